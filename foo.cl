@@ -7,12 +7,96 @@ __attribute__((reqd_work_group_size(WGSZ, 1, 1)))
 void foo
 (
 	uint32_t msk,
+	uint32_t n,
 	__global const uint32_t* __restrict__ src,
 	__global uint32_t* __restrict__ dst
 )
 {
+	// The last work group can hang over the end of the n words.
 	const uint32_t pindex = get_global_id(0);
-	uint32_t s = src[pindex];
-	dst[pindex] = s ^ msk;
+	if (pindex < n)
+	{
+		uint32_t s = src[pindex];
+		dst[pindex] = s ^ msk;
+	}
 }
 
+
+// Same as foo, but every work item does IPT words. They are strided by the
+// global size, so neighbouring work items still access neighbouring words.
+#define FOO_IPT(IPT) \
+__kernel void foo_ipt##IPT \
+( \
+	uint32_t msk, \
+	uint32_t n, \
+	__global const uint32_t* __restrict__ src, \
+	__global uint32_t* __restrict__ dst \
+) \
+{ \
+	const uint32_t stride = get_global_size(0); \
+	uint32_t pindex = get_global_id(0); \
+	for (int i=0; i<IPT && pindex < n; ++i, pindex += stride) \
+		dst[pindex] = src[pindex] ^ msk; \
+}
+
+FOO_IPT(2)
+FOO_IPT(4)
+FOO_IPT(8)
+
+
+// Same as foo, but every work item does a uint4, so that the loads and stores are 16 bytes wide. n is still in
+// words, and a multiple of 4.
+__kernel void foo_vec4
+(
+	uint32_t msk,
+	uint32_t n,
+	__global const uint4* __restrict__ src,
+	__global uint4* __restrict__ dst
+)
+{
+	const uint32_t pindex = get_global_id(0);
+	if (pindex < n / 4)
+		dst[pindex] = src[pindex] ^ msk;
+}
+
+
+// Same as foo_vec4, with IPT of the uint4s per work item, strided like FOO_IPT.
+#define FOO_VEC4_IPT(IPT) \
+__kernel void foo_vec4_ipt##IPT \
+( \
+	uint32_t msk, \
+	uint32_t n, \
+	__global const uint4* __restrict__ src, \
+	__global uint4* __restrict__ dst \
+) \
+{ \
+	const uint32_t stride = get_global_size(0); \
+	uint32_t pindex = get_global_id(0); \
+	for (int i=0; i<IPT && pindex < n / 4; ++i, pindex += stride) \
+		dst[pindex] = src[pindex] ^ msk; \
+}
+
+FOO_VEC4_IPT(2)
+FOO_VEC4_IPT(4)
+
+
+// foo for a batch of small jobs, packed into one dispatch by mvk_batcher. Every job starts on a work group of its
+// own. table holds the job of every group, and from jobs on, a record of 4 words per job: its first word, its
+// number of words, and its msk.
+__kernel
+#if defined(WGSZ)
+__attribute__((reqd_work_group_size(WGSZ, 1, 1)))
+#endif
+void foo_batch
+(
+	uint32_t jobs,
+	__global const uint32_t* __restrict__ table,
+	__global const uint32_t* __restrict__ src,
+	__global uint32_t* __restrict__ dst
+)
+{
+	const uint32_t pindex = get_global_id(0);
+	__global const uint32_t* job = table + jobs + 4 * table[get_group_id(0)];
+	if (pindex - job[0] < job[1])
+		dst[pindex] = src[pindex] ^ job[2];
+}
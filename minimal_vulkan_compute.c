@@ -1,846 +1,1502 @@
+#define _GNU_SOURCE		// for O_DIRECT
 #include <stdio.h>	// for fprintf()
-#include <stdlib.h>	// for getenv()
+#include <stdlib.h>	// for aligned_alloc()
 #include <assert.h>	// for assert()
-#include <string.h>	// for memset()
+#include <string.h>	// for strcmp()
+#include <stdint.h>
+#include <time.h>	// for clock_gettime()
+#include <unistd.h>	// for pread()
+#include <fcntl.h>	// for open()
+#include <errno.h>	// for errno
+#include <sys/stat.h>	// for fstat()
+#include <pthread.h>	// for pthread_create()
 
-#include <vulkan/vulkan.h>
+#include "mvk.h"
 
-#define CHECK_VK(RES) \
-	if (RES != VK_SUCCESS) \
-	{ \
-		fprintf(stderr, "VK FAIL (%d) at %s:%d\n", RES, __FILE__, __LINE__); \
-		assert(RES == VK_SUCCESS); \
-	}
 
-#define LABEL_OBJ(O, TYP, NAM) \
-	if (pfnSetDebugUtilsObjectNameEXT) \
-	{ \
-		const VkDebugUtilsObjectNameInfoEXT ni = \
-		{ \
-			VK_STRUCTURE_TYPE_DEBUG_UTILS_OBJECT_NAME_INFO_EXT, \
-			0, \
-			TYP, \
-			(uint64_t) O, \
-			NAM \
-		}; \
-		const VkResult res_name = pfnSetDebugUtilsObjectNameEXT \
-		( \
-			devi, \
-			&ni \
-		); \
-		CHECK_VK(res_name); \
-	}
+static void report_done(mvk_job_t* job, void* user)
+{
+	(void) job;
+	fprintf(stderr, "Job %s is done.\n", (const char*) user);
+}
 
 
+// Does MVK_VERBOSE ask for the details of where the buffers went?
+static int verbose(void)
+{
+	const char* env = getenv("MVK_VERBOSE");
+	return env && *env;
+}
 
-static VkInstance inst;					// A Vulkan instance.
-static VkPhysicalDevice pdev;				// A physical device.
-static VkPhysicalDeviceProperties dprops;		// The properties of the picked device.
-static VkDevice devi;					// A device.
-static int qfam = -1;					// queue family index.
 
-static uint32_t mtcnt;					// Memory type count
-static uint32_t mhcnt;					// Memory heap count
-static VkPhysicalDeviceMemoryProperties memprops;	// Properties for all memory types
+// Run the kernel once over numwords words of host memory, as a job, and time the dispatch.
+static int run_once(mvk_context_t* ctx, size_t numwords)
+{
+	mvk_module_t* mod = mvk_module_load(ctx, "foo.spirv");
+	if (!mod)
+		return 1;
+	const mvk_kernel_t* foo = mvk_kernel(mod, "foo");
+	assert(foo);
+
+	// Page aligned, so that the device can use the memory as is, if it can import host memory.
+	const size_t bufsz = numwords * sizeof(uint32_t);
+	const size_t allocsz = (bufsz + 4095) / 4096 * 4096;
+	uint32_t* src = aligned_alloc(4096, allocsz);
+	uint32_t* dst = aligned_alloc(4096, allocsz);
+	assert(src && dst);
+	memset(src, 0x55, bufsz);
+	memset(dst, 0x00, bufsz);
+	mvk_buffer_t* buffers[2] =
+	{
+		mvk_buffer_import(ctx, src, bufsz),
+		mvk_buffer_import(ctx, dst, bufsz),
+	};
+	if (verbose())
+		fprintf(stderr, "Buffers are %s.\n", mvk_buffer_is_zero_copy(buffers[0]) ? "zero-copy" : "copies");
+
+	// Push the constant args: the mask, and the number of words.
+	const uint32_t msk = 0xff0000ff;
+	const uint32_t pc[2] = { msk, (uint32_t) numwords };
+	mvk_job_t* job = mvk_submit(ctx, foo, numwords, buffers, 2, pc, sizeof(pc), report_done, "foo");
+	assert(job);
+	const int64_t elapsed_ns = mvk_job_wait(job);
+	mvk_job_release(job);
+	mvk_buffer_pull(buffers[1]);
 
-// Extension func.
-static PFN_vkSetDebugUtilsObjectNameEXT	pfnSetDebugUtilsObjectNameEXT;
+	fprintf(stderr, "Checking results...\n");
+	for (size_t i=0; i<numwords; ++i)
+		assert(dst[i] == 0xaa5555aa);
+	fprintf(stderr, "Results are correct.\n");
+	fprintf(stderr, "elapsed: %ld ns on %s\n", (long) elapsed_ns, mvk_device_name(ctx));
 
+	mvk_buffer_destroy(buffers[0]);
+	mvk_buffer_destroy(buffers[1]);
+	free(src);
+	free(dst);
+	mvk_module_unload(mod);
+	return 0;
+}
 
 
-#pragma mark Buffer creation
+// Run a small graph over numwords words: b = a^m0 and c = b^m1 depend on each other, d = a^m2 does not,
+// and e gets a copy of c. The graph runs d alongside b, and needs barriers only before c and e.
+static int run_graph(mvk_context_t* ctx, size_t numwords)
+{
+	mvk_module_t* mod = mvk_module_load(ctx, "foo.spirv");
+	if (!mod)
+		return 1;
+	const mvk_kernel_t* foo = mvk_kernel(mod, "foo");
+	assert(foo);
+
+	const size_t bufsz = numwords * sizeof(uint32_t);
+	mvk_buffer_t* a = mvk_buffer_create(ctx, bufsz);
+	mvk_buffer_t* b = mvk_buffer_create(ctx, bufsz);
+	mvk_buffer_t* c = mvk_buffer_create(ctx, bufsz);
+	mvk_buffer_t* d = mvk_buffer_create(ctx, bufsz);
+	mvk_buffer_t* e = mvk_buffer_create(ctx, bufsz);
+	uint32_t* data = malloc(bufsz);
+	assert(data);
+	for (size_t i=0; i<numwords; ++i)
+		data[i] = (uint32_t) i;
+	mvk_buffer_write(a, 0, data, bufsz);
+
+	const uint32_t msk[3] = { 0xff0000ff, 0x00ffff00, 0x0f0f0f0f };
+	const uint32_t pc[3][2] = { { msk[0], (uint32_t) numwords }, { msk[1], (uint32_t) numwords }, { msk[2], (uint32_t) numwords } };
+	mvk_buffer_t* ab[2] = { a, b };
+	mvk_buffer_t* bc[2] = { b, c };
+	mvk_buffer_t* ad[2] = { a, d };
+	mvk_graph_t* graph = mvk_graph_create(ctx);
+	mvk_graph_dispatch(graph, foo, numwords, ab, 2, 2, pc[0], sizeof(pc[0]));
+	mvk_graph_dispatch(graph, foo, numwords, bc, 2, 2, pc[1], sizeof(pc[1]));
+	mvk_graph_dispatch(graph, foo, numwords, ad, 2, 2, pc[2], sizeof(pc[2]));
+	mvk_graph_copy(graph, c, 0, e, 0, bufsz);
+	mvk_job_t* job = mvk_graph_submit(graph, report_done, "graph");
+	assert(job);
+	const int64_t elapsed_ns = mvk_job_wait(job);
+	mvk_job_release(job);
 
-// Create a buffer for specified usage, and with specified properties.
-void mk_buffer
-(
-	VkBufferUsageFlags usageFlags,			// How to use buffer?
-	VkMemoryPropertyFlags propFlags,		// Local? Host Visible? Cached? etc.
-	VkDeviceSize sz,				// Size of the buffer.
-	VkBuffer* buff,					// Out: buffer
-	VkDeviceMemory* devmem,				// Out: memory
-	const char* tag					// Debug name
-)
+	fprintf(stderr, "Checking results...\n");
+	mvk_buffer_read(d, 0, data, bufsz);
+	for (size_t i=0; i<numwords; ++i)
+		assert(data[i] == ((uint32_t) i ^ msk[2]));
+	mvk_buffer_read(e, 0, data, bufsz);
+	for (size_t i=0; i<numwords; ++i)
+		assert(data[i] == ((uint32_t) i ^ msk[0] ^ msk[1]));
+	fprintf(stderr, "Results are correct.\n");
+	fprintf(stderr, "elapsed: %ld ns on %s\n", (long) elapsed_ns, mvk_device_name(ctx));
+
+	mvk_graph_destroy(graph);
+	free(data);
+	mvk_buffer_destroy(a);
+	mvk_buffer_destroy(b);
+	mvk_buffer_destroy(c);
+	mvk_buffer_destroy(d);
+	mvk_buffer_destroy(e);
+	mvk_module_unload(mod);
+	return 0;
+}
+
+
+static double now_s(void)
 {
-	// Create the buffer.
-	const VkBufferCreateFlags createFlags = 0;
-	const VkBufferCreateInfo bci =
-	{
-		VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
-		0,					// pNext
-		createFlags,
-		sz,
-		usageFlags,
-		VK_SHARING_MODE_EXCLUSIVE,		// only one queue will use it.
-		0,					// queue family index count.
-		0					// queue family indices.
-	};
-	const VkResult res_crbuf = vkCreateBuffer
-	(
-		devi,
-		&bci,
-		0,
-		buff
-	);
-	CHECK_VK(res_crbuf);
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
 
-	// Check mem requirements for it.
-	VkMemoryRequirements memreqs;
-	vkGetBufferMemoryRequirements(devi, *buff, &memreqs);
-	fprintf
-	(
-		stderr,
-		"reqs: size=%lu align=%lu memtp=0x%x\n",
-		memreqs.size, memreqs.alignment, memreqs.memoryTypeBits
-	);
 
-	// Pick a buffer matching the props
-	int tp = -1;
-	for (uint32_t mt=0; mt<mtcnt; ++mt)
-		if ((memprops.memoryTypes[mt].propertyFlags & propFlags) == propFlags) { tp = mt; break; }
-	if (tp<0)
-	{
-		fprintf(stderr, "Cannot find a memory type that is both device-local and host-visible.\n");
-		assert(tp>=0);
-	}
-	fprintf(stderr, "Using memory type index %d\n", tp);
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
 
-	// TODO: test against mem reqs.
 
-	// Allocate the memory
-	const VkMemoryAllocateInfo mai =
+// Run the primitives of prims.spirv over numwords random words, check them against a loop on the host,
+// and compare their times.
+static int run_prims(mvk_context_t* ctx, size_t numwords)
+{
+	mvk_prims_t* prims = mvk_prims_create(ctx, "prims.spirv");
+	if (!prims)
+		return 1;
+	const size_t bufsz = numwords * sizeof(uint32_t);
+	uint32_t* data = malloc(bufsz);
+	uint32_t* ref = malloc(bufsz);
+	uint32_t* res = malloc(bufsz);
+	assert(data && ref && res);
+	srand(1);
+	for (size_t i=0; i<numwords; ++i)
+		data[i] = (uint32_t) rand();
+	mvk_buffer_t* src = mvk_buffer_create(ctx, bufsz);
+	mvk_buffer_t* dst = mvk_buffer_create(ctx, bufsz);
+	mvk_buffer_write(src, 0, data, bufsz);
+	fprintf(stderr, "%-10s %12s %12s\n", "primitive", "gpu ms", "host ms");
+
+	double t0 = now_s();
+	const int64_t sum = mvk_reduce_add(prims, src, numwords);
+	double t1 = now_s();
+	uint32_t refsum = 0;
+	for (size_t i=0; i<numwords; ++i)
+		refsum += data[i];
+	double t2 = now_s();
+	assert(sum == refsum);
+	fprintf(stderr, "%-10s %12.3f %12.3f\n", "reduce", (t1-t0)*1e3, (t2-t1)*1e3);
+
+	for (int inclusive=0; inclusive<2; ++inclusive)
 	{
-		VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
-		0,
-		memreqs.size,
-		tp
-	};
-	const VkResult res_alloc = vkAllocateMemory
-	(
-		devi,
-		&mai,
-		0,
-		devmem
-	);
-	CHECK_VK(res_alloc);
+		t0 = now_s();
+		const int res_scan = mvk_scan_add(prims, src, dst, numwords, inclusive);
+		assert(res_scan == 0);
+		t1 = now_s();
+		uint32_t acc = 0;
+		for (size_t i=0; i<numwords; ++i)
+		{
+			ref[i] = inclusive ? acc + data[i] : acc;
+			acc += data[i];
+		}
+		t2 = now_s();
+		mvk_buffer_read(dst, 0, res, bufsz);
+		for (size_t i=0; i<numwords; ++i)
+			assert(res[i] == ref[i]);
+		fprintf(stderr, "%-10s %12.3f %12.3f\n", inclusive ? "scan incl" : "scan excl", (t1-t0)*1e3, (t2-t1)*1e3);
+	}
 
-	LABEL_OBJ(*devmem, VK_OBJECT_TYPE_DEVICE_MEMORY, tag);
-	LABEL_OBJ(*buff,   VK_OBJECT_TYPE_BUFFER,        tag);
+	// Keep about one in four.
+	const uint32_t msk = 0x3, cmp = 0x1;
+	t0 = now_s();
+	const int64_t compacted = mvk_compact(prims, src, dst, numwords, msk, cmp);
+	assert(compacted >= 0);
+	const size_t count = (size_t) compacted;
+	t1 = now_s();
+	size_t refcount = 0;
+	for (size_t i=0; i<numwords; ++i)
+		if ((data[i] & msk) == cmp)
+			ref[refcount++] = data[i];
+	t2 = now_s();
+	assert(count == refcount);
+	mvk_buffer_read(dst, 0, res, count * sizeof(uint32_t));
+	for (size_t i=0; i<count; ++i)
+		assert(res[i] == ref[i]);
+	fprintf(stderr, "%-10s %12.3f %12.3f\n", "compact", (t1-t0)*1e3, (t2-t1)*1e3);
+	fprintf(stderr, "Results of %zu words are correct.\n", numwords);
+
+	mvk_buffer_destroy(src);
+	mvk_buffer_destroy(dst);
+	free(data);
+	free(ref);
+	free(res);
+	mvk_prims_destroy(prims);
+	return 0;
 }
 
-#pragma mark Shader module
 
-#define MAXSHADERSZ 4096
-static uint32_t shader[MAXSHADERSZ];
+static void count_done(void* user)
+{
+	(*(size_t*) user)++;
+}
 
-static VkShaderModule mk_shader(const char* spirv_fname)
+
+// Run numjobs small jobs of 1 to 8 KiB, first each with a submit of its own, and then coalesced by a batcher
+// into batches of up to maxbatch jobs, that wait no longer than maxlatency us. Checks both, and compares their rates.
+static int run_coalesce(mvk_context_t* ctx, size_t numjobs, uint32_t maxbatch, int64_t maxlatency)
 {
-	FILE* f = fopen(spirv_fname, "rb");
-	if (!f)
-		fprintf(stderr,"Failed to open %s for reading.\n", spirv_fname);
-	assert(f);
-	const uint16_t shader_sz = (uint16_t) fread(shader, sizeof(uint32_t), MAXSHADERSZ, f);
-	assert(shader_sz);
+	mvk_module_t* mod = mvk_module_load(ctx, "foo.spirv");
+	if (!mod)
+		return 1;
+	const mvk_kernel_t* foo = mvk_kernel(mod, "foo");
+	const mvk_kernel_t* foo_batch = mvk_kernel(mod, "foo_batch");
+	assert(foo);
+	if (!foo_batch)
+	{
+		fprintf(stderr, "Rebuild foo.spirv for foo_batch.\n");
+		mvk_module_unload(mod);
+		return 1;
+	}
+	const size_t maxwords = 2048;
+	size_t* first = malloc((numjobs + 1) * sizeof(size_t));
+	assert(first);
+	srand(1);
+	first[0] = 0;
+	for (size_t i=0; i<numjobs; ++i)
+		first[i+1] = first[i] + 256 + rand() % (maxwords - 255);
+	const size_t totalwords = first[numjobs];
+	uint32_t* src = malloc(totalwords * sizeof(uint32_t));
+	uint32_t* dst = malloc(totalwords * sizeof(uint32_t));
+	assert(src && dst);
+	for (size_t i=0; i<totalwords; ++i)
+		src[i] = (uint32_t) i;
+
+	// A submit and wait per job.
+	mvk_buffer_t* buffers[2] = { mvk_buffer_create(ctx, maxwords * sizeof(uint32_t)), mvk_buffer_create(ctx, maxwords * sizeof(uint32_t)) };
+	memset(dst, 0, totalwords * sizeof(uint32_t));
+	double t0 = now_s();
+	for (size_t i=0; i<numjobs; ++i)
+	{
+		const size_t n = first[i+1] - first[i];
+		const uint32_t pc[2] = { (uint32_t) i, (uint32_t) n };
+		mvk_buffer_write(buffers[0], 0, src + first[i], n * sizeof(uint32_t));
+		mvk_job_t* job = mvk_submit(ctx, foo, n, buffers, 2, pc, sizeof(pc), 0, 0);
+		assert(job);
+		mvk_job_wait(job);
+		mvk_job_release(job);
+		mvk_buffer_read(buffers[1], 0, dst + first[i], n * sizeof(uint32_t));
+	}
+	const double single_s = now_s() - t0;
+	for (size_t i=0; i<numjobs; ++i)
+		for (size_t w=first[i]; w<first[i+1]; ++w)
+			assert(dst[w] == (src[w] ^ (uint32_t) i));
+	mvk_buffer_destroy(buffers[0]);
+	mvk_buffer_destroy(buffers[1]);
+
+	// The same jobs, coalesced.
+	mvk_batcher_t* batcher = mvk_batcher_create(ctx, foo_batch, 4 << 20, maxbatch, maxlatency * 1000);
+	assert(batcher);
+	memset(dst, 0, totalwords * sizeof(uint32_t));
+	size_t numdone = 0;
+	t0 = now_s();
+	for (size_t i=0; i<numjobs; ++i)
+	{
+		const int res_add = mvk_batcher_add(batcher, src + first[i], dst + first[i], first[i+1] - first[i], (uint32_t) i, count_done, &numdone);
+		assert(res_add == 0);
+	}
+	mvk_batcher_flush(batcher);
+	const double batched_s = now_s() - t0;
+	assert(numdone == numjobs);
+	for (size_t i=0; i<numjobs; ++i)
+		for (size_t w=first[i]; w<first[i+1]; ++w)
+			assert(dst[w] == (src[w] ^ (uint32_t) i));
+	fprintf(stderr, "Results are correct.\n");
+	uint64_t batchedjobs, numbatches;
+	mvk_batcher_stats(batcher, &batchedjobs, &numbatches);
+	fprintf(stderr, "Batcher ran %lu jobs in %lu batches.\n", (unsigned long) batchedjobs, (unsigned long) numbatches);
+	mvk_batcher_destroy(batcher);
+	fprintf(stderr, "%zu jobs of %zu KiB on average\n", numjobs, totalwords * sizeof(uint32_t) / numjobs >> 10);
+	fprintf(stderr, "single : %.3f s, %.0f jobs/s\n", single_s, numjobs / single_s);
+	fprintf(stderr, "batched: %.3f s, %.0f jobs/s\n", batched_s, numjobs / batched_s);
+
+	free(first);
+	free(src);
+	free(dst);
+	mvk_module_unload(mod);
+	return 0;
+}
+
 
-	// Create the shader module
-	VkShaderModuleCreateInfo smci =
+// Change numpages random pages of the source between updates, and bring the destination up to date, first with a
+// whole push, dispatch and pull, and then with only the dirty ranges. Checks both, and compares their times.
+static int run_dirty(mvk_context_t* ctx, size_t numwords, size_t numpages)
+{
+	mvk_module_t* mod = mvk_module_load(ctx, "foo.spirv");
+	if (!mod)
+		return 1;
+	const mvk_kernel_t* foo = mvk_kernel(mod, "foo");
+	assert(foo);
+
+	const size_t pagesz = 4096;
+	const size_t bufsz = numwords * sizeof(uint32_t);
+	const size_t allocsz = (bufsz + pagesz - 1) / pagesz * pagesz;
+	const size_t totalpages = allocsz / pagesz;
+	uint32_t* src = aligned_alloc(pagesz, allocsz);
+	uint32_t* dst = aligned_alloc(pagesz, allocsz);
+	assert(src && dst);
+	for (size_t i=0; i<numwords; ++i)
+		src[i] = (uint32_t) i;
+	mvk_buffer_t* buffers[2] =
 	{
-		VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
-		0,
-		0,
-		shader_sz * sizeof(uint32_t),
-		shader
+		mvk_buffer_import(ctx, src, bufsz),
+		mvk_buffer_import(ctx, dst, bufsz),
 	};
-	VkShaderModule shader_module;
-	const VkResult res_csm = vkCreateShaderModule(devi, &smci, 0, &shader_module);
-	CHECK_VK(res_csm);
-	return shader_module;
+	if (verbose())
+		fprintf(stderr, "Buffers are %s.\n", mvk_buffer_is_zero_copy(buffers[0]) ? "zero-copy" : "copies");
+	const uint32_t msk = 0xff0000ff;
+	const uint32_t pc[2] = { msk, (uint32_t) numwords };
+	mvk_buffer_push(buffers[0]);
+	mvk_job_t* job = mvk_submit(ctx, foo, numwords, buffers, 2, pc, sizeof(pc), 0, 0);
+	assert(job);
+	mvk_job_wait(job);
+	mvk_job_release(job);
+	mvk_buffer_pull(buffers[1]);
+
+	const int numupdates = 20;
+	double elapsed_s[2] = { 0, 0 };
+	size_t pulled = 0;
+	srand(1);
+	for (int dirty=0; dirty<2; ++dirty)
+		for (int u=0; u<numupdates; ++u)
+		{
+			for (size_t p=0; p<numpages; ++p)
+			{
+				const size_t page = rand() % totalpages;
+				const size_t first = page * pagesz / sizeof(uint32_t);
+				const size_t last = first + pagesz / sizeof(uint32_t) < numwords ? first + pagesz / sizeof(uint32_t) : numwords;
+				for (size_t i=first; i<last; ++i)
+					src[i] += (uint32_t) u + 1;
+				mvk_buffer_mark_dirty(buffers[0], first * sizeof(uint32_t), (last - first) * sizeof(uint32_t));
+			}
+			const double t0 = now_s();
+			if (dirty)
+			{
+				mvk_buffer_push_dirty(buffers[0]);
+				job = mvk_submit_dirty(ctx, foo, numwords, buffers, 2, pc, sizeof(pc), 0, 0);
+			}
+			else
+			{
+				mvk_buffer_push(buffers[0]);
+				job = mvk_submit(ctx, foo, numwords, buffers, 2, pc, sizeof(pc), 0, 0);
+			}
+			assert(job);
+			mvk_job_wait(job);
+			mvk_job_release(job);
+			if (dirty)
+			{
+				pulled += mvk_buffer_dirty_size(buffers[1]);
+				mvk_buffer_pull_dirty(buffers[1]);
+			}
+			else
+				mvk_buffer_pull(buffers[1]);
+			elapsed_s[dirty] += now_s() - t0;
+			mvk_buffer_clean(buffers[0]);
+			mvk_buffer_clean(buffers[1]);
+			for (size_t i=0; i<numwords; ++i)
+				assert(dst[i] == (src[i] ^ msk));
+		}
+	fprintf(stderr, "Results are correct.\n");
+	fprintf(stderr, "%zu of %zu pages change per update\n", numpages, totalpages);
+	fprintf(stderr, "whole: %.3f ms per update\n", elapsed_s[0] * 1e3 / numupdates);
+	fprintf(stderr, "dirty: %.3f ms per update, %zu KiB pulled\n", elapsed_s[1] * 1e3 / numupdates, pulled / numupdates >> 10);
+
+	mvk_buffer_destroy(buffers[0]);
+	mvk_buffer_destroy(buffers[1]);
+	free(src);
+	free(dst);
+	mvk_module_unload(mod);
+	return 0;
 }
 
-#pragma mark Device selection
 
-static void pick_device(void)
+static int cmp_words(const void* a, const void* b)
 {
-	// Check instance layers
-	uint32_t layerCount=16;
-	VkLayerProperties layerProps[layerCount];
-	const VkResult res_eilp = vkEnumerateInstanceLayerProperties(&layerCount, layerProps);
-	CHECK_VK(res_eilp);
+	const uint32_t x = *(const uint32_t*) a;
+	const uint32_t y = *(const uint32_t*) b;
+	return x < y ? -1 : x > y;
+}
+
 
-	int foundLayer0 = 0;
-	int foundLayer1 = 0;
-	for (uint32_t i=0; i<layerCount; ++i)
+// Sort random keys, and random keys with their index as value, on the device, from 1000 words up to maxwords
+// words, 10x at a time. Checks them against qsort() on the host, and compares their times.
+static int run_sort(mvk_context_t* ctx, size_t maxwords)
+{
+	mvk_prims_t* prims = mvk_prims_create(ctx, "prims.spirv");
+	if (!prims)
+		return 1;
+	fprintf(stderr, "%12s %12s %12s %12s\n", "words", "keys ms", "pairs ms", "qsort ms");
+	srand(1);
+	for (size_t numwords=1000; numwords<=maxwords; numwords*=10)
 	{
-		VkLayerProperties prop = layerProps[i];
-		//fprintf(stderr,"layer: %s\n", prop.layerName);
-		if (strcmp("VK_LAYER_LUNARG_standard_validation", prop.layerName) == 0)
+		const size_t bufsz = numwords * sizeof(uint32_t);
+		uint32_t* data = malloc(bufsz);
+		uint32_t* ref = malloc(bufsz);
+		uint32_t* res = malloc(bufsz);
+		uint32_t* idx = malloc(bufsz);
+		assert(data && ref && res && idx);
+		for (size_t i=0; i<numwords; ++i)
 		{
-			foundLayer0 = 1;
-			break;
+			data[i] = ((uint32_t) rand() << 16) ^ (uint32_t) rand();
+			idx[i] = (uint32_t) i;
 		}
-		if (strcmp("VK_LAYER_KHRONOS_validation", prop.layerName) == 0) 
+		mvk_buffer_t* keys = mvk_buffer_create(ctx, bufsz);
+		mvk_buffer_t* vals = mvk_buffer_create(ctx, bufsz);
+
+		mvk_buffer_write(keys, 0, data, bufsz);
+		double t0 = now_s();
+		const int res_keys = mvk_sort(prims, keys, 0, numwords);
+		assert(res_keys == 0);
+		const double keys_s = now_s() - t0;
+		mvk_buffer_read(keys, 0, res, bufsz);
+
+		memcpy(ref, data, bufsz);
+		t0 = now_s();
+		qsort(ref, numwords, sizeof(uint32_t), cmp_words);
+		const double qsort_s = now_s() - t0;
+		assert(!memcmp(res, ref, bufsz));
+
+		mvk_buffer_write(keys, 0, data, bufsz);
+		mvk_buffer_write(vals, 0, idx, bufsz);
+		t0 = now_s();
+		const int res_pairs = mvk_sort(prims, keys, vals, numwords);
+		assert(res_pairs == 0);
+		const double pairs_s = now_s() - t0;
+		mvk_buffer_read(keys, 0, res, bufsz);
+		mvk_buffer_read(vals, 0, idx, bufsz);
+		assert(!memcmp(res, ref, bufsz));
+		// Every value is the index of its key, and equal keys keep their order.
+		for (size_t i=0; i<numwords; ++i)
 		{
-			foundLayer1 = 1;
-			break;
+			assert(data[idx[i]] == res[i]);
+			assert(i == 0 || res[i-1] != res[i] || idx[i-1] < idx[i]);
 		}
+		fprintf(stderr, "%12zu %12.3f %12.3f %12.3f\n", numwords, keys_s*1e3, pairs_s*1e3, qsort_s*1e3);
+
+		mvk_buffer_destroy(keys);
+		mvk_buffer_destroy(vals);
+		free(data);
+		free(ref);
+		free(res);
+		free(idx);
 	}
-	const char* layerName = foundLayer1 ? 
-		"VK_LAYER_KHRONOS_validation" :
-		"VK_LAYER_LUNARG_standard_validation";
-
-	// Check the extensions
-	uint32_t extCount = 32;
-	VkExtensionProperties extProps[extCount];
-	const VkResult res_eisp = vkEnumerateInstanceExtensionProperties
+	fprintf(stderr, "Results are correct.\n");
+	mvk_prims_destroy(prims);
+	return 0;
+}
+
+
+static void fill_chunk(void* user, size_t firstword, uint32_t* data, size_t numwords)
+{
+	(void) user;
+	for (size_t i=0; i<numwords; ++i)
+		data[i] = (uint32_t) (firstword + i);
+}
+
+
+static void check_chunk(void* user, size_t firstword, uint32_t* data, size_t numwords)
+{
+	const uint32_t msk = *(const uint32_t*) user;
+	for (size_t i=0; i<numwords; ++i)
+		if (data[i] != ((uint32_t) (firstword + i) ^ msk))
+		{
+			fprintf(stderr, "Word %zu is 0x%08x, expected 0x%08x\n", firstword + i, data[i], (uint32_t) (firstword + i) ^ msk);
+			assert(0);
+		}
+}
+
+
+// Stream a generated pattern of total bytes through the kernel, chunksz at a time, with numslots chunks in flight,
+// and check what comes back.
+static int run_stream(mvk_context_t* ctx, size_t total, size_t chunksz, uint32_t numslots)
+{
+	mvk_module_t* mod = mvk_module_load(ctx, "foo.spirv");
+	if (!mod)
+		return 1;
+	const mvk_kernel_t* foo = mvk_kernel(mod, "foo");
+	assert(foo);
+	uint32_t msk = 0xff0000ff;
+	const uint32_t pc[2] = { msk, (uint32_t) (chunksz / sizeof(uint32_t)) };
+	fprintf(stderr, "Streaming %zu MiB in chunks of %zu KiB, using %u slots.\n", total>>20, chunksz>>10, numslots);
+	int64_t hostns;
+	const int64_t elapsed = mvk_stream(ctx, foo, total / sizeof(uint32_t), chunksz / sizeof(uint32_t), numslots, pc, sizeof(pc), fill_chunk, check_chunk, &msk, &hostns);
+	mvk_module_unload(mod);
+	if (elapsed < 0)
+		return 1;
+	fprintf
 	(
-	 	0,		// layer to retrieve extensions from
-		&extCount,
-		extProps
+		stderr,
+		"Streamed %zu MiB in %.3f s: %.3f GB/s sustained (host fill+check took %.3f s).\n",
+		total>>20,
+		elapsed * 1e-9,
+		total / (double) elapsed,
+		hostns * 1e-9
 	);
-	CHECK_VK(res_eisp);
-	int foundExt = 0;
-	for (uint32_t i=0; i<extCount; ++i)
-	{
-		const char* ename = extProps[i].extensionName;
-		//fprintf(stderr,"Extension %s\n", ename);
-		if (!strcmp(ename, "VK_EXT_debug_report"))
-			foundExt = 1;
-	}
-	assert(foundExt);
-	const char* extNames[2] =
+	return 0;
+}
+
+
+#define BATCH_MAXNODES	32	// The most dispatches that a graph holds.
+
+// Ping-pong between two buffers with many small dispatches, once with a submit and wait per dispatch, and once
+// with a graph of batchsz dispatches per submit. Two of those jobs are in flight at once, so that recording one
+// overlaps the execution of the other.
+static int run_batch(mvk_context_t* ctx, uint32_t numdispatches, uint32_t batchsz)
+{
+	mvk_module_t* mod = mvk_module_load(ctx, "foo.spirv");
+	if (!mod)
+		return 1;
+	const mvk_kernel_t* foo = mvk_kernel(mod, "foo");
+	assert(foo);
+	const size_t bufsz = 64*1024;
+	const size_t numwords = bufsz / sizeof(uint32_t);
+	if (batchsz < 2 || batchsz > BATCH_MAXNODES)
+		batchsz = BATCH_MAXNODES;
+	batchsz &= ~1U;		// Even, so that every graph ends up in buffer a.
+	numdispatches = numdispatches / batchsz * batchsz;
+	mvk_buffer_t* a = mvk_buffer_create(ctx, bufsz);
+	mvk_buffer_t* b = mvk_buffer_create(ctx, bufsz);
+	uint32_t* hostdata = malloc(bufsz);
+	assert(hostdata);
+	for (size_t i=0; i<numwords; ++i)
+		hostdata[i] = (uint32_t) i;
+	mvk_buffer_write(a, 0, hostdata, bufsz);
+	mvk_buffer_t* ab[2] = { a, b };
+	mvk_buffer_t* ba[2] = { b, a };
+	const uint32_t msk[2] = { 0x0000ffff, 0xff000000 };
+	const uint32_t pc[2][2] = { { msk[0], (uint32_t) numwords }, { msk[1], (uint32_t) numwords } };
+	uint32_t expected = 0;	// Every a->b->a pair applies both masks.
+
+	// One submit, and one wait, per dispatch.
+	int64_t t0 = now_ns();
+	for (uint32_t i=0; i<numdispatches; ++i)
 	{
-		"VK_EXT_debug_report",
-		"VK_EXT_debug_utils",
-	};
+		mvk_job_t* job = mvk_submit(ctx, foo, numwords, (i&1) ? ba : ab, 2, pc[i&1], sizeof(pc[0]), 0, 0);
+		assert(job);
+		mvk_job_wait(job);
+		mvk_job_release(job);
+	}
+	const int64_t singlens = now_ns() - t0;
+	if (numdispatches/2 & 1)
+		expected ^= msk[0] ^ msk[1];
 
-	// Get an instance
-	const VkApplicationInfo ai =
+	// Many dispatches per submit, and one wait per graph.
+	mvk_graph_t* graph = mvk_graph_create(ctx);
+	for (uint32_t i=0; i<batchsz; ++i)
 	{
-		VK_STRUCTURE_TYPE_APPLICATION_INFO,
-		0,
-		"vkt",
-		0,
-		"",
-		0,
-		VK_MAKE_VERSION(1,3,238)
-	};
-	const VkInstanceCreateInfo ici =
-	{
-		VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
-		0,			// next
-		0,			// flags
-		&ai,			// application info
-		1,			// enabled layer count
-		&layerName,		// enabled layer names
-		2,			// enabled extension count
-		extNames		// enabled extension names
-	};
-	const VkResult res_ci = vkCreateInstance
+		const int node = mvk_graph_dispatch(graph, foo, numwords, (i&1) ? ba : ab, 2, 2, pc[i&1], sizeof(pc[0]));
+		assert(node >= 0);
+	}
+	mvk_job_t* jobs[2] = { 0, 0 };
+	t0 = now_ns();
+	for (uint32_t i=0; i<numdispatches/batchsz; ++i)
+	{
+		if (jobs[i&1])
+		{
+			mvk_job_wait(jobs[i&1]);
+			mvk_job_release(jobs[i&1]);
+		}
+		jobs[i&1] = mvk_graph_submit(graph, 0, 0);
+		assert(jobs[i&1]);
+	}
+	for (int j=0; j<2; ++j)
+		if (jobs[j])
+		{
+			mvk_job_wait(jobs[j]);
+			mvk_job_release(jobs[j]);
+		}
+	const int64_t batchns = now_ns() - t0;
+	if (numdispatches/2 & 1)
+		expected ^= msk[0] ^ msk[1];
+
+	mvk_buffer_read(a, 0, hostdata, bufsz);
+	for (size_t i=0; i<numwords; ++i)
+		if (hostdata[i] != ((uint32_t) i ^ expected))
+		{
+			fprintf(stderr, "Word %zu is 0x%08x, expected 0x%08x\n", i, hostdata[i], (uint32_t) i ^ expected);
+			assert(0);
+		}
+	fprintf(stderr, "Results are correct.\n");
+	fprintf
 	(
-		&ici,
-		0,
-		&inst
+		stderr,
+		"%u dispatches: %.2f us each with a submit per dispatch, %.2f us each with %u per submit (%.1fx).\n",
+		numdispatches,
+		singlens * 1e-3 / numdispatches,
+		batchns * 1e-3 / numdispatches,
+		batchsz,
+		singlens / (double) batchns
 	);
-	CHECK_VK(res_ci);
-
-	// Enumerate devices, and pick one.
-	uint32_t dev_count = 64;
-	VkPhysicalDevice devices[dev_count];
-	VkPhysicalDeviceProperties devprops[dev_count];
-	VkPhysicalDeviceFeatures2 devfeats[dev_count];
-	VkPhysicalDeviceVulkan12Features v12feats[dev_count];
-	const VkResult res_enum = vkEnumeratePhysicalDevices(inst, &dev_count, devices);
-	CHECK_VK(res_enum);
-	fprintf(stderr, "Found %d physical devices.\n", dev_count);
-	if (!dev_count) exit(2);
-	const char* devtypenames[] =
-	{
-		"OTHER",
-		"iGPU",
-		"dGPU",
-		"vGPU",
-		"CPU",
-		0,
-	};
-	int num_igpu = 0;
-	int num_dgpu = 0;
-	int num_cpu  = 0;
-	for (uint32_t dnr=0; dnr<dev_count; ++dnr)
-	{
-		VkPhysicalDevice* device = devices + dnr;
-		vkGetPhysicalDeviceProperties(devices[dnr], devprops+dnr);
-		num_igpu += (devprops[dnr].deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU);
-		num_dgpu += (devprops[dnr].deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU);
-		num_cpu  += (devprops[dnr].deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU);
-		const char* tnam = devtypenames[devprops[dnr].deviceType];
-                v12feats[dnr].sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
-                v12feats[dnr].pNext = 0;
-                devfeats[dnr].sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
-                devfeats[dnr].pNext = v12feats+dnr;
-                vkGetPhysicalDeviceFeatures2(devices[dnr], devfeats+dnr);
-                assert(devfeats[dnr].sType == VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2);
-                const int has_i8  = v12feats[dnr].shaderInt8;
-                const int has_f16 = v12feats[dnr].shaderFloat16;
-                fprintf(stderr,"%4s %-44s (i8:%c f16:%c)\n", tnam, devprops[dnr].deviceName, has_i8?'Y':'N', has_f16?'Y':'N');
 
+	mvk_graph_destroy(graph);
+	free(hostdata);
+	mvk_buffer_destroy(a);
+	mvk_buffer_destroy(b);
+	mvk_module_unload(mod);
+	return 0;
+}
+
+
+static int cmp_i64(const void* a, const void* b)
+{
+	const int64_t x = *(const int64_t*) a;
+	const int64_t y = *(const int64_t*) b;
+	return x < y ? -1 : x > y;
+}
+
+
+// Nearest rank percentile of n sorted values.
+static int64_t percentile(const int64_t* sorted, uint32_t n, double p)
+{
+	uint32_t rank = (uint32_t) (p * n + 0.999999);
+	if (rank < 1)
+		rank = 1;
+	return sorted[rank-1];
+}
+
+
+static void print_json_string(const char* str)
+{
+	putchar('"');
+	for (const char* c=str; *c; ++c)
+		if (*c == '"' || *c == '\\')
+			printf("\\%c", *c);
+		else if ((unsigned char) *c < 0x20)
+			printf("\\u%04x", *c);
+		else
+			putchar(*c);
+	putchar('"');
+}
+
+
+#define BENCH_WARMUP	3	// Runs that do not count, per size.
+
+// Run the kernel over buffers from minsz to maxsz, growing 4x at a time, reps times each after a warm-up.
+// Writes GPU time percentiles, wall time per job and effective bandwidth to stdout, as JSON or CSV.
+static int run_bench(mvk_context_t* ctx, int csv, size_t minsz, size_t maxsz, uint32_t reps)
+{
+	mvk_module_t* mod = mvk_module_load(ctx, "foo.spirv");
+	if (!mod)
+		return 1;
+	const mvk_kernel_t* foo = mvk_kernel(mod, "foo");
+	assert(foo);
+	const uint32_t msk = 0xff0000ff;
+	const char* devname = mvk_device_name(ctx);
+	const char* name = mvk_kernel_name(foo);
+	if (reps < 1)
+		reps = 1;
+	int64_t* gpuns  = malloc(reps * sizeof(int64_t));
+	int64_t* wallns = malloc(reps * sizeof(int64_t));
+	assert(gpuns && wallns);
+
+	if (csv)
+		printf("device,kernel,wgsz,bytes,reps,gpu_min_us,gpu_median_us,gpu_p99_us,wall_median_us,wall_p99_us,gbps\n");
+	else
+	{
+		printf("{\n\t\"device\": ");
+		print_json_string(devname);
+		printf(",\n\t\"kernel\": ");
+		print_json_string(name);
+		printf(",\n\t\"wgsz\": %u,\n\t\"results\": [", mvk_kernel_wgsz(foo));
 	}
+	int first = 1;
+	for (size_t sz = (minsz + 3) / 4 * 4; sz && sz <= maxsz; sz *= 4)
+	{
+		mvk_buffer_t* buffers[2] = { mvk_buffer_create(ctx, sz), mvk_buffer_create(ctx, sz) };
+		for (int32_t r=-BENCH_WARMUP; r<(int32_t) reps; ++r)
+		{
+			const int64_t t0 = now_ns();
+			const uint32_t pc[2] = { msk, (uint32_t) (sz / sizeof(uint32_t)) };
+			mvk_job_t* job = mvk_submit(ctx, foo, sz / sizeof(uint32_t), buffers, 2, pc, sizeof(pc), 0, 0);
+			assert(job);
+			const int64_t ns = mvk_job_wait(job);
+			const int64_t t1 = now_ns();
+			mvk_job_release(job);
+			if (r < 0)
+				continue;
+			gpuns[r] = ns;
+			wallns[r] = t1 - t0;
+		}
+		mvk_buffer_destroy(buffers[0]);
+		mvk_buffer_destroy(buffers[1]);
+		qsort(gpuns, reps, sizeof(int64_t), cmp_i64);
+		qsort(wallns, reps, sizeof(int64_t), cmp_i64);
+		const int64_t med = percentile(gpuns, reps, 0.5);
+		// The kernel reads sz bytes, and writes sz bytes.
+		const double gbps = med > 0 ? 2.0 * sz / med : 0.0;
+		if (csv)
+		{
+			printf("\"%s\",%s,%u,%zu,%u,", devname, name, mvk_kernel_wgsz(foo), sz, reps);
+			printf("%.3f,%.3f,%.3f,", gpuns[0] * 1e-3, med * 1e-3, percentile(gpuns, reps, 0.99) * 1e-3);
+			printf("%.3f,%.3f,%.3f\n", percentile(wallns, reps, 0.5) * 1e-3, percentile(wallns, reps, 0.99) * 1e-3, gbps);
+		}
+		else
+		{
+			printf("%s\n\t\t{ \"bytes\": %zu, \"reps\": %u, ", first ? "" : ",", sz, reps);
+			printf("\"gpu_min_us\": %.3f, \"gpu_median_us\": %.3f, \"gpu_p99_us\": %.3f, ", gpuns[0] * 1e-3, med * 1e-3, percentile(gpuns, reps, 0.99) * 1e-3);
+			printf("\"wall_median_us\": %.3f, \"wall_p99_us\": %.3f, \"gbps\": %.3f }", percentile(wallns, reps, 0.5) * 1e-3, percentile(wallns, reps, 0.99) * 1e-3, gbps);
+		}
+		fflush(stdout);
+		fprintf(stderr, "%8zu KiB: %10.1f us median on the GPU, %.3f GB/s\n", sz>>10, med * 1e-3, gbps);
+		first = 0;
+	}
+	if (!csv)
+		printf("\n\t]\n}\n");
 
-	int selnr = -1;
-	const char* prefer_dgpu = getenv("MVK_PREFER_DGPU");
-	const char* prefer_igpu = getenv("MVK_PREFER_IGPU");
-	const char* prefer_cpu  = getenv("MVK_PREFER_CPU");
-	const int skip_dgpu = (num_igpu && prefer_igpu) || (num_cpu  && prefer_cpu );
-	const int skip_igpu = (num_dgpu && prefer_dgpu) || (num_cpu  && prefer_cpu );
-	const int skip_cpu  = (num_igpu && prefer_igpu) || (num_dgpu && prefer_dgpu);
-	if (num_dgpu && !skip_dgpu)
-		for (uint32_t i=0; i<dev_count; ++i)
-			if (devprops[i].deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) { selnr=i; break; }
-	if (num_igpu && !skip_igpu && selnr<0)
-		for (uint32_t i=0; i<dev_count; ++i)
-			if (devprops[i].deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU) { selnr=i; break; }
-	if (num_cpu && !skip_cpu && selnr<0)
-		for (uint32_t i=0; i<dev_count; ++i)
-			if (devprops[i].deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU) { selnr=i; break; }
-	if (selnr<0)
-		selnr = 0;
-	const char* device_name = devprops[selnr].deviceName;
-	fprintf(stderr, "Using %s\n", device_name);
-	pdev = devices[selnr];
-	dprops = devprops[selnr];
-
-	// Find queue fam.
-	uint32_t fam_count = 16;
-	VkQueueFamilyProperties famprops[fam_count];
-	vkGetPhysicalDeviceQueueFamilyProperties(pdev, &fam_count, famprops);
-	for (uint32_t fa=0; fa<fam_count; ++fa)
-		if (famprops[fa].queueFlags & VK_QUEUE_COMPUTE_BIT )
-			if (famprops[fa].queueFlags & VK_QUEUE_TRANSFER_BIT)
-			{
-				qfam = fa;
-				break;
-			}
-	assert(qfam>=0);
-
-	// Create a device
-	const float queue_prio = 1.0f;
-	const VkDeviceQueueCreateInfo dqci =
-	{
-		VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO,
-		0,					// next
-		0,					// flags
-		qfam,					// family idx
-		1,					// queue count
-		&queue_prio				// priority 0..1
-	};
-	const VkDeviceCreateInfo dci =
-	{
-		VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
-		0,					// next
-		0,					// flags
-		1,					// dqci count
-		&dqci,					// dqci
-		0,					// layer count
-		0,					// layers
-		0,					// extension count
-		0,					// extensions
-		0					// features
-	};
-	const VkResult res_cd = vkCreateDevice
-	(
-		pdev,
-		&dci,
-		0,					// allocator
-		&devi
-	);
-	CHECK_VK(res_cd);
-	pfnSetDebugUtilsObjectNameEXT = (PFN_vkSetDebugUtilsObjectNameEXT)vkGetInstanceProcAddr
-	(
-		inst,
-		"vkSetDebugUtilsObjectNameEXT"
-	);
-	LABEL_OBJ(devi, VK_OBJECT_TYPE_DEVICE, device_name);
+	free(gpuns);
+	free(wallns);
+	mvk_module_unload(mod);
+	return 0;
 }
 
 
-#pragma mark memory types
+#define MAXTHREADS	16
 
-static void list_memory_types(void)
+// A thread that does small jobs on a shared context, and times them.
+typedef struct
 {
-	// Examine the memory types.
-	vkGetPhysicalDeviceMemoryProperties(pdev, &memprops);
-	mtcnt = memprops.memoryTypeCount;
-	mhcnt = memprops.memoryHeapCount;
-	fprintf(stderr, "%d mem types (%d mem heaps)\n", mtcnt, mhcnt);
-	for (uint32_t mt=0; mt<mtcnt; ++mt)
+	mvk_context_t* ctx;
+	const mvk_kernel_t* kernel;
+	uint32_t numdispatches;
+	int64_t ns;			// Time it took to do its dispatches.
+} threadjob_t;
+
+
+static void* threads_worker(void* arg)
+{
+	threadjob_t* j = arg;
+	const size_t bufsz = 64*1024;
+	const size_t numwords = bufsz / sizeof(uint32_t);
+	mvk_buffer_t* a = mvk_buffer_create(j->ctx, bufsz);
+	mvk_buffer_t* b = mvk_buffer_create(j->ctx, bufsz);
+	uint32_t* hostdata = malloc(bufsz);
+	assert(hostdata);
+	for (size_t i=0; i<numwords; ++i)
+		hostdata[i] = (uint32_t) i;
+	mvk_buffer_write(a, 0, hostdata, bufsz);
+
+	// Ping-pong between a and b, and wait for every dispatch, as a latency-sensitive job would.
+	mvk_buffer_t* ab[2] = { a, b };
+	mvk_buffer_t* ba[2] = { b, a };
+	const uint32_t msk[2] = { 0x0000ffff, 0xff000000 };
+	const uint32_t pc[2][2] = { { msk[0], (uint32_t) numwords }, { msk[1], (uint32_t) numwords } };
+	const int64_t t0 = now_ns();
+	for (uint32_t i=0; i<j->numdispatches; ++i)
 	{
-		const uint32_t hidx = memprops.memoryTypes[mt].heapIndex;
-		const VkMemoryPropertyFlags fl = memprops.memoryTypes[mt].propertyFlags;
-		const VkDeviceSize sz = memprops.memoryHeaps[hidx].size;
-		const VkMemoryHeapFlags mhf = memprops.memoryHeaps[hidx].flags;
-		fprintf
-		(
-			stderr,
-			"%7zu MiB of %s memory [ %s%s%s%s]\n",
-			sz / (1024*1024),
-			mhf & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT ? "local" : "non-local",
-			fl & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT ? "device-local " : "",
-			fl & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT ? "host-visible " : "",
-			fl & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT ? "host-coherent " : "",
-			fl & VK_MEMORY_PROPERTY_HOST_CACHED_BIT ? "host-cached " : ""
-		);
+		mvk_job_t* job = mvk_submit(j->ctx, j->kernel, numwords, (i&1) ? ba : ab, 2, pc[i&1], sizeof(pc[0]), 0, 0);
+		assert(job);
+		mvk_job_wait(job);
+		mvk_job_release(job);
 	}
+	j->ns = now_ns() - t0;
+
+	mvk_buffer_read(a, 0, hostdata, bufsz);
+	const uint32_t expected = (j->numdispatches/2 & 1) ? msk[0] ^ msk[1] : 0;
+	for (size_t i=0; i<numwords; ++i)
+		assert(hostdata[i] == ((uint32_t) i ^ expected));
+
+	free(hostdata);
+	mvk_buffer_destroy(a);
+	mvk_buffer_destroy(b);
+	return 0;
 }
 
-#pragma mark Main
 
-int main(int argc, char* argv[])
+// Run numthreads threads that each do numdispatches small jobs on the context.
+static int run_threads(mvk_context_t* ctx, uint32_t numthreads, uint32_t numdispatches)
 {
-	(void) argc;
-	(void) argv;
+	mvk_module_t* mod = mvk_module_load(ctx, "foo.spirv");
+	if (!mod)
+		return 1;
+	const mvk_kernel_t* foo = mvk_kernel(mod, "foo");
+	assert(foo);
+	if (numthreads < 1)
+		numthreads = 1;
+	if (numthreads > MAXTHREADS)
+		numthreads = MAXTHREADS;
+	numdispatches &= ~1U;
+	threadjob_t jobs[MAXTHREADS];
+	pthread_t threads[MAXTHREADS];
+	const int64_t t0 = now_ns();
+	for (uint32_t t=0; t<numthreads; ++t)
+	{
+		threadjob_t* j = jobs + t;
+		j->ctx = ctx;
+		j->kernel = foo;
+		j->numdispatches = numdispatches;
+		const int res_pc = pthread_create(threads + t, 0, threads_worker, j);
+		assert(res_pc == 0);
+	}
+	for (uint32_t t=0; t<numthreads; ++t)
+		pthread_join(threads[t], 0);
+	const int64_t elapsed = now_ns() - t0;
+	fprintf(stderr, "Results are correct.\n");
+	for (uint32_t t=0; t<numthreads; ++t)
+		fprintf(stderr, "Thread %u: %.1f us per dispatch\n", t, jobs[t].ns * 1e-3 / numdispatches);
+	fprintf(stderr, "%u threads did %u dispatches in %.3f s: %.0f dispatches/s\n", numthreads, numthreads * numdispatches, elapsed * 1e-9, numthreads * numdispatches / (elapsed * 1e-9));
+	mvk_module_unload(mod);
+	return 0;
+}
 
-	pick_device();
 
-	list_memory_types();
+#define FILE_NUMBUFS	4		// Chunks that each disk thread can be ahead, or behind.
+#define FILE_ALIGN	4096		// Alignment of offsets, sizes and memory for O_DIRECT.
 
-	// Create a buffer for constant data
-	const VkDeviceSize bufsz = 1024*1024;
-	VkBuffer bufsrc;
-	VkDeviceMemory memsrc;
-	mk_buffer
-	(
-		//VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
-		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-		bufsz,
-		&bufsrc,
-		&memsrc,
-		"src"
-	);
-	// Create a buffer for dest data
-	VkBuffer bufdst;
-	VkDeviceMemory memdst;
-	mk_buffer
-	(
-		VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
-		VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,
-		bufsz,
-		&bufdst,
-		&memdst,
-		"dst"
-	);
+// Chunks that go between the stream and a thread that does the disk I/O.
+typedef struct
+{
+	int fd;
+	size_t filesz;
+	size_t chunksz;
+	int64_t numchunks;
+	uint8_t* bufs[FILE_NUMBUFS];
+	int64_t produced;		// Chunks put in the ring.
+	int64_t consumed;		// Chunks taken out of the ring.
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_t thread;
+	int64_t iotime;			// Time the thread spent in pread or pwrite.
+} ioring_t;
+
+
+static size_t align_up(size_t v, size_t a)
+{
+	return (v + a - 1) / a * a;
+}
 
-	// Map the src memory
-	void* datasrc = 0;
-	const VkResult resmap0 = vkMapMemory
-	(
-		devi,
-		memsrc,
-		0,
-		bufsz,
-		0,
-		(void**) &datasrc
-	);
-	CHECK_VK(resmap0);
 
+// Open a file for O_DIRECT I/O, or for normal I/O if the file system can not do that.
+static int open_direct(const char* fname, int flags, int* direct)
+{
+	*direct = 1;
+	int fd = open(fname, flags | O_DIRECT, 0644);
+	if (fd < 0 && errno == EINVAL)
+	{
+		*direct = 0;
+		fd = open(fname, flags, 0644);
+	}
+	return fd;
+}
 
-	// Write the data
-	memset(datasrc, 0x55, bufsz);
 
-	// Flush it
-	const VkMappedMemoryRange rng =
+static void ioring_init(ioring_t* r, int fd, size_t filesz, size_t chunksz)
+{
+	r->fd = fd;
+	r->filesz = filesz;
+	r->chunksz = chunksz;
+	r->numchunks = (int64_t) ((filesz + chunksz - 1) / chunksz);
+	for (int i=0; i<FILE_NUMBUFS; ++i)
 	{
-		VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE,
-		0,
-		memsrc,
-		0,			// offset
-		bufsz
-	};
-	const VkResult resflush = vkFlushMappedMemoryRanges
-	(
-		devi,
-		1,
-		&rng
-	);
-	CHECK_VK(resflush);
+		r->bufs[i] = aligned_alloc(FILE_ALIGN, chunksz);
+		assert(r->bufs[i]);
+	}
+	r->produced = r->consumed = 0;
+	r->iotime = 0;
+	pthread_mutex_init(&r->lock, 0);
+	pthread_cond_init(&r->cond, 0);
+}
 
-	// Unmap it
-	vkUnmapMemory(devi, memsrc);
 
-	// Bind src buf
-	const VkDeviceSize offset = 0;
-	const VkResult resbind0 = vkBindBufferMemory
-	(
-		devi,
-		bufsrc,
-		memsrc,
-		offset
-	);
-	CHECK_VK(resbind0);
-	// Bind dst buf
-	const VkResult resbind1 = vkBindBufferMemory
-	(
-		devi,
-		bufdst,
-		memdst,
-		offset
-	);
-	CHECK_VK(resbind1);
+static void ioring_destroy(ioring_t* r)
+{
+	pthread_join(r->thread, 0);
+	for (int i=0; i<FILE_NUMBUFS; ++i)
+		free(r->bufs[i]);
+	pthread_cond_destroy(&r->cond);
+	pthread_mutex_destroy(&r->lock);
+}
+
+
+// Wait for room to put a chunk in, and return the buffer for it.
+static uint8_t* ioring_put_begin(ioring_t* r)
+{
+	pthread_mutex_lock(&r->lock);
+	while (r->produced - r->consumed == FILE_NUMBUFS)
+		pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+	return r->bufs[r->produced % FILE_NUMBUFS];
+}
 
-	// Make a shader module
-	VkShaderModule shader_module = mk_shader("foo.spirv");
-	LABEL_OBJ(shader_module, VK_OBJECT_TYPE_SHADER_MODULE, "foo.spirv");
 
-	// Make a descriptor set
-	const VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[2] = 
+static void ioring_put_end(ioring_t* r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->produced++;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+
+// Wait for a chunk to take out, and return its buffer.
+static uint8_t* ioring_get_begin(ioring_t* r)
+{
+	pthread_mutex_lock(&r->lock);
+	while (r->produced == r->consumed)
+		pthread_cond_wait(&r->cond, &r->lock);
+	pthread_mutex_unlock(&r->lock);
+	return r->bufs[r->consumed % FILE_NUMBUFS];
+}
+
+
+static void ioring_get_end(ioring_t* r)
+{
+	pthread_mutex_lock(&r->lock);
+	r->consumed++;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
+
+// Bytes of the file in chunk c.
+static size_t chunk_bytes(const ioring_t* r, int64_t c)
+{
+	const size_t left = r->filesz - c * r->chunksz;
+	return left < r->chunksz ? left : r->chunksz;
+}
+
+
+// Reads the chunks of the input file ahead of the stream.
+static void* reader_thread(void* arg)
+{
+	ioring_t* r = arg;
+	for (int64_t c=0; c<r->numchunks; ++c)
 	{
+		uint8_t* buf = ioring_put_begin(r);
+		const size_t len = chunk_bytes(r, c);
+		const int64_t t0 = now_ns();
+		size_t done = 0;
+		while (done < len)
 		{
-			0,					// binding number
-#if 1
-			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,	// descriptor type
-#else
-			VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER,	// descriptor type
-#endif
-			1,					// descriptor count
-			VK_SHADER_STAGE_COMPUTE_BIT,		// stage flags
-			0					// immutable samplers
-		},
-		{
-			1,					// binding number
-			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,	// descriptor type
-			1,					// descriptor count
-			VK_SHADER_STAGE_COMPUTE_BIT,		// stage flags
-			0					// immutable samplers
+			// O_DIRECT wants whole blocks, even at the end of the file, where it then reads less.
+			const ssize_t n = pread(r->fd, buf + done, align_up(len - done, FILE_ALIGN), c * r->chunksz + done);
+			if (n <= 0)
+			{
+				fprintf(stderr, "Read of chunk %ld failed.\n", (long) c);
+				assert(n > 0);
+			}
+			done += n;
 		}
-	};
-	VkDescriptorSetLayout  descriptorSetLayout;
-	const VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo =
-	{
-		VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
-		0,				// next
-		0,				// flags
-		2,				// bindingCount
-		descriptorSetLayoutBindings	// bindings
-	};
-	const VkResult rescdsl = vkCreateDescriptorSetLayout(devi, &descriptorSetLayoutCreateInfo, 0, &descriptorSetLayout);
-	CHECK_VK(rescdsl);
-	LABEL_OBJ(descriptorSetLayout, VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT, "foo.spirv");
+		r->iotime += now_ns() - t0;
+		ioring_put_end(r);
+	}
+	return 0;
+}
+
 
-	const VkPushConstantRange pcr =
+// Writes the chunks of the output file behind the stream.
+static void* writer_thread(void* arg)
+{
+	ioring_t* r = arg;
+	for (int64_t c=0; c<r->numchunks; ++c)
 	{
-		VK_SHADER_STAGE_COMPUTE_BIT,
-		0,				// offset
-		sizeof(uint32_t)
-	};
+		const uint8_t* buf = ioring_get_begin(r);
+		// Whole blocks again, the file gets truncated to size at the end.
+		const size_t len = align_up(chunk_bytes(r, c), FILE_ALIGN);
+		const int64_t t0 = now_ns();
+		size_t done = 0;
+		while (done < len)
+		{
+			const ssize_t n = pwrite(r->fd, buf + done, len - done, c * r->chunksz + done);
+			if (n <= 0)
+			{
+				fprintf(stderr, "Write of chunk %ld failed.\n", (long) c);
+				assert(n > 0);
+			}
+			done += n;
+		}
+		r->iotime += now_ns() - t0;
+		ioring_get_end(r);
+	}
+	return 0;
+}
+
+
+typedef struct
+{
+	ioring_t in;
+	ioring_t out;
+} filejob_t;
+
 
-	// Create pipeline
-	VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo =
+static void read_chunk(void* user, size_t firstword, uint32_t* data, size_t numwords)
+{
+	filejob_t* f = user;
+	const int64_t c = firstword * sizeof(uint32_t) / f->in.chunksz;
+	const size_t len = chunk_bytes(&f->in, c);
+	assert(len <= numwords * sizeof(uint32_t));
+	memcpy(data, ioring_get_begin(&f->in), len);
+	ioring_get_end(&f->in);
+	// A file that does not end on a whole word gets its last word padded with zeros.
+	memset((uint8_t*) data + len, 0, numwords * sizeof(uint32_t) - len);
+}
+
+
+static void write_chunk(void* user, size_t firstword, uint32_t* data, size_t numwords)
+{
+	filejob_t* f = user;
+	const int64_t c = firstword * sizeof(uint32_t) / f->out.chunksz;
+	const size_t len = chunk_bytes(&f->out, c);
+	assert(len <= numwords * sizeof(uint32_t));
+	memcpy(ioring_put_begin(&f->out), data, len);
+	ioring_put_end(&f->out);
+}
+
+
+// Run a kernel of foo.spirv over a file of any size, and write the results to another file.
+// Disk reads, uploads, dispatches, downloads and disk writes of different chunks all overlap.
+static int run_file(mvk_context_t* ctx, const char* inname, const char* outname, uint32_t msk, const char* kernel, size_t chunksz)
+{
+	mvk_module_t* mod = mvk_module_load(ctx, "foo.spirv");
+	if (!mod)
+		return 1;
+	const mvk_kernel_t* k = mvk_kernel(mod, kernel);
+	if (!k)
 	{
-		VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
-		0,				// next
-		0,				// flags
-		1,				// layout count
-		&descriptorSetLayout,		// layouts
-		1,				// pushConstantRangeCount
-		&pcr				// pushConstantRanges
-	};
-	VkPipelineLayout pipelineLayout;
-	const VkResult rescpl = vkCreatePipelineLayout(devi, &pipelineLayoutCreateInfo, 0, &pipelineLayout);
-	CHECK_VK(rescpl);
-	LABEL_OBJ(pipelineLayout, VK_OBJECT_TYPE_PIPELINE_LAYOUT, "foo.spirv");
-
-	const VkPipelineShaderStageCreateInfo pssci =
-	{
-		VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
-		0,				// next
-		0,				// flags
-		VK_SHADER_STAGE_COMPUTE_BIT,	// stage
-		shader_module,			// module
-		"foo",				// name of entry point
-		0				// specialization info
-	};
-	VkComputePipelineCreateInfo computePipelineCreateInfo =
-	{
-		VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
-		0,				// next
-		0,				// flags
-		pssci,				// pipeline shader stage create info
-		pipelineLayout,			// layout
-		0,				// basePipelineHandle
-		0				// basePipelineIndex
-	};
-	VkPipeline pipeline;
-	const VkResult res_cp = vkCreateComputePipelines
+		mvk_module_unload(mod);
+		return 1;
+	}
+	int indirect, outdirect;
+	const int infd = open_direct(inname, O_RDONLY, &indirect);
+	if (infd < 0)
+	{
+		fprintf(stderr, "Cannot open %s\n", inname);
+		mvk_module_unload(mod);
+		return 1;
+	}
+	const int outfd = open_direct(outname, O_WRONLY | O_CREAT | O_TRUNC, &outdirect);
+	if (outfd < 0)
+	{
+		fprintf(stderr, "Cannot create %s\n", outname);
+		close(infd);
+		mvk_module_unload(mod);
+		return 1;
+	}
+	struct stat st;
+	const int res_st = fstat(infd, &st);
+	assert(res_st == 0);
+	const size_t filesz = st.st_size;
+
+	// Chunks must be whole blocks for the disk. The stream pads them to whole work groups for the kernel.
+	chunksz = align_up(chunksz ? chunksz : FILE_ALIGN, FILE_ALIGN);
+	fprintf
 	(
-		devi,
-		0,				// pipeline cache
-		1,				// create info count
-		&computePipelineCreateInfo,
-		0,				// allocator
-		&pipeline
+		stderr,
+		"Running %s over %s (%zu bytes) into %s, in chunks of %zu KiB%s.\n",
+		kernel, inname, filesz, outname, chunksz>>10, indirect && outdirect ? ", with O_DIRECT" : ""
 	);
-	CHECK_VK(res_cp);
-	LABEL_OBJ(pipeline, VK_OBJECT_TYPE_PIPELINE, "foo.spirv");
 
-	// Descriptor pool
-	const VkDescriptorPoolSize descriptorPoolSize = 
+	int64_t elapsed = 0;
+	int64_t hostns = 0;
+	filejob_t f;
+	ioring_init(&f.in, infd, filesz, chunksz);
+	ioring_init(&f.out, outfd, filesz, chunksz);
+	pthread_create(&f.in.thread, 0, reader_thread, &f.in);
+	pthread_create(&f.out.thread, 0, writer_thread, &f.out);
+	const uint32_t pc[2] = { msk, (uint32_t) (chunksz / sizeof(uint32_t)) };
+	if (filesz)
+		elapsed = mvk_stream(ctx, k, align_up(filesz, sizeof(uint32_t)) / sizeof(uint32_t), chunksz / sizeof(uint32_t), 3, pc, sizeof(pc), read_chunk, write_chunk, &f, &hostns);
+	if (elapsed < 0)
 	{
-		VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-		2
-	};
-	const VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = 
-	{
-		VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
-		0,				// next
-		0,				// flags
-		1,				// max sets
-		1,				// pool size count
-		&descriptorPoolSize		// pool sizes
-	};
-	VkDescriptorPool descriptorPool;
-	VkResult rescdp = vkCreateDescriptorPool
+		// Let the disk threads finish, on chunks that nobody processed.
+		for (int64_t c=0; c<f.in.numchunks; ++c)
+		{
+			ioring_get_begin(&f.in);
+			ioring_get_end(&f.in);
+			ioring_put_begin(&f.out);
+			ioring_put_end(&f.out);
+		}
+	}
+	ioring_destroy(&f.in);
+	ioring_destroy(&f.out);
+
+	const int res_tr = ftruncate(outfd, filesz);
+	assert(res_tr == 0);
+	close(infd);
+	close(outfd);
+	mvk_module_unload(mod);
+	if (elapsed < 0)
+		return 1;
+	fprintf
 	(
-		devi,
-		&descriptorPoolCreateInfo,
-		0,				// allocator
-		&descriptorPool
+		stderr,
+		"Processed %zu MiB in %.3f s: %.3f GB/s (reading took %.3f s, writing %.3f s, in their own threads).\n",
+		filesz>>20,
+		elapsed * 1e-9,
+		elapsed ? filesz / (double) elapsed : 0.0,
+		f.in.iotime * 1e-9,
+		f.out.iotime * 1e-9
 	);
-	CHECK_VK(rescdp);
+	return 0;
+}
 
-	// Descriptor set
-	VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = 
-	{
-		VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
-		0,				// next
-		descriptorPool,			// descriptor pool to allocate from
-		1,				// descriptor set count
-		&descriptorSetLayout		// descriptor set layouts
-	};
-	VkDescriptorSet descriptorSet;
-	const VkResult resads = vkAllocateDescriptorSets(devi, &descriptorSetAllocateInfo, &descriptorSet);
-	CHECK_VK(resads);
 
-	const VkDescriptorBufferInfo dbi_src =
-	{
-		bufsrc,
-		0,
-		VK_WHOLE_SIZE
-	};
-	const VkDescriptorBufferInfo dbi_dst =
-	{
-		bufdst,
-		0,
-		VK_WHOLE_SIZE
-	};
+#define TUNE_MAXTIMINGS	64
 
-	VkWriteDescriptorSet dset[2] =
+// Time the kernel and its variants over 4 MiB, with the work group sizes they can have, and keep the fastest.
+// Then check the results of the kernel, as it runs from now on.
+static int run_tune(mvk_context_t* ctx, const char* name)
+{
+	mvk_module_t* mod = mvk_module_load(ctx, "foo.spirv");
+	if (!mod)
+		return 1;
+	const size_t bufsz = 4*1024*1024;
+	const size_t numwords = bufsz / sizeof(uint32_t);
+	const uint32_t msk = 0xff0000ff;
+	const uint32_t pc[2] = { msk, (uint32_t) numwords };
+	mvk_buffer_t* buffers[2] = { mvk_buffer_create(ctx, bufsz), mvk_buffer_create(ctx, bufsz) };
+	uint32_t* hostdata = malloc(bufsz);
+	assert(hostdata);
+	for (size_t i=0; i<numwords; ++i)
+		hostdata[i] = (uint32_t) i;
+	mvk_buffer_write(buffers[0], 0, hostdata, bufsz);
+
+	mvk_timing_t timings[TUNE_MAXTIMINGS];
+	const int numtimings = mvk_tune(mod, name, numwords, buffers, 2, pc, sizeof(pc), timings, TUNE_MAXTIMINGS);
+	int rv = numtimings < 0;
+	if (numtimings > 0)
 	{
+		int best = 0;
+		int64_t basens = 0;
+		for (int i=0; i<numtimings; ++i)
 		{
-			VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-			0,
-			descriptorSet,
-			0,
-			0,
-			1,
-			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-			0,
-			&dbi_src,
-			0
-		},
-		{
-			VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET,
-			0,
-			descriptorSet,
-			1,
-			0,
-			1,
-			VK_DESCRIPTOR_TYPE_STORAGE_BUFFER,
-			0,
-			&dbi_dst,
-			0
+			fprintf(stderr, "%-16s work group size %4u: %9.1f us\n", timings[i].variant, timings[i].wgsz, timings[i].ns * 1e-3);
+			if (timings[i].ns < timings[best].ns)
+				best = i;
+			if (!strcmp(timings[i].variant, name) && (!basens || timings[i].ns < basens))
+				basens = timings[i].ns;
 		}
-	};
-	vkUpdateDescriptorSets(devi, 2, dset, 0, 0);
+		fprintf(stderr, "Fastest %s is %s with work group size %u: %.1f us", name, timings[best].variant, timings[best].wgsz, timings[best].ns * 1e-3);
+		if (basens)
+			fprintf(stderr, ", %.2fx of %s at its best", basens / (double) timings[best].ns, name);
+		fprintf(stderr, ".\n");
+
+		memset(hostdata, 0, bufsz);
+		mvk_buffer_write(buffers[1], 0, hostdata, bufsz);
+		mvk_job_t* job = mvk_submit(ctx, mvk_kernel(mod, name), numwords, buffers, 2, pc, sizeof(pc), 0, 0);
+		assert(job);
+		mvk_job_wait(job);
+		mvk_job_release(job);
+		mvk_buffer_read(buffers[1], 0, hostdata, bufsz);
+		for (size_t w=0; w<numwords; ++w)
+			if (hostdata[w] != ((uint32_t) w ^ msk))
+			{
+				fprintf(stderr, "Tuned %s computed 0x%08x for word %zu.\n", name, hostdata[w], w);
+				assert(0);
+			}
+		fprintf(stderr, "Results are correct.\n");
+	}
 
-	// query pool
-	const VkQueryPoolCreateInfo qpci =
-	{
-		VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
-		0,				// pNext
-		0,				// flags
-		VK_QUERY_TYPE_TIMESTAMP,	// query type
-		2,				// query count
-		0,				// pipeline statistics
-	};
-	VkQueryPool queryPool;
-	const VkResult res_cqp = vkCreateQueryPool
-	(
-	 	devi,
-		&qpci,
-		0,
-		&queryPool
-	);
-	CHECK_VK(res_cqp);
+	free(hostdata);
+	mvk_buffer_destroy(buffers[0]);
+	mvk_buffer_destroy(buffers[1]);
+	mvk_module_unload(mod);
+	return rv;
+}
 
-	// Command pool
-	const VkCommandPoolCreateInfo commandPoolCreateInfo =
-	{
-		VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
-		0,				// next
-		0,				// flags
-		qfam				// queue fam
-	};
-	VkCommandPool commandPool;
-	const VkResult res_ccp = vkCreateCommandPool(devi, &commandPoolCreateInfo, 0, &commandPool);
-	CHECK_VK(res_ccp);
-	VkCommandBufferAllocateInfo commandBufferAllocateInfo =
-	{
-		VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
-		0,
-		commandPool,
-		VK_COMMAND_BUFFER_LEVEL_PRIMARY,
-		1
-	};
 
-	// Command buffer
-	VkCommandBuffer commandBuffer;
-	const VkResult res_acc = vkAllocateCommandBuffers(devi, &commandBufferAllocateInfo, &commandBuffer);
-	CHECK_VK(res_acc);
-
-	// Record it
-	VkCommandBufferBeginInfo commandBufferBeginInfo =
-  	{
-		VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
-		0,
-		VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
-		0
-	};
+#define MAXDEVICES	8
+#define MULTI_CHUNKSZ	(4*1024*1024)
+#define MULTI_CALIBSZ	(16*1024*1024)
 
-	const VkResult res_bcb = vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo);
-	CHECK_VK(res_bcb);
+// A thread that drives one device, with its slice of the work.
+typedef struct
+{
+	int devnr;
+	char name[256];
+	const uint32_t* src;
+	uint32_t* dst;
+	uint32_t msk;
+	size_t first;			// First word of the slice.
+	size_t numwords;		// Size of the slice.
+	int calibrating;		// Output is not wanted yet.
+	double rate;			// Measured bytes per ns.
+	int64_t ns;			// Time it took to do the slice.
+	pthread_barrier_t* barrier;
+} worker_t;
+
+
+static void copy_in(void* user, size_t firstword, uint32_t* data, size_t numwords)
+{
+	const worker_t* w = user;
+	memcpy(data, w->src + w->first + firstword, numwords * sizeof(uint32_t));
+}
 
-	vkCmdBindPipeline(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipeline);
 
-	vkCmdBindDescriptorSets(commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, pipelineLayout, 0, 1, &descriptorSet, 0, 0);
+static void copy_out(void* user, size_t firstword, uint32_t* data, size_t numwords)
+{
+	const worker_t* w = user;
+	if (!w->calibrating)
+		memcpy(w->dst + w->first + firstword, data, numwords * sizeof(uint32_t));
+}
 
-	// Push the constant arg.
-	uint32_t msk = 0xff0000ff;
-	vkCmdPushConstants
-	(
-		commandBuffer,
-		pipelineLayout,
-		VK_SHADER_STAGE_COMPUTE_BIT,
-		0,
-		sizeof(uint32_t),
-		&msk
-	);
 
-	vkCmdResetQueryPool
-	(
-		commandBuffer,
-	 	queryPool,
-		0,
-		2
-	);
+static void* multi_worker(void* arg)
+{
+	worker_t* w = arg;
+	mvk_context_t* ctx = mvk_create(w->devnr);
+	assert(ctx);
+	snprintf(w->name, sizeof(w->name), "%s", mvk_device_name(ctx));
+	mvk_module_t* mod = mvk_module_load(ctx, "foo.spirv");
+	assert(mod);
+	const mvk_kernel_t* foo = mvk_kernel(mod, "foo");
+	assert(foo);
+
+	// Measure what this device does, from host memory to host memory, on the start of the range.
+	int64_t hostns;
+	w->calibrating = 1;
+	const size_t calwords = w->numwords;
+	const uint32_t pc[2] = { w->msk, MULTI_CHUNKSZ / sizeof(uint32_t) };
+	const int64_t calns = mvk_stream(ctx, foo, calwords, MULTI_CHUNKSZ / sizeof(uint32_t), 3, pc, sizeof(pc), copy_in, copy_out, w, &hostns);
+	assert(calns > 0);
+	w->rate = calwords * sizeof(uint32_t) / (double) calns;
+	w->calibrating = 0;
+
+	// Wait for all devices to be measured, and for our slice.
+	pthread_barrier_wait(w->barrier);
+	pthread_barrier_wait(w->barrier);
+	if (w->numwords)
+		w->ns = mvk_stream(ctx, foo, w->numwords, MULTI_CHUNKSZ / sizeof(uint32_t), 3, pc, sizeof(pc), copy_in, copy_out, w, &hostns);
+
+	mvk_module_unload(mod);
+	mvk_destroy(ctx);
+	return 0;
+}
 
-	vkCmdWriteTimestamp
-	(
-	 	commandBuffer,
-		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-		queryPool,
-		0
-	);
-	const size_t numwork = bufsz / sizeof(uint32_t);
-	const size_t numgroups = numwork / WGSZ;
-	vkCmdDispatch(commandBuffer, numgroups, 1, 1);
-	vkCmdWriteTimestamp
-	(
-	 	commandBuffer,
-		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
-		queryPool,
-		1
-	);
 
-	const VkResult res_ecb = vkEndCommandBuffer(commandBuffer);
-	CHECK_VK(res_ecb);
+// Split total bytes of work over all devices, in proportion to how fast each of them turned out to be.
+static int run_multi(size_t total)
+{
+	int numdev = mvk_device_count();
+	if (numdev > MAXDEVICES)
+		numdev = MAXDEVICES;
+	if (numdev < 1)
+	{
+		fprintf(stderr, "There are no devices.\n");
+		return 1;
+	}
+	const size_t totalwords = total / sizeof(uint32_t);
+	uint32_t* src = malloc(totalwords * sizeof(uint32_t));
+	uint32_t* dst = malloc(totalwords * sizeof(uint32_t));
+	assert(src && dst);
+	for (size_t i=0; i<totalwords; ++i)
+		src[i] = (uint32_t) i;
+	memset(dst, 0, totalwords * sizeof(uint32_t));
+
+	pthread_barrier_t barrier;
+	pthread_barrier_init(&barrier, 0, numdev + 1);
+	worker_t workers[MAXDEVICES];
+	pthread_t threads[MAXDEVICES];
+	const size_t calwords = (MULTI_CALIBSZ / sizeof(uint32_t)) < totalwords ? (MULTI_CALIBSZ / sizeof(uint32_t)) : totalwords;
+	for (int d=0; d<numdev; ++d)
+	{
+		worker_t* w = workers + d;
+		memset(w, 0, sizeof(worker_t));
+		w->devnr = d;
+		w->src = src;
+		w->dst = dst;
+		w->msk = 0xff0000ff;
+		w->numwords = calwords;
+		w->barrier = &barrier;
+		const int res_pc = pthread_create(threads + d, 0, multi_worker, w);
+		assert(res_pc == 0);
+	}
+	pthread_barrier_wait(&barrier);
+
+	// Every device gets a slice that is in proportion to its rate.
+	double sumrate = 0.0;
+	for (int d=0; d<numdev; ++d)
+		sumrate += workers[d].rate;
+	size_t first = 0;
+	for (int d=0; d<numdev; ++d)
+	{
+		worker_t* w = workers + d;
+		size_t n = (size_t) (totalwords * (w->rate / sumrate)) & ~(size_t) 1023;
+		if (d == numdev-1 || first + n > totalwords)
+			n = totalwords - first;
+		w->first = first;
+		w->numwords = n;
+		first += n;
+	}
+	const int64_t t0 = now_ns();
+	pthread_barrier_wait(&barrier);
+	for (int d=0; d<numdev; ++d)
+		pthread_join(threads[d], 0);
+	const int64_t elapsed = now_ns() - t0;
+	pthread_barrier_destroy(&barrier);
+
+	for (size_t i=0; i<totalwords; ++i)
+		if (dst[i] != (src[i] ^ workers[0].msk))
+		{
+			fprintf(stderr, "Word %zu is 0x%08x, expected 0x%08x\n", i, dst[i], src[i] ^ workers[0].msk);
+			assert(0);
+		}
+	fprintf(stderr, "Results are correct.\n");
+	for (int d=0; d<numdev; ++d)
+		fprintf
+		(
+			stderr,
+			"%-44s measured %.3f GB/s, did %5.1f%% in %.3f s\n",
+			workers[d].name,
+			workers[d].rate,
+			100.0 * workers[d].numwords / totalwords,
+			workers[d].ns * 1e-9
+		);
+	fprintf(stderr, "%zu MiB over %d devices in %.3f s: %.3f GB/s\n", total>>20, numdev, elapsed * 1e-9, total / (double) elapsed);
+	free(src);
+	free(dst);
+	return 0;
+}
 
-	VkQueue queue;
-	vkGetDeviceQueue(devi, qfam, 0, &queue);
 
-	VkSubmitInfo submitInfo =
+// A client of the load generator, that runs its requests one after the other, and times each.
+typedef struct
+{
+	const char* path;
+	uint32_t numrequests;
+	size_t bufsz;
+	int64_t* latency;		// Wall time of every request, in ns.
+	int64_t gpuns;			// GPU time of all requests.
+	int ok;
+} loadclient_t;
+
+
+static void* load_worker(void* arg)
+{
+	loadclient_t* lc = arg;
+	mvk_client_t* cl = mvk_client_connect(lc->path);
+	if (!cl)
+		return 0;
+	int ids[2];
+	uint32_t* src = mvk_client_alloc(cl, lc->bufsz, ids+0);
+	uint32_t* dst = mvk_client_alloc(cl, lc->bufsz, ids+1);
+	const size_t numwords = lc->bufsz / sizeof(uint32_t);
+	if (src && dst)
 	{
-		VK_STRUCTURE_TYPE_SUBMIT_INFO,
-		0,
-		0,
-		0,
-		0,
-		1,
-		&commandBuffer,
-		0,
-		0
-	};
-	const VkResult res_qs = vkQueueSubmit(queue, 1, &submitInfo, 0);
-	CHECK_VK(res_qs);
+		for (size_t i=0; i<numwords; ++i)
+			src[i] = (uint32_t) i;
+		const uint32_t msk = 0xff0000ff;
+		const uint32_t pc[2] = { msk, (uint32_t) numwords };
+		lc->ok = 1;
+		for (uint32_t i=0; i<lc->numrequests && lc->ok; ++i)
+		{
+			const int64_t t0 = now_ns();
+			const int64_t ns = mvk_client_run(cl, "foo", numwords, ids, 2, pc, sizeof(pc));
+			lc->latency[i] = now_ns() - t0;
+			lc->gpuns += ns;
+			lc->ok = ns >= 0;
+		}
+		for (size_t i=0; i<numwords && lc->ok; ++i)
+			lc->ok = dst[i] == (src[i] ^ msk);
+	}
+	mvk_client_close(cl);
+	return 0;
+}
 
-	const VkResult res_qwi = vkQueueWaitIdle(queue);
-	CHECK_VK(res_qwi);
 
-	// Map the dst memory
-	uint32_t* datadst = 0;
-	const VkResult resmap1 = vkMapMemory
+// Run numclients clients against the daemon on path, each doing numrequests requests of foo over bufsz bytes.
+static int run_load(const char* path, uint32_t numclients, uint32_t numrequests, size_t bufsz)
+{
+	if (numclients < 1 || numrequests < 1)
+		return -1;
+	loadclient_t lcs[numclients];
+	pthread_t threads[numclients];
+	int64_t* latency = malloc((size_t) numclients * numrequests * sizeof(int64_t));
+	assert(latency);
+	const int64_t t0 = now_ns();
+	for (uint32_t i=0; i<numclients; ++i)
+	{
+		loadclient_t* lc = lcs + i;
+		memset(lc, 0, sizeof(loadclient_t));
+		lc->path = path;
+		lc->numrequests = numrequests;
+		lc->bufsz = bufsz;
+		lc->latency = latency + (size_t) i * numrequests;
+		const int res_pc = pthread_create(threads + i, 0, load_worker, lc);
+		assert(res_pc == 0);
+	}
+	int ok = 1;
+	int64_t gpuns = 0;
+	for (uint32_t i=0; i<numclients; ++i)
+	{
+		pthread_join(threads[i], 0);
+		ok = ok && lcs[i].ok;
+		gpuns += lcs[i].gpuns;
+	}
+	const int64_t elapsed = now_ns() - t0;
+	if (!ok)
+	{
+		fprintf(stderr, "Requests to %s failed, or gave wrong results.\n", path);
+		free(latency);
+		return 1;
+	}
+	const uint32_t n = numclients * numrequests;
+	qsort(latency, n, sizeof(int64_t), cmp_i64);
+	fprintf(stderr, "Results are correct.\n");
+	fprintf
 	(
-		devi,
-		memdst,
-		0,
-		bufsz,
-		0,
-		(void**) &datadst
+		stderr,
+		"%u clients did %u requests of %zu KiB in %.3f s: %.0f requests/s, %.3f GB/s\n",
+		numclients, n, bufsz >> 10, elapsed * 1e-9, n / (elapsed * 1e-9), (double) n * bufsz / elapsed
 	);
-	CHECK_VK(resmap1);
-
-	fprintf(stderr, "Checking results...\n");
-	for (uint32_t i=0; i<bufsz/4; ++i)
-		assert(datadst[i] == 0xaa5555aa);
-	fprintf(stderr, "Results are correct.\n");
-
-	vkUnmapMemory(devi, memdst);
-
-	uint64_t stamps[2];
-	const VkQueryResultFlags qrflags =
-		  VK_QUERY_RESULT_64_BIT
-		| VK_QUERY_RESULT_WAIT_BIT
-		;
-	const VkResult res_qpr = vkGetQueryPoolResults
+	fprintf
 	(
-	 	devi,
-		queryPool,
-		0,
-		2,
-		sizeof(stamps),
-		stamps,
-		sizeof(uint64_t),
-		qrflags
+		stderr,
+		"latency: median %.1f us, p99 %.1f us, max %.1f us, of which %.1f us on the GPU on average\n",
+		percentile(latency, n, 0.5) * 1e-3, percentile(latency, n, 0.99) * 1e-3, latency[n-1] * 1e-3, gpuns * 1e-3 / n
 	);
-	CHECK_VK(res_qpr);
-	const float period = dprops.limits.timestampPeriod;
-	fprintf(stderr, "ns per timestamp tick: %f\n", period);
-	const uint64_t elapsed = stamps[1] - stamps[0];
-	const float elapsed_ns = elapsed * period;
-	fprintf(stderr,"elapsed: %lu\n", elapsed);
-	fprintf(stderr,"elapsed: %.1f ns\n", elapsed_ns);
-
-	vkDestroyQueryPool(devi, queryPool, 0);
-	vkDestroyDescriptorPool(devi, descriptorPool, 0);
-	vkDestroyDescriptorSetLayout(devi, descriptorSetLayout, 0);
-	vkDestroyPipelineLayout(devi, pipelineLayout, 0);
-	vkDestroyPipeline(devi, pipeline, 0);
-	vkDestroyCommandPool(devi, commandPool, 0);
-	vkDestroyShaderModule(devi, shader_module, 0);
-	vkDestroyBuffer(devi, bufsrc, 0);
-	vkDestroyBuffer(devi, bufdst, 0);
-	vkFreeMemory(devi, memsrc, 0);
-	vkFreeMemory(devi, memdst, 0);
-	vkDestroyDevice(devi, 0);
-	vkDestroyInstance(inst, 0);
-
+	free(latency);
 	return 0;
 }
 
+
+int main(int argc, char* argv[])
+{
+	const char* mode = argc > 1 ? argv[1] : "once";
+
+	// The multi mode picks all devices itself, and the load mode leaves the device to a daemon.
+	if (!strcmp(mode, "multi"))
+		return run_multi((size_t) (argc > 2 ? atoi(argv[2]) : 256) << 20);
+	if (!strcmp(mode, "load"))
+	{
+		const char* path           = argc > 2 ? argv[2] : "mvk.sock";
+		const uint32_t numclients  = argc > 3 ? atoi(argv[3]) : 4;
+		const uint32_t numrequests = argc > 4 ? atoi(argv[4]) : 1000;
+		const size_t bufsz         = (size_t) (argc > 5 ? atoi(argv[5]) : 1024) << 10;
+		return run_load(path, numclients, numrequests, bufsz);
+	}
+
+	mvk_context_t* ctx = mvk_create(-1);
+	if (!ctx)
+	{
+		fprintf(stderr, "Cannot create a context.\n");
+		return 1;
+	}
+
+	const size_t numwords = argc > 2 ? strtoull(argv[2], 0, 0) : 256*1024;
+	const int rv =
+		!strcmp(mode, "once") ? run_once(ctx, numwords) :
+		!strcmp(mode, "graph") ? run_graph(ctx, numwords) :
+		!strcmp(mode, "prims") ? run_prims(ctx, numwords) :
+		!strcmp(mode, "coalesce") ? run_coalesce(ctx, argc > 2 ? numwords : 10000, argc > 3 ? atoi(argv[3]) : 256, argc > 4 ? atoi(argv[4]) : 200) :
+		!strcmp(mode, "sort") ? run_sort(ctx, argc > 2 ? numwords : 100*1000*1000) :
+		!strcmp(mode, "dirty") ? run_dirty(ctx, argc > 2 ? numwords : 4*1024*1024, argc > 3 ? strtoull(argv[3], 0, 0) : 4) :
+		!strcmp(mode, "stream") ? run_stream(ctx, (size_t) (argc > 2 ? atoi(argv[2]) : 1024) << 20, (size_t) (argc > 3 ? atoi(argv[3]) : 4096) << 10, argc > 4 ? atoi(argv[4]) : 3) :
+		!strcmp(mode, "batch") ? run_batch(ctx, argc > 2 ? atoi(argv[2]) : 4096, argc > 3 ? atoi(argv[3]) : 32) :
+		!strcmp(mode, "bench") ? run_bench(ctx, argc > 2 && !strcmp(argv[2], "csv"), (size_t) (argc > 3 ? atoi(argv[3]) : 64) << 10, (size_t) (argc > 4 ? atoi(argv[4]) : 16384) << 10, argc > 5 ? atoi(argv[5]) : 20) :
+		!strcmp(mode, "threads") ? run_threads(ctx, argc > 2 ? atoi(argv[2]) : 4, argc > 3 ? atoi(argv[3]) : 1000) :
+		!strcmp(mode, "file") && argc > 3 ? run_file(ctx, argv[2], argv[3], argc > 4 ? strtoul(argv[4], 0, 0) : 0xff0000ff, argc > 5 ? argv[5] : "foo", (size_t) (argc > 6 ? atoi(argv[6]) : 4096) << 10) :
+		!strcmp(mode, "tune") ? run_tune(ctx, argc > 2 ? argv[2] : "foo") :
+		!strcmp(mode, "serve") ? (mvk_serve(ctx, argc > 2 ? argv[2] : "mvk.sock", argc > 3 ? argv[3] : "foo.spirv") < 0 ? 1 : 0) :
+		-1;
+	if (rv < 0)
+		fprintf(stderr, "Usage: %s [once [words] | graph [words] | prims [words] | sort [max words] | dirty [words [pages]] | coalesce [jobs [max batch [max latency us]]] | stream [MiB [chunk KiB [slots]]] | batch [dispatches [per submit]] | bench [json | csv [min KiB [max KiB [reps]]]] | threads [count [dispatches]] | file in out [msk [kernel [chunk KiB]]] | tune [kernel] | multi [MiB] | serve [socket [spirv]] | load [socket [clients [requests [KiB]]]]]\n", argv[0]);
+
+	mvk_destroy(ctx);
+
+	return rv < 0 ? 1 : rv;
+}
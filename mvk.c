@@ -0,0 +1,6428 @@
+#define _GNU_SOURCE		// for O_DIRECT
+#include <stdio.h>	// for fprintf()
+#include <stdlib.h>	// for getenv()
+#include <assert.h>	// for assert()
+#include <string.h>	// for memset()
+#include <time.h>	// for clock_gettime()
+#include <unistd.h>	// for fsync(), getpid()
+#include <fcntl.h>	// for open()
+#include <errno.h>	// for errno
+#include <sys/mman.h>	// for mmap()
+#include <sys/stat.h>	// for fstat()
+#include <pthread.h>	// for pthread_create()
+#include <signal.h>	// for sigaction()
+#include <poll.h>	// for poll()
+#include <sys/socket.h>	// for socket()
+#include <sys/un.h>	// for sockaddr_un
+
+#include <vulkan/vulkan.h>
+
+#include "mvk.h"
+
+#if !defined(WGSZ)
+#	define WGSZ	64	// Work group size for kernels that can be specialized, until they get tuned.
+#endif
+
+#define CHECK_VK(RES) \
+	if (RES != VK_SUCCESS) \
+	{ \
+		fprintf(stderr, "VK FAIL (%d) at %s:%d\n", RES, __FILE__, __LINE__); \
+		assert(RES == VK_SUCCESS); \
+	}
+
+#define LABEL_OBJ(DC, O, TYP, NAM) \
+	if ((DC)->pfnSetDebugUtilsObjectNameEXT) \
+	{ \
+		const VkDebugUtilsObjectNameInfoEXT ni = \
+		{ \
+			VK_STRUCTURE_TYPE_DEBUG_UTILS_OBJECT_NAME_INFO_EXT, \
+			0, \
+			TYP, \
+			(uint64_t) O, \
+			NAM \
+		}; \
+		const VkResult res_name = (DC)->pfnSetDebugUtilsObjectNameEXT \
+		( \
+			(DC)->devi, \
+			&ni \
+		); \
+		CHECK_VK(res_name); \
+	}
+
+
+
+// All state that belongs to a device lives in the context that made it, and gets passed down as a devctx_t.
+typedef struct devctx devctx_t;
+
+
+
+#pragma mark Queues
+
+#define MAXQUEUES	16	// Max number of queues we create, over all families.
+
+// All the queues of a device, shared by all threads that use the device.
+typedef struct
+{
+	uint32_t count;
+	VkQueue queue[MAXQUEUES];
+	int fam[MAXQUEUES];
+	int compute[MAXQUEUES];		// Can it compute, or is it transfer-only?
+	float prio[MAXQUEUES];
+	uint64_t tsmask[MAXQUEUES];		// The valid bits of its timestamps; the others are undefined.
+	pthread_mutex_t lock[MAXQUEUES];	// Held while submitting to it.
+} queues_t;
+
+
+static int queue_index(const queues_t* qs, VkQueue q)
+{
+	for (uint32_t i=0; i<qs->count; ++i)
+		if (qs->queue[i] == q)
+			return i;
+	assert(0);
+	return -1;
+}
+
+
+// vkQueueSubmit, made safe to use from any thread.
+static VkResult queue_submit(queues_t* qs, VkQueue q, uint32_t count, const VkSubmitInfo* si, VkFence fence)
+{
+	const int i = queue_index(qs, q);
+	pthread_mutex_lock(qs->lock + i);
+	const VkResult res = vkQueueSubmit(q, count, si, fence);
+	pthread_mutex_unlock(qs->lock + i);
+	return res;
+}
+
+
+// vkQueueWaitIdle, made safe to use from any thread.
+static VkResult queue_wait_idle(queues_t* qs, VkQueue q)
+{
+	const int i = queue_index(qs, q);
+	pthread_mutex_lock(qs->lock + i);
+	const VkResult res = vkQueueWaitIdle(q);
+	pthread_mutex_unlock(qs->lock + i);
+	return res;
+}
+
+
+// Pick the compute queue with the highest priority, as jobs are latency-sensitive.
+static int assign_queue(const queues_t* qs)
+{
+	int best = -1;
+	for (uint32_t i=0; i<qs->count; ++i)
+		if (qs->compute[i] && (best < 0 || qs->prio[i] > qs->prio[best]))
+			best = i;
+	assert(best >= 0);
+	return best;
+}
+
+
+// Pick a queue for copies. A transfer-only queue maps to the DMA engines, which can copy while the shader cores compute.
+// Otherwise, use another queue of the home queue's family, so that no ownership transfers are needed.
+static int assign_copy_queue(const queues_t* qs, int home)
+{
+	for (uint32_t i=0; i<qs->count; ++i)
+		if (!qs->compute[i])
+			return i;
+	for (uint32_t i=0; i<qs->count; ++i)
+		if ((int)i != home && qs->fam[i] == qs->fam[home])
+			return i;
+	return home;
+}
+
+#pragma mark Memory arena
+
+#define ARENA_BLOCKSZ	(64*1024*1024)	// Default size of a device memory block.
+#define ARENA_MAXBLOCKS	64		// Max number of device memory blocks, over all memory types.
+#define ARENA_MAXRANGES	1024		// Max number of free ranges in a single block.
+#define DIRTY_MAX	16		// Max number of dirty ranges of a buffer, that get flushed or copied in one go.
+
+typedef struct
+{
+	VkDeviceSize offset;
+	VkDeviceSize size;
+} range_t;
+
+// A large device memory allocation that we carve sub-ranges out of.
+typedef struct
+{
+	VkDeviceMemory mem;			// Backing memory, or 0 if this slot is unused.
+	uint32_t memtype;			// Memory type index it was allocated from.
+	VkDeviceSize size;			// Size of the block.
+	void* mapped;				// Persistent mapping, if the type is host-visible.
+	uint32_t numallocs;			// Number of live sub-allocations.
+	uint32_t numfree;			// Number of free ranges.
+	range_t freelist[ARENA_MAXRANGES];	// Free ranges, sorted by offset, never adjacent.
+	VkDeviceSize lost;			// Bytes freed while the free list was full, back when the block is empty.
+} block_t;
+
+// A range of device memory handed out by the arena.
+typedef struct
+{
+	VkDeviceMemory mem;			// Memory object that holds the range.
+	VkDeviceSize offset;			// Aligned offset of the range in mem.
+	VkDeviceSize size;			// Requested size.
+	void* mapped;				// Host address of offset, or 0 if not host-visible.
+	int block;				// Index of the owning block.
+	range_t reserved;			// What is returned to the block on free, including padding.
+} suballoc_t;
+
+typedef struct
+{
+	uint64_t suballocs;			// Sub-allocations handed out.
+	uint64_t frees;				// Sub-allocations returned.
+	uint64_t devallocs;			// vkAllocateMemory calls made.
+	uint64_t livedevallocs;			// Device memory objects currently alive.
+	VkDeviceSize inuse;			// Bytes currently handed out, including padding.
+	VkDeviceSize lost;			// Bytes freed while the free list of their block was full.
+	VkDeviceSize heapusage[VK_MAX_MEMORY_HEAPS];	// Bytes of blocks allocated, per heap.
+} arenastats_t;
+
+#pragma mark Device state
+
+#define PCACHE_MAXMODULES	16	// Max number of modules whose cold start time the pipeline cache keeps.
+
+// How long the pipelines of a module took to create without a cache.
+typedef struct
+{
+	uint64_t spirvsum;			// FNV-1a hash of the SPIR-V of the module.
+	int64_t coldns;
+} coldstart_t;
+
+// A device, with its queues, memory arena and pools. It belongs to one context, and any thread may use it.
+struct devctx
+{
+	VkInstance inst;				// The shared instance.
+	VkPhysicalDevice pdev;				// A physical device.
+	VkPhysicalDeviceProperties dprops;		// The properties of the picked device.
+	VkDevice devi;					// A device.
+	uint32_t mtcnt;					// Memory type count
+	uint32_t mhcnt;					// Memory heap count
+	VkPhysicalDeviceMemoryProperties memprops;	// Properties for all memory types
+	int has_memory_budget;				// Is VK_EXT_memory_budget available?
+	int has_host_import;				// Is VK_EXT_external_memory_host enabled?
+	int has_robust_access;				// Are accesses outside a descriptor's range discarded?
+	int has_device_address;				// Can kernels take buffers as pointers in push constants?
+	int has_push_descriptor;			// Is VK_KHR_push_descriptor enabled?
+	int has_pipeline_stats;				// Can dispatches count their shader invocations?
+	int has_calibrated_timestamps;			// Can device timestamps be matched to CLOCK_MONOTONIC?
+	VkDeviceSize hostimportalign;			// Alignment of host memory that gets imported.
+	int verbose;					// Is MVK_VERBOSE set? Then the placement of memory gets printed.
+
+	queues_t queues;
+	int homeq;					// The queue we submit compute work to.
+	int homexq;					// The queue we submit copies to.
+	VkQueue queue;					// queues.queue[homeq]
+	int qfam;					// queue family index.
+	VkQueue xqueue;					// queues.queue[homexq], may equal queue.
+	int xfam;					// Transfer queue family index, may equal qfam.
+
+	// Extension funcs.
+	PFN_vkSetDebugUtilsObjectNameEXT	pfnSetDebugUtilsObjectNameEXT;
+	PFN_vkGetMemoryHostPointerPropertiesEXT	pfnGetMemoryHostPointerPropertiesEXT;
+	PFN_vkCmdPushDescriptorSetKHR		pfnCmdPushDescriptorSetKHR;
+	PFN_vkGetCalibratedTimestampsEXT	pfnGetCalibratedTimestampsEXT;
+
+	block_t blocks[ARENA_MAXBLOCKS];
+	uint32_t numblocks;
+	arenastats_t arenastats;
+	pthread_mutex_t arenalock;			// Held while the arena hands out or takes back memory.
+
+	VkCommandPool stagingPool;			// For the copies, on the transfer queue.
+	VkCommandPool stagingOwnerPool;			// For the hand-overs of the device buffer, on the compute queue.
+	VkFence stagingFence;
+	VkSemaphore stagingSemas[2];			// Between the hand-overs and the copy.
+	pthread_mutex_t staginglock;			// Held during a staging copy.
+
+	char pcache_path[512];				// Where the pipeline cache for this device lives.
+	uint64_t pcache_loadedsum;			// Checksum of what we loaded, to skip needless writes.
+	coldstart_t pcache_cold[PCACHE_MAXMODULES];	// Cold start pipeline creation time per module, oldest first.
+	uint32_t pcache_numcold;
+	int pcache_newcold;				// Were cold starts added since the load?
+	char tune_path[512];				// Where the tuning results live, empty if we do not keep them.
+};
+
+#pragma mark Memory arena
+
+static VkDeviceSize heap_room(devctx_t* dc, uint32_t heap);
+
+
+static VkDeviceSize align_up(VkDeviceSize v, VkDeviceSize a)
+{
+	return (v + a - 1) / a * a;
+}
+
+
+// Create a new block of at least sz bytes, of memory type tp. Returns its index, or -1 on failure.
+static int arena_add_block(devctx_t* dc, uint32_t tp, VkDeviceSize sz)
+{
+	int idx = -1;
+	for (uint32_t i=0; i<dc->numblocks; ++i)
+		if (!dc->blocks[i].mem) { idx = i; break; }
+	if (idx < 0)
+	{
+		if (dc->numblocks == ARENA_MAXBLOCKS)
+			return -1;
+		idx = dc->numblocks++;
+	}
+	if (dc->arenastats.livedevallocs >= dc->dprops.limits.maxMemoryAllocationCount)
+	{
+		fprintf(stderr, "Reached maxMemoryAllocationCount (%u).\n", dc->dprops.limits.maxMemoryAllocationCount);
+		return -1;
+	}
+
+	// Prefer a full size block, but settle for an exact fit if the heap is tight.
+	const uint32_t heap = dc->memprops.memoryTypes[tp].heapIndex;
+	const VkDeviceSize room = heap_room(dc, heap);
+	if (sz > room)
+		return -1;
+	VkDeviceSize blocksz = sz > ARENA_BLOCKSZ ? sz : ARENA_BLOCKSZ;
+	if (blocksz > room / 2 && sz <= room / 2)
+		blocksz = room / 2;
+	if (blocksz > room)
+		blocksz = sz;
+	block_t* b = dc->blocks + idx;
+	// Buffers in the block may get passed to kernels by address.
+	VkMemoryAllocateFlagsInfo mafi;
+	memset(&mafi, 0, sizeof(mafi));
+	mafi.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
+	mafi.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+	VkResult res_alloc = VK_ERROR_OUT_OF_DEVICE_MEMORY;
+	while (res_alloc != VK_SUCCESS)
+	{
+		const VkMemoryAllocateInfo mai =
+		{
+			VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+			dc->has_device_address ? &mafi : 0,
+			blocksz,
+			tp
+		};
+		res_alloc = vkAllocateMemory
+		(
+			dc->devi,
+			&mai,
+			0,
+			&b->mem
+		);
+		if (res_alloc == VK_SUCCESS || blocksz == sz)
+			break;
+		blocksz = sz;
+	}
+	if (res_alloc != VK_SUCCESS)
+	{
+		fprintf(stderr, "vkAllocateMemory of %lu bytes from type %u failed (%d).\n", blocksz, tp, res_alloc);
+		b->mem = 0;
+		return -1;
+	}
+	dc->arenastats.devallocs++;
+	dc->arenastats.livedevallocs++;
+	dc->arenastats.heapusage[heap] += blocksz;
+
+	b->memtype = tp;
+	b->size = blocksz;
+	b->mapped = 0;
+	b->numallocs = 0;
+	b->numfree = 1;
+	b->freelist[0].offset = 0;
+	b->freelist[0].size = blocksz;
+	b->lost = 0;
+
+	// Host-visible blocks are mapped once, for their whole lifetime, as a memory object can only be mapped once.
+	if (dc->memprops.memoryTypes[tp].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+	{
+		const VkResult res_map = vkMapMemory(dc->devi, b->mem, 0, VK_WHOLE_SIZE, 0, &b->mapped);
+		if (res_map != VK_SUCCESS)
+		{
+			fprintf(stderr, "vkMapMemory of a block of memory type %u failed (%d).\n", tp, res_map);
+			vkFreeMemory(dc->devi, b->mem, 0);
+			b->mem = 0;
+			b->mapped = 0;
+			dc->arenastats.livedevallocs--;
+			dc->arenastats.heapusage[heap] -= blocksz;
+			return -1;
+		}
+	}
+
+	char tag[32];
+	snprintf(tag, sizeof(tag), "arena block %d", idx);
+	LABEL_OBJ(dc, b->mem, VK_OBJECT_TYPE_DEVICE_MEMORY, tag);
+	if (dc->verbose)
+		fprintf(stderr, "arena: new block %d of %lu MiB from memory type %u\n", idx, blocksz / (1024*1024), tp);
+	return idx;
+}
+
+
+// Carve sz bytes aligned to align out of block b, first fit.
+static int arena_carve(devctx_t* dc, int bidx, VkDeviceSize sz, VkDeviceSize align, suballoc_t* sa)
+{
+	block_t* b = dc->blocks + bidx;
+	for (uint32_t i=0; i<b->numfree; ++i)
+	{
+		range_t* r = b->freelist + i;
+		const VkDeviceSize start = align_up(r->offset, align);
+		if (start + sz > r->offset + r->size)
+			continue;
+		// Alignment padding at the front stays with the allocation, so the free list never grows here.
+		sa->mem = b->mem;
+		sa->offset = start;
+		sa->size = sz;
+		sa->mapped = b->mapped ? (char*)b->mapped + start : 0;
+		sa->block = bidx;
+		sa->reserved.offset = r->offset;
+		sa->reserved.size = start + sz - r->offset;
+		r->offset += sa->reserved.size;
+		r->size -= sa->reserved.size;
+		if (!r->size)
+		{
+			memmove(r, r+1, (b->numfree - i - 1) * sizeof(range_t));
+			b->numfree--;
+		}
+		b->numallocs++;
+		dc->arenastats.suballocs++;
+		dc->arenastats.inuse += sa->reserved.size;
+		return 1;
+	}
+	return 0;
+}
+
+
+// Sub-allocate memory that satisfies the requirements, from memory type tp.
+static int arena_alloc(devctx_t* dc, const VkMemoryRequirements* memreqs, uint32_t tp, suballoc_t* sa)
+{
+	// Buffers and images that share a block must be bufferImageGranularity apart, and
+	// mapped ranges can only be flushed at nonCoherentAtomSize granularity.
+	VkDeviceSize align = memreqs->alignment;
+	if (dc->dprops.limits.bufferImageGranularity > align)
+		align = dc->dprops.limits.bufferImageGranularity;
+	if (dc->memprops.memoryTypes[tp].propertyFlags & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT)
+		if (dc->dprops.limits.nonCoherentAtomSize > align)
+			align = dc->dprops.limits.nonCoherentAtomSize;
+	const VkDeviceSize sz = align_up(memreqs->size, align);
+
+	pthread_mutex_lock(&dc->arenalock);
+	int found = 0;
+	for (uint32_t i=0; i<dc->numblocks && !found; ++i)
+		if (dc->blocks[i].mem && dc->blocks[i].memtype == tp)
+			found = arena_carve(dc, i, sz, align, sa);
+	if (!found)
+	{
+		const int bidx = arena_add_block(dc, tp, sz);
+		if (bidx >= 0)
+		{
+			found = arena_carve(dc, bidx, sz, align, sa);
+			assert(found);
+		}
+	}
+	pthread_mutex_unlock(&dc->arenalock);
+	if (found)
+		sa->size = memreqs->size;
+	return found;
+}
+
+
+// Return a sub-allocation to its block, coalescing with neighbouring free ranges.
+static void arena_free(devctx_t* dc, suballoc_t* sa)
+{
+	pthread_mutex_lock(&dc->arenalock);
+	block_t* b = dc->blocks + sa->block;
+	assert(b->mem == sa->mem);
+	const range_t r = sa->reserved;
+
+	// Find the first free range past us.
+	uint32_t i=0;
+	while (i<b->numfree && b->freelist[i].offset < r.offset)
+		++i;
+	const int joinprev = i>0 && b->freelist[i-1].offset + b->freelist[i-1].size == r.offset;
+	const int joinnext = i<b->numfree && r.offset + r.size == b->freelist[i].offset;
+	if (joinprev && joinnext)
+	{
+		b->freelist[i-1].size += r.size + b->freelist[i].size;
+		memmove(b->freelist+i, b->freelist+i+1, (b->numfree - i - 1) * sizeof(range_t));
+		b->numfree--;
+	}
+	else if (joinprev)
+		b->freelist[i-1].size += r.size;
+	else if (joinnext)
+	{
+		b->freelist[i].offset = r.offset;
+		b->freelist[i].size += r.size;
+	}
+	else if (b->numfree < ARENA_MAXRANGES)
+	{
+		memmove(b->freelist+i+1, b->freelist+i, (b->numfree - i) * sizeof(range_t));
+		b->freelist[i] = r;
+		b->numfree++;
+	}
+	else
+	{
+		// No room for another range. It can not be handed out again until the whole block is free.
+		b->lost += r.size;
+		dc->arenastats.lost += r.size;
+	}
+	b->numallocs--;
+	dc->arenastats.frees++;
+	dc->arenastats.inuse -= r.size;
+	if (!b->numallocs && b->lost)
+	{
+		b->freelist[0].offset = 0;
+		b->freelist[0].size = b->size;
+		b->numfree = 1;
+		dc->arenastats.lost -= b->lost;
+		b->lost = 0;
+	}
+
+	// Oversized blocks are not worth keeping around once empty.
+	if (!b->numallocs && b->size > ARENA_BLOCKSZ)
+	{
+		if (b->mapped)
+			vkUnmapMemory(dc->devi, b->mem);
+		vkFreeMemory(dc->devi, b->mem, 0);
+		b->mem = 0;
+		dc->arenastats.livedevallocs--;
+		dc->arenastats.heapusage[dc->memprops.memoryTypes[b->memtype].heapIndex] -= b->size;
+	}
+	pthread_mutex_unlock(&dc->arenalock);
+	memset(sa, 0, sizeof(suballoc_t));
+}
+
+
+// Fill in the mapped ranges of a host-visible sub-allocation that cover the ranges, in whole atoms.
+static void arena_ranges(devctx_t* dc, const suballoc_t* sa, const range_t* ranges, uint32_t numranges, VkMappedMemoryRange* rngs)
+{
+	const VkDeviceSize atom = dc->dprops.limits.nonCoherentAtomSize;
+	assert(sa->mapped);
+	for (uint32_t i=0; i<numranges; ++i)
+	{
+		const VkDeviceSize beg = ranges[i].offset / atom * atom;
+		const VkDeviceSize end = align_up(ranges[i].offset + ranges[i].size, atom);
+		rngs[i].sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+		rngs[i].pNext = 0;
+		rngs[i].memory = sa->mem;
+		rngs[i].offset = sa->offset + beg;
+		rngs[i].size = end - beg;
+	}
+}
+
+
+// Flush host writes to ranges of a host-visible sub-allocation, with one call.
+static void arena_flush_ranges(devctx_t* dc, const suballoc_t* sa, const range_t* ranges, uint32_t numranges)
+{
+	assert(numranges <= DIRTY_MAX);
+	VkMappedMemoryRange rngs[DIRTY_MAX];
+	arena_ranges(dc, sa, ranges, numranges, rngs);
+	const VkResult resflush = vkFlushMappedMemoryRanges
+	(
+		dc->devi,
+		numranges,
+		rngs
+	);
+	CHECK_VK(resflush);
+}
+
+
+// Make device writes to ranges of a host-visible sub-allocation visible to the host, with one call.
+static void arena_invalidate_ranges(devctx_t* dc, const suballoc_t* sa, const range_t* ranges, uint32_t numranges)
+{
+	assert(numranges <= DIRTY_MAX);
+	VkMappedMemoryRange rngs[DIRTY_MAX];
+	arena_ranges(dc, sa, ranges, numranges, rngs);
+	const VkResult resinval = vkInvalidateMappedMemoryRanges
+	(
+		dc->devi,
+		numranges,
+		rngs
+	);
+	CHECK_VK(resinval);
+}
+
+
+// Flush host writes to [offset,offset+sz) of a host-visible sub-allocation.
+static void arena_flush(devctx_t* dc, const suballoc_t* sa, VkDeviceSize offset, VkDeviceSize sz)
+{
+	const range_t r = { offset, sz };
+	arena_flush_ranges(dc, sa, &r, 1);
+}
+
+
+// Make device writes to [offset,offset+sz) of a host-visible sub-allocation visible to the host.
+static void arena_invalidate(devctx_t* dc, const suballoc_t* sa, VkDeviceSize offset, VkDeviceSize sz)
+{
+	const range_t r = { offset, sz };
+	arena_invalidate_ranges(dc, sa, &r, 1);
+}
+
+
+// Report on allocations saved, and fragmentation of the free space.
+static void arena_report(devctx_t* dc)
+{
+	VkDeviceSize reserved = 0;
+	VkDeviceSize totalfree = 0;
+	VkDeviceSize largestfree = 0;
+	uint32_t numranges = 0;
+	for (uint32_t i=0; i<dc->numblocks; ++i)
+	{
+		const block_t* b = dc->blocks + i;
+		if (!b->mem)
+			continue;
+		reserved += b->size;
+		numranges += b->numfree;
+		for (uint32_t j=0; j<b->numfree; ++j)
+		{
+			totalfree += b->freelist[j].size;
+			if (b->freelist[j].size > largestfree)
+				largestfree = b->freelist[j].size;
+		}
+	}
+	// Fragmentation: the part of the free space that can not be handed out in one piece.
+	const float frag = totalfree ? 1.0f - largestfree / (float)totalfree : 0.0f;
+	fprintf
+	(
+		stderr,
+		"arena: %lu sub-allocations (%lu freed) using %lu vkAllocateMemory calls, %ld saved.\n",
+		dc->arenastats.suballocs, dc->arenastats.frees, dc->arenastats.devallocs,
+		(int64_t)dc->arenastats.suballocs - (int64_t)dc->arenastats.devallocs
+	);
+	fprintf
+	(
+		stderr,
+		"arena: %lu KiB reserved, %lu KiB in use, %u free ranges, fragmentation %.1f%%\n",
+		reserved / 1024, dc->arenastats.inuse / 1024, numranges, 100.0f * frag
+	);
+	if (dc->arenastats.lost)
+		fprintf(stderr, "arena: %lu KiB lost, freed while their block had %d free ranges already.\n", dc->arenastats.lost / 1024, ARENA_MAXRANGES);
+}
+
+
+// Release all blocks.
+static void arena_destroy(devctx_t* dc)
+{
+	for (uint32_t i=0; i<dc->numblocks; ++i)
+	{
+		block_t* b = dc->blocks + i;
+		if (!b->mem)
+			continue;
+		if (b->numallocs)
+			fprintf(stderr, "arena: block %u still has %u live sub-allocations.\n", i, b->numallocs);
+		if (b->mapped)
+			vkUnmapMemory(dc->devi, b->mem);
+		vkFreeMemory(dc->devi, b->mem, 0);
+		b->mem = 0;
+	}
+	dc->numblocks = 0;
+	dc->arenastats.livedevallocs = 0;
+	memset(dc->arenastats.heapusage, 0, sizeof(dc->arenastats.heapusage));
+}
+
+#pragma mark Memory placement
+
+// What a buffer is used for, which determines where we want it to live.
+typedef enum
+{
+	MEM_DEVICE=0,		// Only ever accessed by the device.
+	MEM_UPLOAD,		// Written once by the host, read by the device. E.g. a staging source.
+	MEM_READBACK,		// Written by the device, read by the host.
+	MEM_STREAM,		// Written by the host every dispatch, and read by the device directly.
+	MEM_NUMROLES
+} memrole_t;
+
+static const char* memrolenames[MEM_NUMROLES] =
+{
+	"device",
+	"upload",
+	"readback",
+	"stream",
+};
+
+// Per role: the flags we want, and the flags we would rather not have.
+static const VkMemoryPropertyFlags memrole_prefer[MEM_NUMROLES] =
+{
+	VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+};
+static const VkMemoryPropertyFlags memrole_avoid[MEM_NUMROLES] =
+{
+	VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT,	// Leave the BAR for the buffers that need it.
+	VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT | VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+	0,
+	VK_MEMORY_PROPERTY_HOST_CACHED_BIT,
+};
+
+static int role_needs_host(memrole_t role)
+{
+	return role != MEM_DEVICE;
+}
+
+
+// How many bytes can we still allocate from a heap?
+static VkDeviceSize heap_room(devctx_t* dc, uint32_t heap)
+{
+	if (dc->has_memory_budget)
+	{
+		// The budget accounts for other processes, and for our own allocations.
+		VkPhysicalDeviceMemoryBudgetPropertiesEXT budget;
+		budget.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_BUDGET_PROPERTIES_EXT;
+		budget.pNext = 0;
+		VkPhysicalDeviceMemoryProperties2 mp2;
+		mp2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_MEMORY_PROPERTIES_2;
+		mp2.pNext = &budget;
+		vkGetPhysicalDeviceMemoryProperties2(dc->pdev, &mp2);
+		const VkDeviceSize b = budget.heapBudget[heap];
+		const VkDeviceSize u = budget.heapUsage[heap];
+		return b > u ? b - u : 0;
+	}
+	// Without the extension, stay clear of the last 20% of the heap, which is shared with everyone else.
+	const VkDeviceSize limit = dc->memprops.memoryHeaps[heap].size / 10 * 8;
+	const VkDeviceSize used = dc->arenastats.heapusage[heap];
+	return limit > used ? limit - used : 0;
+}
+
+
+// Rank the memory types allowed by typebits for a role, best first. Returns the number of candidates.
+static uint32_t rank_memory_types(devctx_t* dc, uint32_t typebits, memrole_t role, uint32_t* ranked)
+{
+	int scores[VK_MAX_MEMORY_TYPES];
+	uint32_t cnt = 0;
+	for (uint32_t mt=0; mt<dc->mtcnt; ++mt)
+	{
+		if (!(typebits & (1U<<mt)))
+			continue;
+		const VkMemoryPropertyFlags fl = dc->memprops.memoryTypes[mt].propertyFlags;
+		const VkMemoryPropertyFlags known =
+			VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT |
+			VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT |
+			VK_MEMORY_PROPERTY_HOST_COHERENT_BIT |
+			VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+		if (fl & ~known)
+			continue;	// Lazily allocated, protected, or vendor specific.
+		const int hostvis = (fl & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT) != 0;
+		if (role == MEM_UPLOAD && !hostvis)
+			continue;	// A staging buffer that needs staging itself is no use.
+		int score = 0;
+		score += 2 * __builtin_popcount(fl & memrole_prefer[role]);
+		score -= 1 * __builtin_popcount(fl & memrole_avoid[role]);
+		if (role_needs_host(role) && !hostvis)
+			score -= 100;	// Only reachable through a staging copy.
+		// Insertion sort, stable, so that the driver's own ordering breaks ties.
+		uint32_t i = cnt++;
+		while (i>0 && scores[i-1] < score)
+		{
+			scores[i] = scores[i-1];
+			ranked[i] = ranked[i-1];
+			--i;
+		}
+		scores[i] = score;
+		ranked[i] = mt;
+	}
+	return cnt;
+}
+
+#pragma mark Buffer creation
+
+void rm_buffer(devctx_t* dc, VkBuffer buff, suballoc_t* alloc);
+
+
+// Create a buffer for specified usage, place it in memory that suits its role, and bind it.
+// If the role wants host access, but only device memory was available, alloc->mapped is 0
+// and the data has to go through upload_buffer() / download_buffer() instead.
+// Returns -1 if no memory type has room for it.
+int mk_buffer
+(
+	devctx_t* dc,
+	VkBufferUsageFlags usageFlags,			// How to use buffer?
+	memrole_t role,					// Who reads and writes it?
+	VkDeviceSize sz,				// Size of the buffer.
+	VkBuffer* buff,					// Out: buffer
+	suballoc_t* alloc,				// Out: memory
+	const char* tag					// Debug name
+)
+{
+	// Buffers that the host wants to access may end up needing a staging copy.
+	if (role_needs_host(role))
+		usageFlags |= VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+
+	// Create the buffer.
+	const VkBufferCreateFlags createFlags = 0;
+	const VkBufferCreateInfo bci =
+	{
+		VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		0,					// pNext
+		createFlags,
+		sz,
+		usageFlags,
+		VK_SHARING_MODE_EXCLUSIVE,		// only one queue will use it.
+		0,					// queue family index count.
+		0					// queue family indices.
+	};
+	const VkResult res_crbuf = vkCreateBuffer
+	(
+		dc->devi,
+		&bci,
+		0,
+		buff
+	);
+	if (res_crbuf != VK_SUCCESS)
+	{
+		fprintf(stderr, "Cannot create a buffer of %lu bytes for %s (%d).\n", sz, tag, res_crbuf);
+		return -1;
+	}
+
+	// Check mem requirements for it.
+	VkMemoryRequirements memreqs;
+	vkGetBufferMemoryRequirements(dc->devi, *buff, &memreqs);
+	if (dc->verbose)
+		fprintf
+		(
+			stderr,
+			"reqs: size=%lu align=%lu memtp=0x%x\n",
+			memreqs.size, memreqs.alignment, memreqs.memoryTypeBits
+		);
+
+	// Try the memory types in order of preference, until one has room.
+	uint32_t ranked[VK_MAX_MEMORY_TYPES];
+	const uint32_t numranked = rank_memory_types(dc, memreqs.memoryTypeBits, role, ranked);
+	int tp = -1;
+	for (uint32_t i=0; i<numranked && tp<0; ++i)
+		if (arena_alloc(dc, &memreqs, ranked[i], alloc))
+			tp = ranked[i];
+	if (tp<0)
+	{
+		fprintf(stderr, "Cannot find memory for %lu bytes of %s buffer %s.\n", memreqs.size, memrolenames[role], tag);
+		vkDestroyBuffer(dc->devi, *buff, 0);
+		*buff = VK_NULL_HANDLE;
+		return -1;
+	}
+	const int staged = role_needs_host(role) && !alloc->mapped;
+	if (dc->verbose)
+		fprintf(stderr, "Using memory type index %d for %s buffer %s%s\n", tp, memrolenames[role], tag, staged ? " (staged)" : "");
+
+	// Bind it.
+	const VkResult res_bind = vkBindBufferMemory
+	(
+		dc->devi,
+		*buff,
+		alloc->mem,
+		alloc->offset
+	);
+	if (res_bind != VK_SUCCESS)
+	{
+		fprintf(stderr, "Cannot bind the memory of buffer %s (%d).\n", tag, res_bind);
+		rm_buffer(dc, *buff, alloc);
+		*buff = VK_NULL_HANDLE;
+		return -1;
+	}
+
+	LABEL_OBJ(dc, *buff,   VK_OBJECT_TYPE_BUFFER,        tag);
+	return 0;
+}
+
+
+// Destroy a buffer made with mk_buffer() and return its memory to the arena.
+void rm_buffer(devctx_t* dc, VkBuffer buff, suballoc_t* alloc)
+{
+	vkDestroyBuffer(dc->devi, buff, 0);
+	arena_free(dc, alloc);
+}
+
+#pragma mark Staging
+
+static void staging_destroy(devctx_t* dc)
+{
+	for (int i=0; i<2; ++i)
+		if (dc->stagingSemas[i])
+			vkDestroySemaphore(dc->devi, dc->stagingSemas[i], 0);
+	if (dc->stagingFence)
+		vkDestroyFence(dc->devi, dc->stagingFence, 0);
+	if (dc->stagingOwnerPool)
+		vkDestroyCommandPool(dc->devi, dc->stagingOwnerPool, 0);
+	if (dc->stagingPool)
+		vkDestroyCommandPool(dc->devi, dc->stagingPool, 0);
+	dc->stagingSemas[0] = dc->stagingSemas[1] = VK_NULL_HANDLE;
+	dc->stagingFence = VK_NULL_HANDLE;
+	dc->stagingOwnerPool = dc->stagingPool = VK_NULL_HANDLE;
+}
+
+
+// Made on the first staging copy. Returns -1 if they can not be made.
+static int staging_init(devctx_t* dc)
+{
+	const VkCommandPoolCreateInfo cpci[2] =
+	{
+		{ VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, 0, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT, dc->xfam },
+		{ VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO, 0, VK_COMMAND_POOL_CREATE_TRANSIENT_BIT, dc->qfam },
+	};
+	const VkFenceCreateInfo fci = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, 0, 0 };
+	const VkSemaphoreCreateInfo sci = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, 0, 0 };
+	if
+	(
+		vkCreateCommandPool(dc->devi, cpci + 0, 0, &dc->stagingPool) != VK_SUCCESS ||
+		vkCreateCommandPool(dc->devi, cpci + 1, 0, &dc->stagingOwnerPool) != VK_SUCCESS ||
+		vkCreateFence(dc->devi, &fci, 0, &dc->stagingFence) != VK_SUCCESS ||
+		vkCreateSemaphore(dc->devi, &sci, 0, dc->stagingSemas + 0) != VK_SUCCESS ||
+		vkCreateSemaphore(dc->devi, &sci, 0, dc->stagingSemas + 1) != VK_SUCCESS
+	)
+	{
+		fprintf(stderr, "Cannot create the pools, fence and semaphores of the staging copies.\n");
+		staging_destroy(dc);
+		return -1;
+	}
+	LABEL_OBJ(dc, dc->stagingPool, VK_OBJECT_TYPE_COMMAND_POOL, "staging copies");
+	LABEL_OBJ(dc, dc->stagingOwnerPool, VK_OBJECT_TYPE_COMMAND_POOL, "staging hand-overs");
+	return 0;
+}
+
+
+// Record a barrier over the regions of the device buffer of a staging copy. With srcFam != dstFam, it is the release
+// or the acquire half of a queue family ownership transfer.
+static void staging_barrier
+(
+	VkCommandBuffer cb,
+	VkBuffer buf,
+	const VkBufferCopy* regions,
+	uint32_t numregions,
+	int toDevice,
+	VkPipelineStageFlags srcStage,
+	VkAccessFlags srcAccess,
+	VkPipelineStageFlags dstStage,
+	VkAccessFlags dstAccess,
+	uint32_t srcFam,
+	uint32_t dstFam
+)
+{
+	assert(numregions <= DIRTY_MAX);
+	VkBufferMemoryBarrier bmb[DIRTY_MAX];
+	for (uint32_t i=0; i<numregions; ++i)
+	{
+		bmb[i].sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+		bmb[i].pNext = 0;
+		bmb[i].srcAccessMask = srcAccess;
+		bmb[i].dstAccessMask = dstAccess;
+		bmb[i].srcQueueFamilyIndex = srcFam;
+		bmb[i].dstQueueFamilyIndex = dstFam;
+		bmb[i].buffer = buf;
+		bmb[i].offset = toDevice ? regions[i].dstOffset : regions[i].srcOffset;
+		bmb[i].size = regions[i].size;
+	}
+	vkCmdPipelineBarrier(cb, srcStage, dstStage, 0, 0, 0, numregions, bmb, 0, 0);
+}
+
+
+// Copy regions between a device buffer and a staging buffer on the transfer queue, and wait for it. Returns -1 if the
+// copy can not be submitted.
+// The device buffer belongs to the family of the compute queue. Where the transfer queue is of another family, the
+// compute queue hands the regions over to it first, for a download, and takes them back after, with semaphores in
+// between. Uploads overwrite the regions, so they need not be handed over first.
+static int copy_and_wait(devctx_t* dc, VkBuffer src, VkBuffer dst, const VkBufferCopy* regions, uint32_t numregions, int toDevice)
+{
+	const int handover = dc->xfam != dc->qfam;
+	const VkBuffer devbuf = toDevice ? dst : src;
+	pthread_mutex_lock(&dc->staginglock);
+	if (!dc->stagingPool && staging_init(dc) < 0)
+	{
+		pthread_mutex_unlock(&dc->staginglock);
+		return -1;
+	}
+	// The copy, and the hand-overs before and after it.
+	VkCommandBuffer cb = VK_NULL_HANDLE;
+	VkCommandBuffer owncbs[2] = { VK_NULL_HANDLE, VK_NULL_HANDLE };
+	const VkCommandBufferAllocateInfo cbai[2] =
+	{
+		{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, 0, dc->stagingPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 1 },
+		{ VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO, 0, dc->stagingOwnerPool, VK_COMMAND_BUFFER_LEVEL_PRIMARY, 2 },
+	};
+	VkResult res = vkAllocateCommandBuffers(dc->devi, cbai + 0, &cb);
+	if (res == VK_SUCCESS && handover)
+		res = vkAllocateCommandBuffers(dc->devi, cbai + 1, owncbs);
+	if (res != VK_SUCCESS)
+	{
+		fprintf(stderr, "Cannot allocate the command buffers of a staging copy (%d).\n", res);
+		if (cb)
+			vkFreeCommandBuffers(dc->devi, dc->stagingPool, 1, &cb);
+		pthread_mutex_unlock(&dc->staginglock);
+		return -1;
+	}
+	const VkCommandBufferBeginInfo cbbi =
+	{
+		VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		0,
+		VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+		0
+	};
+	res = vkBeginCommandBuffer(cb, &cbbi);
+	for (int i=0; i<2 && handover && res == VK_SUCCESS; ++i)
+		res = vkBeginCommandBuffer(owncbs[i], &cbbi);
+	if (res == VK_SUCCESS)
+	{
+		// Order the copy against the compute work that wrote the buffer before, or that reads it after.
+		const VkMemoryBarrier mb =
+		{
+			VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+			0,
+			toDevice ? VK_ACCESS_TRANSFER_WRITE_BIT : VK_ACCESS_SHADER_WRITE_BIT,
+			toDevice ? VK_ACCESS_SHADER_READ_BIT : VK_ACCESS_TRANSFER_READ_BIT,
+		};
+		const VkMemoryBarrier hostmb = { VK_STRUCTURE_TYPE_MEMORY_BARRIER, 0, VK_ACCESS_TRANSFER_WRITE_BIT, VK_ACCESS_HOST_READ_BIT };
+		const VkAccessFlags shaderAccess = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT;
+		if (!toDevice && handover)
+		{
+			staging_barrier(owncbs[0], devbuf, regions, numregions, 0, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, dc->qfam, dc->xfam);
+			staging_barrier(cb, devbuf, regions, numregions, 0, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT, dc->qfam, dc->xfam);
+		}
+		else if (!toDevice)
+			vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 1, &mb, 0, 0, 0, 0);
+		vkCmdCopyBuffer(cb, src, dst, numregions, regions);
+		if (!toDevice)
+			vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &hostmb, 0, 0, 0, 0);
+		if (handover)
+		{
+			const VkAccessFlags written = toDevice ? VK_ACCESS_TRANSFER_WRITE_BIT : 0;
+			staging_barrier(cb, devbuf, regions, numregions, toDevice, VK_PIPELINE_STAGE_TRANSFER_BIT, written, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, dc->xfam, dc->qfam);
+			staging_barrier(owncbs[1], devbuf, regions, numregions, toDevice, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, shaderAccess, dc->xfam, dc->qfam);
+		}
+		else if (toDevice)
+			vkCmdPipelineBarrier(cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0, 1, &mb, 0, 0, 0, 0);
+		res = vkEndCommandBuffer(cb);
+		for (int i=0; i<2 && handover && res == VK_SUCCESS; ++i)
+			res = vkEndCommandBuffer(owncbs[i]);
+	}
+
+	// Release on the compute queue, copy on the transfer queue, and acquire on the compute queue. Without a
+	// hand-over, only the copy.
+	const VkPipelineStageFlags xferStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	const VkPipelineStageFlags computeStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	const int release = handover && !toDevice;
+	const VkSubmitInfo si[3] =
+	{
+		{ VK_STRUCTURE_TYPE_SUBMIT_INFO, 0, 0, 0, 0, 1, owncbs + 0, 1, dc->stagingSemas + 0 },
+		{ VK_STRUCTURE_TYPE_SUBMIT_INFO, 0, release ? 1 : 0, dc->stagingSemas + 0, &xferStage, 1, &cb, handover ? 1 : 0, dc->stagingSemas + 1 },
+		{ VK_STRUCTURE_TYPE_SUBMIT_INFO, 0, 1, dc->stagingSemas + 1, &computeStage, 1, owncbs + 1, 0, 0 },
+	};
+	int submitted = 0;
+	if (res == VK_SUCCESS && release)
+	{
+		res = queue_submit(&dc->queues, dc->queue, 1, si + 0, VK_NULL_HANDLE);
+		submitted += res == VK_SUCCESS;
+	}
+	if (res == VK_SUCCESS)
+	{
+		res = queue_submit(&dc->queues, dc->xqueue, 1, si + 1, handover ? VK_NULL_HANDLE : dc->stagingFence);
+		submitted += res == VK_SUCCESS;
+	}
+	if (res == VK_SUCCESS && handover)
+		res = queue_submit(&dc->queues, dc->queue, 1, si + 2, dc->stagingFence);
+	if (res == VK_SUCCESS)
+	{
+		const VkResult res_wf = vkWaitForFences(dc->devi, 1, &dc->stagingFence, VK_TRUE, ~0ULL);
+		CHECK_VK(res_wf);
+		const VkResult res_rf = vkResetFences(dc->devi, 1, &dc->stagingFence);
+		CHECK_VK(res_rf);
+	}
+	else
+		fprintf(stderr, "Cannot submit a staging copy (%d).\n", res);
+	if (res != VK_SUCCESS && submitted)
+	{
+		// What did get submitted can leave a semaphore signalled. Start over with new ones, once it is done.
+		queue_wait_idle(&dc->queues, dc->queue);
+		queue_wait_idle(&dc->queues, dc->xqueue);
+		staging_destroy(dc);
+	}
+	else
+	{
+		vkFreeCommandBuffers(dc->devi, dc->stagingPool, 1, &cb);
+		if (handover)
+			vkFreeCommandBuffers(dc->devi, dc->stagingOwnerPool, 2, owncbs);
+	}
+	pthread_mutex_unlock(&dc->staginglock);
+	return res == VK_SUCCESS ? 0 : -1;
+}
+
+
+// A host-visible staging buffer of sz bytes. Returns -1 if there is no room for it in host-visible memory.
+static int mk_staging(devctx_t* dc, memrole_t role, VkDeviceSize sz, VkBuffer* stg, suballoc_t* stgmem, const char* tag)
+{
+	const VkBufferUsageFlags usage = role == MEM_UPLOAD ? VK_BUFFER_USAGE_TRANSFER_SRC_BIT : VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+	if (mk_buffer(dc, usage, role, sz, stg, stgmem, tag) < 0)
+		return -1;
+	if (stgmem->mapped)
+		return 0;
+	fprintf(stderr, "Staging buffer %s is not host-visible.\n", tag);
+	rm_buffer(dc, *stg, stgmem);
+	return -1;
+}
+
+
+// Write host data into a buffer, directly if it is mapped, or else through a staging buffer. Returns -1 on failure.
+static int upload_buffer(devctx_t* dc, VkBuffer buff, const suballoc_t* alloc, VkDeviceSize offset, const void* data, VkDeviceSize sz)
+{
+	if (alloc->mapped)
+	{
+		memcpy((char*)alloc->mapped + offset, data, sz);
+		arena_flush(dc, alloc, offset, sz);
+		return 0;
+	}
+	VkBuffer stg;
+	suballoc_t stgmem;
+	if (mk_staging(dc, MEM_UPLOAD, sz, &stg, &stgmem, "upload staging") < 0)
+		return -1;
+	memcpy(stgmem.mapped, data, sz);
+	arena_flush(dc, &stgmem, 0, sz);
+	const VkBufferCopy region = { 0, offset, sz };
+	const int res = copy_and_wait(dc, stg, buff, &region, 1, 1);
+	rm_buffer(dc, stg, &stgmem);
+	return res;
+}
+
+
+// Read device data from a buffer, directly if it is mapped, or else through a staging buffer. Returns -1 on failure.
+static int download_buffer(devctx_t* dc, VkBuffer buff, const suballoc_t* alloc, VkDeviceSize offset, void* data, VkDeviceSize sz)
+{
+	if (alloc->mapped)
+	{
+		arena_invalidate(dc, alloc, offset, sz);
+		memcpy(data, (const char*)alloc->mapped + offset, sz);
+		return 0;
+	}
+	VkBuffer stg;
+	suballoc_t stgmem;
+	if (mk_staging(dc, MEM_READBACK, sz, &stg, &stgmem, "readback staging") < 0)
+		return -1;
+	const VkBufferCopy region = { offset, 0, sz };
+	const int res = copy_and_wait(dc, buff, stg, &region, 1, 0);
+	if (!res)
+	{
+		arena_invalidate(dc, &stgmem, 0, sz);
+		memcpy(data, stgmem.mapped, sz);
+	}
+	rm_buffer(dc, stg, &stgmem);
+	return res;
+}
+
+
+// Write ranges of host data into a buffer, at the same offsets, like upload_buffer(). The ranges share one
+// flush, or one staging buffer and one copy.
+static int upload_ranges(devctx_t* dc, VkBuffer buff, const suballoc_t* alloc, const void* data, const range_t* ranges, uint32_t numranges)
+{
+	if (!numranges)
+		return 0;
+	if (alloc->mapped)
+	{
+		for (uint32_t i=0; i<numranges; ++i)
+			memcpy((char*)alloc->mapped + ranges[i].offset, (const char*)data + ranges[i].offset, ranges[i].size);
+		arena_flush_ranges(dc, alloc, ranges, numranges);
+		return 0;
+	}
+	assert(numranges <= DIRTY_MAX);
+	VkBufferCopy regions[DIRTY_MAX];
+	VkDeviceSize sz = 0;
+	for (uint32_t i=0; i<numranges; ++i)
+	{
+		regions[i].srcOffset = sz;
+		regions[i].dstOffset = ranges[i].offset;
+		regions[i].size = ranges[i].size;
+		sz += ranges[i].size;
+	}
+	VkBuffer stg;
+	suballoc_t stgmem;
+	if (mk_staging(dc, MEM_UPLOAD, sz, &stg, &stgmem, "upload staging") < 0)
+		return -1;
+	for (uint32_t i=0; i<numranges; ++i)
+		memcpy((char*)stgmem.mapped + regions[i].srcOffset, (const char*)data + ranges[i].offset, ranges[i].size);
+	arena_flush(dc, &stgmem, 0, sz);
+	const int res = copy_and_wait(dc, stg, buff, regions, numranges, 1);
+	rm_buffer(dc, stg, &stgmem);
+	return res;
+}
+
+
+// Read ranges of a buffer into host memory, at the same offsets, like download_buffer().
+static int download_ranges(devctx_t* dc, VkBuffer buff, const suballoc_t* alloc, void* data, const range_t* ranges, uint32_t numranges)
+{
+	if (!numranges)
+		return 0;
+	if (alloc->mapped)
+	{
+		arena_invalidate_ranges(dc, alloc, ranges, numranges);
+		for (uint32_t i=0; i<numranges; ++i)
+			memcpy((char*)data + ranges[i].offset, (const char*)alloc->mapped + ranges[i].offset, ranges[i].size);
+		return 0;
+	}
+	assert(numranges <= DIRTY_MAX);
+	VkBufferCopy regions[DIRTY_MAX];
+	VkDeviceSize sz = 0;
+	for (uint32_t i=0; i<numranges; ++i)
+	{
+		regions[i].srcOffset = ranges[i].offset;
+		regions[i].dstOffset = sz;
+		regions[i].size = ranges[i].size;
+		sz += ranges[i].size;
+	}
+	VkBuffer stg;
+	suballoc_t stgmem;
+	if (mk_staging(dc, MEM_READBACK, sz, &stg, &stgmem, "readback staging") < 0)
+		return -1;
+	const int res = copy_and_wait(dc, buff, stg, regions, numranges, 0);
+	if (!res)
+	{
+		arena_invalidate(dc, &stgmem, 0, sz);
+		for (uint32_t i=0; i<numranges; ++i)
+			memcpy((char*)data + ranges[i].offset, (const char*)stgmem.mapped + regions[i].dstOffset, ranges[i].size);
+	}
+	rm_buffer(dc, stg, &stgmem);
+	return res;
+}
+
+
+// Wrap host memory in a buffer, without a copy. Returns 0 if the device can not import this memory. Only memory that
+// starts and ends on the import alignment will do, as the import takes whole units of it, and the caller owns no more.
+static int import_host_buffer(devctx_t* dc, void* ptr, VkDeviceSize sz, VkBufferUsageFlags usageFlags, VkBuffer* buff, VkDeviceMemory* mem)
+{
+	if (!dc->has_host_import)
+		return 0;
+	if ((uintptr_t)ptr % dc->hostimportalign)
+	{
+		fprintf(stderr, "Can not import host memory at %p, as it is not aligned to %lu bytes.\n", ptr, dc->hostimportalign);
+		return 0;
+	}
+	if (sz % dc->hostimportalign)
+	{
+		fprintf(stderr, "Can not import %lu bytes of host memory, as that is not a multiple of %lu bytes.\n", sz, dc->hostimportalign);
+		return 0;
+	}
+	VkMemoryHostPointerPropertiesEXT hpp;
+	hpp.sType = VK_STRUCTURE_TYPE_MEMORY_HOST_POINTER_PROPERTIES_EXT;
+	hpp.pNext = 0;
+	const VkResult res_ghpp = dc->pfnGetMemoryHostPointerPropertiesEXT(dc->devi, VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT, ptr, &hpp);
+	if (res_ghpp != VK_SUCCESS)
+		return 0;
+
+	VkExternalMemoryBufferCreateInfo embci;
+	embci.sType = VK_STRUCTURE_TYPE_EXTERNAL_MEMORY_BUFFER_CREATE_INFO;
+	embci.pNext = 0;
+	embci.handleTypes = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+	const VkBufferCreateInfo bci =
+	{
+		VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO,
+		&embci,					// pNext
+		0,					// flags
+		sz,
+		usageFlags,
+		VK_SHARING_MODE_EXCLUSIVE,		// only one queue will use it.
+		0,					// queue family index count.
+		0					// queue family indices.
+	};
+	const VkResult res_crbuf = vkCreateBuffer(dc->devi, &bci, 0, buff);
+	if (res_crbuf != VK_SUCCESS)
+		return 0;
+	VkMemoryRequirements memreqs;
+	vkGetBufferMemoryRequirements(dc->devi, *buff, &memreqs);
+	if (memreqs.size > sz)
+	{
+		fprintf(stderr, "Can not import %lu bytes of host memory, as the buffer needs %lu.\n", sz, memreqs.size);
+		vkDestroyBuffer(dc->devi, *buff, 0);
+		*buff = 0;
+		return 0;
+	}
+
+	// We use the host pointer, never a mapping, so only coherent types will do.
+	int tp = -1;
+	const uint32_t typebits = memreqs.memoryTypeBits & hpp.memoryTypeBits;
+	for (uint32_t i=0; i<dc->mtcnt && tp<0; ++i)
+		if ((typebits & (1U<<i)) && (dc->memprops.memoryTypes[i].propertyFlags & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT))
+			tp = i;
+	VkResult res_alloc = VK_ERROR_OUT_OF_DEVICE_MEMORY;
+	if (tp >= 0)
+	{
+		VkMemoryAllocateFlagsInfo mafi;
+		memset(&mafi, 0, sizeof(mafi));
+		mafi.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_FLAGS_INFO;
+		mafi.flags = VK_MEMORY_ALLOCATE_DEVICE_ADDRESS_BIT;
+		VkImportMemoryHostPointerInfoEXT imhpi;
+		imhpi.sType = VK_STRUCTURE_TYPE_IMPORT_MEMORY_HOST_POINTER_INFO_EXT;
+		imhpi.pNext = dc->has_device_address ? &mafi : 0;
+		imhpi.handleType = VK_EXTERNAL_MEMORY_HANDLE_TYPE_HOST_ALLOCATION_BIT_EXT;
+		imhpi.pHostPointer = ptr;
+		const VkMemoryAllocateInfo mai =
+		{
+			VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO,
+			&imhpi,
+			sz,
+			tp
+		};
+		res_alloc = vkAllocateMemory(dc->devi, &mai, 0, mem);
+	}
+	if (tp < 0)
+		fprintf(stderr, "Can not import host memory at %p: no coherent memory type can hold it.\n", ptr);
+	else if (res_alloc != VK_SUCCESS)
+		fprintf(stderr, "Can not import %lu bytes of host memory at %p (%d).\n", sz, ptr, res_alloc);
+	if (res_alloc != VK_SUCCESS)
+	{
+		vkDestroyBuffer(dc->devi, *buff, 0);
+		*buff = 0;
+		return 0;
+	}
+	const VkResult res_bind = vkBindBufferMemory(dc->devi, *buff, *mem, 0);
+	if (res_bind != VK_SUCCESS)
+	{
+		vkDestroyBuffer(dc->devi, *buff, 0);
+		vkFreeMemory(dc->devi, *mem, 0);
+		*buff = 0;
+		*mem = 0;
+		return 0;
+	}
+	LABEL_OBJ(dc, *buff, VK_OBJECT_TYPE_BUFFER, "imported");
+	fprintf(stderr, "Imported %lu bytes of host memory at %p, using memory type %d.\n", sz, ptr, tp);
+	return 1;
+}
+
+#pragma mark Transfer engine
+
+// A staging buffer in host memory, with the commands that move it to or from a device buffer.
+// Uploads use write-combined memory, downloads use host-cached memory, as reading uncached memory is slow.
+typedef struct
+{
+	memrole_t role;				// MEM_UPLOAD or MEM_READBACK.
+	VkBuffer stgbuf;			// Host side staging buffer.
+	suballoc_t stgmem;			// Its memory.
+	VkDeviceSize stgsz;			// Its size.
+	devctx_t* dc;
+	VkCommandPool pool;			// Of cb, so that the transfers of different threads need no lock.
+	VkCommandBuffer cb;			// Transfer queue commands.
+	VkFence fence;				// Signalled when cb has completed.
+	VkSemaphore sema;			// Signalled when cb has completed, for the compute queue to wait on.
+	int pending;				// Submitted, but not yet waited for.
+} xfer_t;
+
+
+// Queue family ownership is only transferred if the transfer queue is from a different family.
+static void xfer_barrier
+(
+	devctx_t* dc,
+	VkCommandBuffer cb,
+	VkBuffer buf,
+	VkDeviceSize offset,
+	VkDeviceSize sz,
+	VkPipelineStageFlags srcStage,
+	VkAccessFlags srcAccess,
+	VkPipelineStageFlags dstStage,
+	VkAccessFlags dstAccess,
+	uint32_t srcFam,
+	uint32_t dstFam
+)
+{
+	if (dc->xfam == dc->qfam)
+		return;	// Same family: the semaphores between the submits already order and make visible the memory.
+	const VkBufferMemoryBarrier bmb =
+	{
+		VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER,
+		0,
+		srcAccess,
+		dstAccess,
+		srcFam,
+		dstFam,
+		buf,
+		offset,
+		sz
+	};
+	vkCmdPipelineBarrier(cb, srcStage, dstStage, 0, 0, 0, 1, &bmb, 0, 0);
+}
+
+
+// To be recorded on the compute queue, before the dispatch that reads an uploaded buffer.
+static void xfer_acquire_barrier(devctx_t* dc, VkCommandBuffer cb, VkBuffer buf, VkDeviceSize offset, VkDeviceSize sz)
+{
+	xfer_barrier
+	(
+		dc,
+		cb, buf, offset, sz,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, 0,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_READ_BIT,
+		dc->xfam, dc->qfam
+	);
+}
+
+
+// To be recorded on the compute queue, after the dispatch that writes a buffer that is to be downloaded.
+static void xfer_release_barrier(devctx_t* dc, VkCommandBuffer cb, VkBuffer buf, VkDeviceSize offset, VkDeviceSize sz)
+{
+	xfer_barrier
+	(
+		dc,
+		cb, buf, offset, sz,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT, VK_ACCESS_SHADER_WRITE_BIT,
+		VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+		dc->qfam, dc->xfam
+	);
+}
+
+
+// Returns -1 if the staging buffer, or the objects that go with it, can not be made. x can be destroyed either way.
+static int xfer_init(devctx_t* dc, xfer_t* x, memrole_t role, VkDeviceSize stgsz, const char* tag)
+{
+	assert(role == MEM_UPLOAD || role == MEM_READBACK);
+	memset(x, 0, sizeof(xfer_t));
+	x->dc = dc;
+	x->role = role;
+	x->stgsz = stgsz;
+	const VkCommandPoolCreateInfo cpci =
+	{
+		VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		0,
+		VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+		dc->xfam
+	};
+	if (vkCreateCommandPool(dc->devi, &cpci, 0, &x->pool) != VK_SUCCESS)
+	{
+		x->pool = VK_NULL_HANDLE;
+		return -1;
+	}
+	LABEL_OBJ(dc, x->pool, VK_OBJECT_TYPE_COMMAND_POOL, tag);
+	if (mk_staging(dc, role, stgsz, &x->stgbuf, &x->stgmem, tag) < 0)
+	{
+		x->stgbuf = VK_NULL_HANDLE;
+		return -1;
+	}
+
+	const VkCommandBufferAllocateInfo cbai =
+	{
+		VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+		0,
+		x->pool,
+		VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+		1
+	};
+	const VkFenceCreateInfo fci = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, 0, 0 };
+	const VkSemaphoreCreateInfo sci = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, 0, 0 };
+	if
+	(
+		vkAllocateCommandBuffers(dc->devi, &cbai, &x->cb) != VK_SUCCESS ||
+		vkCreateFence(dc->devi, &fci, 0, &x->fence) != VK_SUCCESS ||
+		vkCreateSemaphore(dc->devi, &sci, 0, &x->sema) != VK_SUCCESS
+	)
+	{
+		fprintf(stderr, "Cannot create the commands of transfer %s.\n", tag);
+		return -1;
+	}
+	LABEL_OBJ(dc, x->cb,   VK_OBJECT_TYPE_COMMAND_BUFFER, tag);
+	LABEL_OBJ(dc, x->sema, VK_OBJECT_TYPE_SEMAPHORE,      tag);
+	return 0;
+}
+
+
+// The host side of the staging buffer: write uploads here, read downloads from here.
+static void* xfer_staging(const xfer_t* x)
+{
+	return x->stgmem.mapped;
+}
+
+
+static void xfer_begin(xfer_t* x)
+{
+	assert(!x->pending);
+	const VkResult res_rcb = vkResetCommandBuffer(x->cb, 0);
+	CHECK_VK(res_rcb);
+	const VkCommandBufferBeginInfo cbbi =
+	{
+		VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		0,
+		VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+		0
+	};
+	const VkResult res_bcb = vkBeginCommandBuffer(x->cb, &cbbi);
+	CHECK_VK(res_bcb);
+}
+
+
+// Returns -1 if the commands can not be submitted.
+static int xfer_submit(xfer_t* x, VkSemaphore waitsema)
+{
+	devctx_t* dc = x->dc;
+	VkResult res = vkEndCommandBuffer(x->cb);
+	const VkPipelineStageFlags waitstage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	const VkSubmitInfo si =
+	{
+		VK_STRUCTURE_TYPE_SUBMIT_INFO,
+		0,
+		waitsema ? 1 : 0,		// wait semaphore count
+		&waitsema,
+		&waitstage,
+		1,				// command buffer count
+		&x->cb,
+		x->role == MEM_UPLOAD ? 1 : 0,	// signal semaphore count
+		&x->sema
+	};
+	if (res == VK_SUCCESS)
+		res = queue_submit(&dc->queues, dc->xqueue, 1, &si, x->fence);
+	if (res != VK_SUCCESS)
+	{
+		fprintf(stderr, "Cannot submit a transfer (%d).\n", res);
+		return -1;
+	}
+	x->pending = 1;
+	return 0;
+}
+
+
+// Copy sz bytes, that the host wrote at the start of the staging buffer, to dst.
+// The compute submit that reads dst must wait on x->sema, and record xfer_acquire_barrier() first.
+static int xfer_upload(xfer_t* x, VkBuffer dst, VkDeviceSize dstoff, VkDeviceSize sz)
+{
+	devctx_t* dc = x->dc;
+	assert(x->role == MEM_UPLOAD && sz <= x->stgsz);
+	arena_flush(dc, &x->stgmem, 0, sz);
+	xfer_begin(x);
+	const VkBufferCopy region = { 0, dstoff, sz };
+	vkCmdCopyBuffer(x->cb, x->stgbuf, dst, 1, &region);
+	xfer_barrier
+	(
+		dc,
+		x->cb, dst, dstoff, sz,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_WRITE_BIT,
+		VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0,
+		dc->xfam, dc->qfam
+	);
+	return xfer_submit(x, 0);
+}
+
+
+// Copy sz bytes of src to the start of the staging buffer, once the compute queue signals waitsema.
+// The compute commands that wrote src must end with xfer_release_barrier().
+static int xfer_download(xfer_t* x, VkBuffer src, VkDeviceSize srcoff, VkDeviceSize sz, VkSemaphore waitsema)
+{
+	devctx_t* dc = x->dc;
+	assert(x->role == MEM_READBACK && sz <= x->stgsz);
+	xfer_begin(x);
+	xfer_barrier
+	(
+		dc,
+		x->cb, src, srcoff, sz,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, 0,
+		VK_PIPELINE_STAGE_TRANSFER_BIT, VK_ACCESS_TRANSFER_READ_BIT,
+		dc->qfam, dc->xfam
+	);
+	const VkBufferCopy region = { srcoff, 0, sz };
+	vkCmdCopyBuffer(x->cb, src, x->stgbuf, 1, &region);
+	// Make the copy visible to the host.
+	const VkMemoryBarrier mb =
+	{
+		VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		0,
+		VK_ACCESS_TRANSFER_WRITE_BIT,
+		VK_ACCESS_HOST_READ_BIT
+	};
+	vkCmdPipelineBarrier(x->cb, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_HOST_BIT, 0, 1, &mb, 0, 0, 0, 0);
+	return xfer_submit(x, waitsema);
+}
+
+
+// Wait for the transfer to complete. For downloads, the data is then available in xfer_staging(x).
+static void xfer_wait(xfer_t* x, VkDeviceSize sz)
+{
+	devctx_t* dc = x->dc;
+	if (!x->pending)
+		return;
+	const VkResult res_wf = vkWaitForFences(dc->devi, 1, &x->fence, VK_TRUE, ~0ULL);
+	CHECK_VK(res_wf);
+	const VkResult res_rf = vkResetFences(dc->devi, 1, &x->fence);
+	CHECK_VK(res_rf);
+	x->pending = 0;
+	if (x->role == MEM_READBACK && sz)
+		arena_invalidate(dc, &x->stgmem, 0, sz);
+}
+
+
+static void xfer_destroy(xfer_t* x)
+{
+	devctx_t* dc = x->dc;
+	xfer_wait(x, 0);
+	vkDestroySemaphore(dc->devi, x->sema, 0);
+	vkDestroyFence(dc->devi, x->fence, 0);
+	vkDestroyCommandPool(dc->devi, x->pool, 0);
+	if (x->stgbuf)
+		rm_buffer(dc, x->stgbuf, &x->stgmem);
+}
+
+
+#pragma mark Shader module
+
+#define MAXKERNELS	64	// Max number of kernels in a module.
+#define MAXARGS		16	// Max number of args of a kernel.
+#define MAXNAMELEN	64	// Max length of a kernel name.
+
+#define SPV_MAGIC			0x07230203
+#define SPV_OP_STRING			7
+#define SPV_OP_EXTINSTIMPORT		11
+#define SPV_OP_EXTINST			12
+#define SPV_OP_ENTRYPOINT		15
+#define SPV_OP_EXECUTIONMODE		16
+#define SPV_OP_CONSTANT			43
+#define SPV_EXECMODEL_GLCOMPUTE		5
+#define SPV_EXECMODE_LOCALSIZE		17
+
+// The instructions of NonSemantic.ClspvReflection that we care about.
+enum
+{
+	CLSPV_KERNEL = 1,
+	CLSPV_ARGUMENT_STORAGE_BUFFER = 3,
+	CLSPV_ARGUMENT_UNIFORM = 4,
+	CLSPV_ARGUMENT_POD_STORAGE_BUFFER = 5,
+	CLSPV_ARGUMENT_POD_UNIFORM = 6,
+	CLSPV_ARGUMENT_POD_PUSH_CONSTANT = 7,
+	CLSPV_ARGUMENT_SAMPLED_IMAGE = 8,
+	CLSPV_ARGUMENT_STORAGE_IMAGE = 9,
+	CLSPV_ARGUMENT_SAMPLER = 10,
+	CLSPV_ARGUMENT_WORKGROUP = 11,
+	CLSPV_SPEC_CONSTANT_WORKGROUP_SIZE = 12,
+	CLSPV_PUSH_CONSTANT_GLOBAL_OFFSET = 15,
+	CLSPV_PUSH_CONSTANT_REGION_GROUP_OFFSET = 20,
+	CLSPV_CONSTANT_DATA_STORAGE_BUFFER = 21,
+	CLSPV_CONSTANT_DATA_UNIFORM = 22,
+	CLSPV_PROPERTY_REQUIRED_WORKGROUP_SIZE = 24,
+	CLSPV_ARGUMENT_POINTER_PUSH_CONSTANT = 26,
+	CLSPV_ARGUMENT_POINTER_UNIFORM = 27,
+};
+
+// How a kernel arg gets passed.
+typedef struct
+{
+	uint32_t ordinal;		// Position in the kernel's arg list.
+	int binding;			// Binding in descriptor set 0, or -1 if passed as a push constant.
+	VkDescriptorType type;		// Descriptor type, if bound.
+	uint32_t offset;		// Offset in the push constants, if pushed.
+	uint32_t size;			// Size in the push constants, if pushed.
+	int slot;			// Index in the buffers of a job, or -1 if it takes no buffer.
+	int ptr;			// Takes the buffer as its device address, in the push constants.
+} karg_t;
+
+struct module;
+
+// A kernel in a module, with all it takes to dispatch it.
+typedef struct kernel
+{
+	char name[MAXNAMELEN];
+	uint32_t func;			// SPIR-V id of the entry point.
+	uint32_t numargs;
+	karg_t args[MAXARGS];
+	uint32_t numbindings;		// Number of args that are bound in descriptor set 0.
+	uint32_t numpointers;		// Number of args that take a buffer address as a push constant.
+	uint32_t pcsz;			// Size of the push constant range.
+	uint32_t wgsz[3];		// Work group size.
+	int reqd;			// Has a reqd_work_group_size, so wgsz can not be specialized.
+	uint32_t ipt;			// Words per work item, from the _vecN and _iptN suffixes on the name.
+	const struct kernel* base;	// The kernel that this is a variant of, or itself.
+	const struct kernel* tuned;	// Fastest variant of this kernel, if it got tuned.
+	const struct module* module;	// The module it is in.
+	VkDescriptorSetLayout dsl;
+	VkPipelineLayout layout;
+	VkPipeline pipeline;
+} kernel_t;
+
+// A SPIR-V module, mapped from file, with all its kernels.
+typedef struct module
+{
+	const uint32_t* code;
+	size_t codesz;			// In bytes.
+	VkShaderModule module;
+	VkPipelineCache cache;
+	int wgspec[3];			// Spec constant IDs of the work group size, or -1.
+	int pushdesc;			// Its kernels get their descriptors pushed, rather than bound from sets.
+	uint32_t numkernels;
+	kernel_t kernels[MAXKERNELS];
+} module_t;
+
+
+// Map a SPIR-V file into memory, so that large modules need no copying. Returns -1 if it can not be read, or is not
+// SPIR-V.
+static int map_spirv(module_t* m, const char* spirv_fname)
+{
+	const int fd = open(spirv_fname, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr,"Failed to open %s for reading.\n", spirv_fname);
+		return -1;
+	}
+	struct stat st;
+	if (fstat(fd, &st) || st.st_size < 20 || (st.st_size % sizeof(uint32_t)))
+	{
+		fprintf(stderr,"%s is not a SPIR-V module.\n", spirv_fname);
+		close(fd);
+		return -1;
+	}
+	void* p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED)
+	{
+		fprintf(stderr,"Failed to map %s.\n", spirv_fname);
+		return -1;
+	}
+	if (*(const uint32_t*)p != SPV_MAGIC)
+	{
+		fprintf(stderr,"%s is not a SPIR-V module.\n", spirv_fname);
+		munmap(p, st.st_size);
+		return -1;
+	}
+	m->code = p;
+	m->codesz = st.st_size;
+	return 0;
+}
+
+
+static kernel_t* kernel_of_func(module_t* m, uint32_t func)
+{
+	for (uint32_t i=0; i<m->numkernels; ++i)
+		if (m->kernels[i].func == func)
+			return m->kernels + i;
+	return 0;
+}
+
+
+// Returns -1 if the kernel has too many args.
+static int add_arg(kernel_t* k, uint32_t ordinal, int binding, VkDescriptorType type, uint32_t offset, uint32_t size, int ptr)
+{
+	if (k->numargs == MAXARGS)
+		return -1;
+	karg_t* a = k->args + k->numargs++;
+	a->ordinal = ordinal;
+	a->binding = binding;
+	a->type = type;
+	a->offset = offset;
+	a->size = size;
+	a->slot = binding;
+	a->ptr = ptr;
+	if (binding >= 0 && (uint32_t)binding >= k->numbindings)
+		k->numbindings = binding + 1;
+	if (binding < 0 && offset + size > k->pcsz)
+		k->pcsz = offset + size;
+	return 0;
+}
+
+
+// Find the kernels in the module, with their args and work group sizes, from the entry points and clspv's reflection.
+// Kernels with args that can not be bound are left out. Returns -1 if the module is malformed, has no kernels, or
+// has kernels that the device can not run.
+static int reflect_module(devctx_t* dc, module_t* m, const char* spirv_fname)
+{
+	const uint32_t* code = m->code;
+	const size_t numwords = m->codesz / sizeof(uint32_t);
+	const uint32_t bound = code[3];
+	uint32_t* consts = calloc(bound, sizeof(uint32_t));
+	const char** strings = calloc(bound, sizeof(const char*));
+	kernel_t** kernelof = calloc(bound, sizeof(kernel_t*));	// Maps the Kernel ext-insts to our kernels.
+	assert(consts && strings && kernelof);
+	uint32_t reflset = 0;
+	uint32_t modpcsz = 0;		// Push constants that all kernels of the module share.
+	uint8_t rejected[MAXKERNELS] = { 0 };	// Kernels with args that can not be bound.
+	int constdata = 0;		// Module scope constant data, that no kernel gets bound.
+	int bad = 0;
+
+	m->numkernels = 0;
+	m->wgspec[0] = m->wgspec[1] = m->wgspec[2] = -1;
+	for (size_t i=5; i<numwords && !bad; )
+	{
+		const uint32_t wc = code[i] >> 16;
+		const uint32_t op = code[i] & 0xffff;
+		const uint32_t* o = code + i + 1;
+		if (!wc || i + wc > numwords)
+		{
+			bad = 1;
+			break;
+		}
+// Id 0 is never used, so an id that is out of bounds gets a slot that does no harm.
+#define ID(X)	((X) < bound ? (X) : 0)
+		switch (op)
+		{
+			case SPV_OP_STRING:
+				strings[ID(o[0])] = (const char*)(o+1);
+				break;
+			case SPV_OP_CONSTANT:
+				consts[ID(o[1])] = o[2];
+				break;
+			case SPV_OP_EXTINSTIMPORT:
+				if (!strncmp((const char*)(o+1), "NonSemantic.ClspvReflection.", 28))
+					reflset = o[0];
+				break;
+			case SPV_OP_ENTRYPOINT:
+				if (o[0] == SPV_EXECMODEL_GLCOMPUTE)
+				{
+					if (m->numkernels == MAXKERNELS)
+					{
+						fprintf(stderr, "%s has more than %d kernels.\n", spirv_fname, MAXKERNELS);
+						bad = 1;
+						break;
+					}
+					kernel_t* k = m->kernels + m->numkernels++;
+					memset(k, 0, sizeof(kernel_t));
+					snprintf(k->name, sizeof(k->name), "%s", (const char*)(o+2));
+					k->func = o[1];
+					k->wgsz[0] = k->wgsz[1] = k->wgsz[2] = 1;
+					k->module = m;
+					const char* ipt = strstr(k->name, "_ipt");
+					const char* vec = strstr(k->name, "_vec");
+					k->ipt = (ipt ? atoi(ipt+4) : 1) * (vec ? atoi(vec+4) : 1);
+					if (!k->ipt)
+						k->ipt = 1;
+				}
+				break;
+			case SPV_OP_EXECUTIONMODE:
+				if (o[1] == SPV_EXECMODE_LOCALSIZE)
+				{
+					kernel_t* k = kernel_of_func(m, o[0]);
+					if (k)
+						memcpy(k->wgsz, o+2, sizeof(k->wgsz));
+				}
+				break;
+			case SPV_OP_EXTINST:
+			{
+				if (!reflset || o[2] != reflset)
+					break;
+				const uint32_t inst = o[3];
+				const uint32_t* a = o + 4;	// Operands
+				const uint32_t numa = wc - 5;
+				kernel_t* k = numa ? kernelof[ID(a[0])] : 0;
+				switch (inst)
+				{
+					case CLSPV_KERNEL:
+						kernelof[ID(o[1])] = kernel_of_func(m, a[0]);
+						break;
+					case CLSPV_ARGUMENT_STORAGE_BUFFER:
+					case CLSPV_ARGUMENT_UNIFORM:
+					case CLSPV_ARGUMENT_POD_STORAGE_BUFFER:
+					case CLSPV_ARGUMENT_POD_UNIFORM:
+					case CLSPV_ARGUMENT_SAMPLED_IMAGE:
+					case CLSPV_ARGUMENT_STORAGE_IMAGE:
+					case CLSPV_ARGUMENT_SAMPLER:
+					{
+						if (!k || numa < 4)
+						{
+							bad = 1;
+							break;
+						}
+						const VkDescriptorType type =
+							(inst == CLSPV_ARGUMENT_UNIFORM || inst == CLSPV_ARGUMENT_POD_UNIFORM) ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER :
+							(inst == CLSPV_ARGUMENT_SAMPLED_IMAGE) ? VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE :
+							(inst == CLSPV_ARGUMENT_STORAGE_IMAGE) ? VK_DESCRIPTOR_TYPE_STORAGE_IMAGE :
+							(inst == CLSPV_ARGUMENT_SAMPLER) ? VK_DESCRIPTOR_TYPE_SAMPLER :
+							VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+						if (consts[ID(a[2])] != 0)
+						{
+							fprintf(stderr, "Kernel %s uses descriptor set %u, only set 0 is supported.\n", k->name, consts[a[2]]);
+							bad = 1;
+							break;
+						}
+						bad |= add_arg(k, consts[ID(a[1])], consts[ID(a[3])], type, 0, 0, 0) < 0;
+						break;
+					}
+					case CLSPV_ARGUMENT_POD_PUSH_CONSTANT:
+						if (!k || numa < 4)
+						{
+							bad = 1;
+							break;
+						}
+						bad |= add_arg(k, consts[ID(a[1])], -1, 0, consts[ID(a[2])], consts[ID(a[3])], 0) < 0;
+						break;
+					case CLSPV_ARGUMENT_POINTER_PUSH_CONSTANT:
+						// clspv -physical-storage-buffers passes global pointers like this.
+						if (!k || numa < 4)
+						{
+							bad = 1;
+							break;
+						}
+						bad |= add_arg(k, consts[ID(a[1])], -1, VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, consts[ID(a[2])], consts[ID(a[3])], 1) < 0;
+						break;
+					case CLSPV_ARGUMENT_POINTER_UNIFORM:
+					case CLSPV_ARGUMENT_WORKGROUP:
+						if (!k)
+						{
+							bad = 1;
+							break;
+						}
+						fprintf
+						(
+							stderr, "Kernel %s %s, which is not supported.\n", k->name,
+							inst == CLSPV_ARGUMENT_WORKGROUP ? "has a __local arg" : "takes a pointer in a uniform buffer"
+						);
+						rejected[k - m->kernels] = 1;
+						break;
+					case CLSPV_CONSTANT_DATA_STORAGE_BUFFER:
+					case CLSPV_CONSTANT_DATA_UNIFORM:
+						fprintf(stderr, "%s has module scope constant data, which is not supported.\n", spirv_fname);
+						constdata = 1;
+						break;
+					case CLSPV_SPEC_CONSTANT_WORKGROUP_SIZE:
+						if (numa < 3)
+						{
+							bad = 1;
+							break;
+						}
+						m->wgspec[0] = consts[ID(a[0])];
+						m->wgspec[1] = consts[ID(a[1])];
+						m->wgspec[2] = consts[ID(a[2])];
+						break;
+					case CLSPV_PROPERTY_REQUIRED_WORKGROUP_SIZE:
+						if (!k || numa < 4)
+						{
+							bad = 1;
+							break;
+						}
+						k->wgsz[0] = consts[ID(a[1])];
+						k->wgsz[1] = consts[ID(a[2])];
+						k->wgsz[2] = consts[ID(a[3])];
+						k->reqd = 1;
+						break;
+					default:
+						// Module wide push constants, like the global offset, come before those of the args.
+						if (inst >= CLSPV_PUSH_CONSTANT_GLOBAL_OFFSET && inst <= CLSPV_PUSH_CONSTANT_REGION_GROUP_OFFSET && numa >= 2)
+							if (consts[ID(a[0])] + consts[ID(a[1])] > modpcsz)
+								modpcsz = consts[a[0]] + consts[a[1]];
+						break;
+				}
+				break;
+			}
+		}
+#undef ID
+		i += wc;
+	}
+	// Drop the kernels that would run without all of their data, so that they can not be looked up.
+	uint32_t numkept = 0;
+	for (uint32_t i=0; i<m->numkernels && !bad; ++i)
+		if (rejected[i] || constdata)
+			fprintf(stderr, "Skipping kernel %s.\n", m->kernels[i].name);
+		else
+			m->kernels[numkept++] = m->kernels[i];
+	if (!bad)
+		m->numkernels = numkept;
+	if (bad)
+		fprintf(stderr, "%s is malformed, or has kernels that are not supported.\n", spirv_fname);
+	else if (!m->numkernels)
+	{
+		fprintf(stderr, "%s has no kernels.\n", spirv_fname);
+		bad = 1;
+	}
+	if (!reflset)
+		fprintf(stderr, "%s has no clspv reflection info: its kernels take no args.\n", spirv_fname);
+
+	for (uint32_t i=0; i<m->numkernels && !bad; ++i)
+	{
+		kernel_t* k = m->kernels + i;
+		if (modpcsz > k->pcsz)
+			k->pcsz = modpcsz;
+		// Buffers that are passed by address come after the bound ones, in the order of their args.
+		k->numpointers = 0;
+		for (uint32_t j=0; j<k->numargs; ++j)
+			if (k->args[j].ptr)
+			{
+				karg_t* a = k->args + j;
+				a->slot = k->numbindings;
+				for (uint32_t l=0; l<k->numargs; ++l)
+					if (k->args[l].ptr && k->args[l].ordinal < a->ordinal)
+						a->slot++;
+				k->numpointers++;
+			}
+		if (k->numpointers && !dc->has_device_address)
+		{
+			fprintf(stderr, "Kernel %s takes buffers by address, which the device can not do.\n", k->name);
+			bad = 1;
+			break;
+		}
+		// A kernel named foo_vec4_ipt2 is a variant of foo, if there is a foo.
+		size_t baselen = strcspn(k->name, "_");
+		while (k->name[baselen] && strncmp(k->name + baselen, "_vec", 4) && strncmp(k->name + baselen, "_ipt", 4))
+			baselen += 1 + strcspn(k->name + baselen + 1, "_");
+		k->base = k;
+		for (uint32_t j=0; j<m->numkernels; ++j)
+			if (strlen(m->kernels[j].name) == baselen && !strncmp(m->kernels[j].name, k->name, baselen))
+				k->base = m->kernels + j;
+		// The work group size of the other kernels is ours to pick.
+		const int specializable = m->wgspec[0] >= 0 && !k->reqd;
+		if (specializable)
+		{
+			const uint32_t maxsz = dc->dprops.limits.maxComputeWorkGroupSize[0] < dc->dprops.limits.maxComputeWorkGroupInvocations ?
+				dc->dprops.limits.maxComputeWorkGroupSize[0] : dc->dprops.limits.maxComputeWorkGroupInvocations;
+			k->wgsz[0] = WGSZ < maxsz ? WGSZ : maxsz;
+			k->wgsz[1] = k->wgsz[2] = 1;
+		}
+		fprintf
+		(
+			stderr,
+			"Kernel %s: %u args, %u bindings, %u pointers, %u bytes of push constants, work group size %ux%ux%u%s.\n",
+			k->name, k->numargs, k->numbindings, k->numpointers, k->pcsz, k->wgsz[0], k->wgsz[1], k->wgsz[2],
+			specializable ? " (specializable)" : ""
+		);
+	}
+	free(consts);
+	free(strings);
+	free(kernelof);
+	return bad ? -1 : 0;
+}
+
+
+static VkShaderModule mk_shader(devctx_t* dc, const module_t* m)
+{
+	// Create the shader module
+	VkShaderModuleCreateInfo smci =
+	{
+		VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO,
+		0,
+		0,
+		m->codesz,
+		m->code
+	};
+	VkShaderModule shader_module;
+	const VkResult res_csm = vkCreateShaderModule(dc->devi, &smci, 0, &shader_module);
+	CHECK_VK(res_csm);
+	return shader_module;
+}
+
+#pragma mark Pipeline cache
+
+// Our own header in front of the VkPipelineCache data, so we only feed a driver data that it wrote itself.
+typedef struct
+{
+	uint32_t magic;				// PCACHE_MAGIC
+	uint32_t version;			// PCACHE_VERSION
+	uint32_t vendorID;			// Of the device that wrote it.
+	uint32_t deviceID;
+	uint32_t driverVersion;
+	uint8_t uuid[VK_UUID_SIZE];		// pipelineCacheUUID of the device that wrote it.
+	uint64_t datasz;			// Size of the cache data that follows.
+	uint64_t checksum;			// FNV-1a hash of the cache data.
+	uint32_t numcold;			// Modules in cold.
+	coldstart_t cold[PCACHE_MAXMODULES];	// Time it took to create the pipelines of each module without a cache.
+} pcache_header_t;
+
+#define PCACHE_MAGIC	0x43564b4d	// "MKVC"
+#define PCACHE_VERSION	2
+
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+static uint64_t fnv1a(const void* data, size_t sz)
+{
+	const uint8_t* p = (const uint8_t*) data;
+	uint64_t h = 0xcbf29ce484222325ULL;
+	for (size_t i=0; i<sz; ++i)
+		h = (h ^ p[i]) * 0x100000001b3ULL;
+	return h;
+}
+
+
+// Create a pipeline cache, seeded from disk if there is a valid cache file for this device and driver.
+// Set MVK_PIPELINE_CACHE to override the file name, or to an empty string to disable it.
+static VkPipelineCache load_pipeline_cache(devctx_t* dc)
+{
+	const char* override = getenv("MVK_PIPELINE_CACHE");
+	if (override)
+		snprintf(dc->pcache_path, sizeof(dc->pcache_path), "%s", override);
+	else
+		snprintf(dc->pcache_path, sizeof(dc->pcache_path), "mvk_%04x_%04x.pcache", dc->dprops.vendorID, dc->dprops.deviceID);
+	dc->pcache_loadedsum = 0;
+	dc->pcache_numcold = 0;
+	dc->pcache_newcold = 0;
+
+	void* data = 0;
+	size_t datasz = 0;
+	FILE* f = dc->pcache_path[0] ? fopen(dc->pcache_path, "rb") : 0;
+	if (f)
+	{
+		pcache_header_t hdr;
+		const char* reason = 0;
+		if (fread(&hdr, sizeof(hdr), 1, f) != 1 || hdr.magic != PCACHE_MAGIC || hdr.version != PCACHE_VERSION)
+			reason = "not a cache file";
+		else if (hdr.vendorID != dc->dprops.vendorID || hdr.deviceID != dc->dprops.deviceID)
+			reason = "other device";
+		else if (hdr.driverVersion != dc->dprops.driverVersion || memcmp(hdr.uuid, dc->dprops.pipelineCacheUUID, VK_UUID_SIZE))
+			reason = "other driver";
+		else if (hdr.datasz < sizeof(VkPipelineCacheHeaderVersionOne) || hdr.datasz > (1U<<30) || hdr.numcold > PCACHE_MAXMODULES)
+			reason = "bad size";
+		if (!reason)
+		{
+			data = malloc(hdr.datasz);
+			if (fread(data, hdr.datasz, 1, f) != 1 || fnv1a(data, hdr.datasz) != hdr.checksum)
+				reason = "truncated or corrupt";
+		}
+		if (!reason)
+		{
+			// Check the driver's own header as well.
+			VkPipelineCacheHeaderVersionOne vkhdr;
+			memcpy(&vkhdr, data, sizeof(vkhdr));
+			if
+			(
+				vkhdr.headerSize < sizeof(vkhdr) ||
+				vkhdr.headerVersion != VK_PIPELINE_CACHE_HEADER_VERSION_ONE ||
+				vkhdr.vendorID != dc->dprops.vendorID ||
+				vkhdr.deviceID != dc->dprops.deviceID ||
+				memcmp(vkhdr.pipelineCacheUUID, dc->dprops.pipelineCacheUUID, VK_UUID_SIZE)
+			)
+				reason = "bad vulkan header";
+		}
+		fclose(f);
+		if (reason)
+		{
+			fprintf(stderr, "Ignoring pipeline cache %s: %s.\n", dc->pcache_path, reason);
+			free(data);
+			data = 0;
+		}
+		else
+		{
+			datasz = hdr.datasz;
+			dc->pcache_loadedsum = hdr.checksum;
+			dc->pcache_numcold = hdr.numcold;
+			memcpy(dc->pcache_cold, hdr.cold, hdr.numcold * sizeof(coldstart_t));
+		}
+	}
+	fprintf(stderr, "Pipeline cache %s: %s (%zu bytes)\n", dc->pcache_path, data ? "loaded" : "empty", datasz);
+
+	const VkPipelineCacheCreateInfo pcci =
+	{
+		VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO,
+		0,				// next
+		0,				// flags
+		datasz,				// initial data size
+		data				// initial data
+	};
+	VkPipelineCache cache;
+	const VkResult res_cpc = vkCreatePipelineCache(dc->devi, &pcci, 0, &cache);
+	CHECK_VK(res_cpc);
+	free(data);
+	return cache;
+}
+
+
+// Print how long creating the pipelines of a module took, and how that compares to its cold start.
+static void report_pipeline_time(devctx_t* dc, const void* code, size_t codesz, int64_t createns)
+{
+	const uint64_t sum = fnv1a(code, codesz);
+	const coldstart_t* cs = 0;
+	for (uint32_t i=0; i<dc->pcache_numcold && !cs; ++i)
+		if (dc->pcache_cold[i].spirvsum == sum)
+			cs = dc->pcache_cold + i;
+	const int warm = cs != 0;
+	if (!warm)
+	{
+		// This load is the cold start of the module, remember it for later runs. Forget the oldest if full.
+		if (dc->pcache_numcold == PCACHE_MAXMODULES)
+			memmove(dc->pcache_cold, dc->pcache_cold + 1, --dc->pcache_numcold * sizeof(coldstart_t));
+		coldstart_t* ncs = dc->pcache_cold + dc->pcache_numcold++;
+		ncs->spirvsum = sum;
+		ncs->coldns = createns;
+		cs = ncs;
+		dc->pcache_newcold = 1;
+	}
+	fprintf
+	(
+		stderr,
+		"Pipeline creation: %.3f ms (%s start), cold start took %.3f ms, speedup %.1fx\n",
+		createns * 1e-6,
+		warm ? "warm" : "cold",
+		cs->coldns * 1e-6,
+		createns ? cs->coldns / (double) createns : 0.0
+	);
+}
+
+
+// Write the cache back to disk, if it changed. Written to a temporary file first, and then renamed,
+// so that concurrently starting workers never see a half written cache.
+static void save_pipeline_cache(devctx_t* dc, VkPipelineCache cache)
+{
+	if (!dc->pcache_path[0])
+		return;
+	size_t datasz = 0;
+	const VkResult res_gpcd0 = vkGetPipelineCacheData(dc->devi, cache, &datasz, 0);
+	CHECK_VK(res_gpcd0);
+	void* data = malloc(datasz);
+	const VkResult res_gpcd1 = vkGetPipelineCacheData(dc->devi, cache, &datasz, data);
+	CHECK_VK(res_gpcd1);
+
+	pcache_header_t hdr;
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = PCACHE_MAGIC;
+	hdr.version = PCACHE_VERSION;
+	hdr.vendorID = dc->dprops.vendorID;
+	hdr.deviceID = dc->dprops.deviceID;
+	hdr.driverVersion = dc->dprops.driverVersion;
+	memcpy(hdr.uuid, dc->dprops.pipelineCacheUUID, VK_UUID_SIZE);
+	hdr.datasz = datasz;
+	hdr.checksum = fnv1a(data, datasz);
+	hdr.numcold = dc->pcache_numcold;
+	memcpy(hdr.cold, dc->pcache_cold, dc->pcache_numcold * sizeof(coldstart_t));
+	if (hdr.checksum == dc->pcache_loadedsum && !dc->pcache_newcold)
+	{
+		free(data);
+		return;
+	}
+
+	char tmppath[sizeof(dc->pcache_path)+32];
+	snprintf(tmppath, sizeof(tmppath), "%s.%d.%lx.tmp", dc->pcache_path, (int)getpid(), (unsigned long)pthread_self());
+	FILE* f = fopen(tmppath, "wb");
+	int ok = f != 0;
+	if (ok)
+	{
+		ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 && fwrite(data, datasz, 1, f) == 1;
+		ok = fflush(f) == 0 && ok;
+		ok = fsync(fileno(f)) == 0 && ok;
+		ok = fclose(f) == 0 && ok;
+	}
+	if (ok)
+		ok = rename(tmppath, dc->pcache_path) == 0;
+	if (!ok)
+	{
+		fprintf(stderr, "Failed to write pipeline cache %s.\n", dc->pcache_path);
+		remove(tmppath);
+	}
+	else
+		fprintf(stderr, "Wrote %zu bytes of pipeline cache to %s\n", datasz, dc->pcache_path);
+	free(data);
+}
+
+#pragma mark Device selection
+
+#define MAXPHYSDEVS	64
+
+// The instance is shared by all contexts and devices of the process, along with the devices it found and the one
+// the environment prefers, so that it only gets made and enumerated once while any of them are alive.
+typedef struct
+{
+	uint32_t refs;
+	VkInstance inst;
+	int has_debug_utils;				// Was VK_EXT_debug_utils enabled?
+	uint32_t count;
+	VkPhysicalDevice devices[MAXPHYSDEVS];
+	VkPhysicalDeviceProperties devprops[MAXPHYSDEVS];
+	int preferred;					// The device the environment prefers.
+	int64_t ns[2];					// Time it took to make the instance, and to enumerate the devices.
+} instcache_t;
+
+static pthread_mutex_t instlock = PTHREAD_MUTEX_INITIALIZER;
+static instcache_t instcache;
+
+
+// Make the instance, with the profile that MVK_PROFILE selects. The release profile has no layers, and only
+// the debug extensions that the loader has. The debug profile adds the validation layer, where it is installed.
+static void mk_instance(void)
+{
+	const char* profile = getenv("MVK_PROFILE");
+	const int debug = profile && !strcmp(profile, "debug");
+	if (profile && *profile && !debug && strcmp(profile, "release"))
+		fprintf(stderr, "Unknown profile %s, using release.\n", profile);
+
+	// Check instance layers
+	const char* layerName = 0;
+	if (debug)
+	{
+		uint32_t layerCount = 0;
+		const VkResult res_eilp0 = vkEnumerateInstanceLayerProperties(&layerCount, 0);
+		CHECK_VK(res_eilp0);
+		VkLayerProperties layerProps[layerCount+1];
+		const VkResult res_eilp1 = vkEnumerateInstanceLayerProperties(&layerCount, layerProps);
+		CHECK_VK(res_eilp1);
+
+		int foundLayer0 = 0;
+		int foundLayer1 = 0;
+		for (uint32_t i=0; i<layerCount; ++i)
+		{
+			VkLayerProperties prop = layerProps[i];
+			//fprintf(stderr,"layer: %s\n", prop.layerName);
+			if (strcmp("VK_LAYER_LUNARG_standard_validation", prop.layerName) == 0)
+			{
+				foundLayer0 = 1;
+				break;
+			}
+			if (strcmp("VK_LAYER_KHRONOS_validation", prop.layerName) == 0) 
+			{
+				foundLayer1 = 1;
+				break;
+			}
+		}
+		layerName = foundLayer1 ? "VK_LAYER_KHRONOS_validation" :
+			foundLayer0 ? "VK_LAYER_LUNARG_standard_validation" :
+			0;
+		if (!layerName)
+			fprintf(stderr, "There is no validation layer, running without.\n");
+	}
+
+	// Check the extensions
+	uint32_t extCount = 0;
+	const VkResult res_eisp0 = vkEnumerateInstanceExtensionProperties(0, &extCount, 0);
+	CHECK_VK(res_eisp0);
+	VkExtensionProperties extProps[extCount+1];
+	const VkResult res_eisp1 = vkEnumerateInstanceExtensionProperties
+	(
+	 	0,		// layer to retrieve extensions from
+		&extCount,
+		extProps
+	);
+	CHECK_VK(res_eisp1);
+	const char* extNames[2];
+	uint32_t numExt = 0;
+	instcache.has_debug_utils = 0;
+	for (uint32_t i=0; i<extCount; ++i)
+	{
+		const char* ename = extProps[i].extensionName;
+		//fprintf(stderr,"Extension %s\n", ename);
+		if (debug && !strcmp(ename, "VK_EXT_debug_report"))
+			extNames[numExt++] = "VK_EXT_debug_report";
+		// Object names cost nothing per call, and show up in captures and crash dumps, so release has them too.
+		if (!strcmp(ename, "VK_EXT_debug_utils"))
+		{
+			extNames[numExt++] = "VK_EXT_debug_utils";
+			instcache.has_debug_utils = 1;
+		}
+	}
+	fprintf(stderr, "Profile %s, %s, VK_EXT_debug_utils: %s\n", debug ? "debug" : "release", layerName ? layerName : "no layers", instcache.has_debug_utils ? "yes" : "no");
+
+	// Get an instance
+	const VkApplicationInfo ai =
+	{
+		VK_STRUCTURE_TYPE_APPLICATION_INFO,
+		0,
+		"vkt",
+		0,
+		"",
+		0,
+		VK_MAKE_VERSION(1,3,238)
+	};
+	const VkInstanceCreateInfo ici =
+	{
+		VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO,
+		0,			// next
+		0,			// flags
+		&ai,			// application info
+		layerName ? 1 : 0,	// enabled layer count
+		&layerName,		// enabled layer names
+		numExt,			// enabled extension count
+		extNames		// enabled extension names
+	};
+	const VkResult res_ci = vkCreateInstance
+	(
+		&ici,
+		0,
+		&instcache.inst
+	);
+	CHECK_VK(res_ci);
+}
+
+
+// Enumerate the devices of the instance, and pick the one that the environment prefers.
+static void enumerate_devices(void)
+{
+	uint32_t dev_count = MAXPHYSDEVS;
+	VkPhysicalDevice* devices = instcache.devices;
+	VkPhysicalDeviceProperties* devprops = instcache.devprops;
+	VkPhysicalDeviceFeatures2 devfeats[dev_count];
+	VkPhysicalDeviceVulkan12Features v12feats[dev_count];
+	const VkResult res_enum = vkEnumeratePhysicalDevices(instcache.inst, &dev_count, devices);
+	CHECK_VK(res_enum);
+	instcache.count = dev_count;
+	fprintf(stderr, "Found %d physical devices.\n", dev_count);
+	const char* devtypenames[] =
+	{
+		"OTHER",
+		"iGPU",
+		"dGPU",
+		"vGPU",
+		"CPU",
+		0,
+	};
+	int num_igpu = 0;
+	int num_dgpu = 0;
+	int num_cpu  = 0;
+	for (uint32_t dnr=0; dnr<dev_count; ++dnr)
+	{
+		vkGetPhysicalDeviceProperties(devices[dnr], devprops+dnr);
+		num_igpu += (devprops[dnr].deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU);
+		num_dgpu += (devprops[dnr].deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU);
+		num_cpu  += (devprops[dnr].deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU);
+		const char* tnam = devtypenames[devprops[dnr].deviceType];
+                v12feats[dnr].sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+                v12feats[dnr].pNext = 0;
+                devfeats[dnr].sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+                devfeats[dnr].pNext = v12feats+dnr;
+                vkGetPhysicalDeviceFeatures2(devices[dnr], devfeats+dnr);
+                assert(devfeats[dnr].sType == VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2);
+                const int has_i8  = v12feats[dnr].shaderInt8;
+                const int has_f16 = v12feats[dnr].shaderFloat16;
+                fprintf(stderr,"%4s %-44s (i8:%c f16:%c)\n", tnam, devprops[dnr].deviceName, has_i8?'Y':'N', has_f16?'Y':'N');
+
+	}
+
+	int selnr = -1;
+	const char* prefer_dgpu = getenv("MVK_PREFER_DGPU");
+	const char* prefer_igpu = getenv("MVK_PREFER_IGPU");
+	const char* prefer_cpu  = getenv("MVK_PREFER_CPU");
+	const int skip_dgpu = (num_igpu && prefer_igpu) || (num_cpu  && prefer_cpu );
+	const int skip_igpu = (num_dgpu && prefer_dgpu) || (num_cpu  && prefer_cpu );
+	const int skip_cpu  = (num_igpu && prefer_igpu) || (num_dgpu && prefer_dgpu);
+	if (num_dgpu && !skip_dgpu)
+		for (uint32_t i=0; i<dev_count; ++i)
+			if (devprops[i].deviceType == VK_PHYSICAL_DEVICE_TYPE_DISCRETE_GPU) { selnr=i; break; }
+	if (num_igpu && !skip_igpu && selnr<0)
+		for (uint32_t i=0; i<dev_count; ++i)
+			if (devprops[i].deviceType == VK_PHYSICAL_DEVICE_TYPE_INTEGRATED_GPU) { selnr=i; break; }
+	if (num_cpu && !skip_cpu && selnr<0)
+		for (uint32_t i=0; i<dev_count; ++i)
+			if (devprops[i].deviceType == VK_PHYSICAL_DEVICE_TYPE_CPU) { selnr=i; break; }
+	if (selnr<0)
+		selnr = 0;
+	instcache.preferred = selnr;
+}
+
+
+// Take a reference on the instance, and make it if there is none yet. Returns 1 if it got made.
+static int acquire_instance(void)
+{
+	pthread_mutex_lock(&instlock);
+	const int fresh = !instcache.refs++;
+	if (fresh)
+	{
+		const int64_t t0 = now_ns();
+		mk_instance();
+		const int64_t t1 = now_ns();
+		enumerate_devices();
+		instcache.ns[0] = t1 - t0;
+		instcache.ns[1] = now_ns() - t1;
+	}
+	pthread_mutex_unlock(&instlock);
+	return fresh;
+}
+
+
+// Give the reference back, and destroy the instance after the last one.
+static void release_instance(void)
+{
+	pthread_mutex_lock(&instlock);
+	assert(instcache.refs);
+	if (!--instcache.refs)
+	{
+		vkDestroyInstance(instcache.inst, 0);
+		memset(&instcache, 0, sizeof(instcache));
+	}
+	pthread_mutex_unlock(&instlock);
+}
+
+
+// Pick device devnr, or if that is negative, the one the environment prefers. The caller holds a reference on the instance.
+// Returns -1 if there is no such device, or it can not be made.
+static int pick_device(devctx_t* dc, int devnr)
+{
+	assert(dc->inst == instcache.inst);
+	if (!instcache.count || (devnr >= 0 && (uint32_t)devnr >= instcache.count))
+	{
+		fprintf(stderr, "There is no Vulkan device %d, of %u.\n", devnr, instcache.count);
+		return -1;
+	}
+	const int selnr = devnr >= 0 ? devnr : instcache.preferred;
+	const char* device_name = instcache.devprops[selnr].deviceName;
+	fprintf(stderr, "Using %s\n", device_name);
+	dc->pdev = instcache.devices[selnr];
+	dc->dprops = instcache.devprops[selnr];
+
+	// Create all compute queues, and those of a transfer-only family, so that copies need not share a queue with the jobs.
+	uint32_t fam_count = 16;
+	VkQueueFamilyProperties famprops[fam_count];
+	vkGetPhysicalDeviceQueueFamilyProperties(dc->pdev, &fam_count, famprops);
+	// Priorities of the compute queues can be given as a list. By default, the first one goes ahead of the others.
+	const char* priolist = getenv("MVK_QUEUE_PRIORITIES");
+	uint32_t numcompute = 0;
+	VkDeviceQueueCreateInfo dqci[16];
+	uint32_t numdqci = 0;
+	for (uint32_t fa=0; fa<fam_count && dc->queues.count<MAXQUEUES; ++fa)
+	{
+		const VkQueueFlags fl = famprops[fa].queueFlags;
+		const int compute = (fl & VK_QUEUE_COMPUTE_BIT) != 0;
+		const int xferonly = (fl & (VK_QUEUE_TRANSFER_BIT|VK_QUEUE_COMPUTE_BIT|VK_QUEUE_GRAPHICS_BIT)) == VK_QUEUE_TRANSFER_BIT;
+		if (!compute && !xferonly)
+			continue;
+		uint32_t n = famprops[fa].queueCount;
+		if (n > MAXQUEUES - dc->queues.count)
+			n = MAXQUEUES - dc->queues.count;
+		if (!n)
+			continue;
+		VkDeviceQueueCreateInfo* ci = dqci + numdqci++;
+		ci->sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
+		ci->pNext = 0;
+		ci->flags = 0;
+		ci->queueFamilyIndex = fa;				// family idx
+		ci->queueCount = n;					// queue count
+		ci->pQueuePriorities = dc->queues.prio + dc->queues.count;	// priority 0..1
+		for (uint32_t j=0; j<n; ++j)
+		{
+			const uint32_t i = dc->queues.count++;
+			dc->queues.fam[i] = fa;
+			dc->queues.compute[i] = compute;
+			dc->queues.prio[i] = 1.0f;
+			if (compute)
+			{
+				if (numcompute)
+					dc->queues.prio[i] = 0.5f;
+				if (priolist && *priolist)
+				{
+					char* end;
+					const float p = strtof(priolist, &end);
+					dc->queues.prio[i] = p > 1.0f ? 1.0f : p >= 0.0f ? p : 0.0f;
+					priolist = (*end == ',') ? end+1 : end;
+				}
+				numcompute++;
+			}
+		}
+	}
+	if (!numcompute)
+	{
+		fprintf(stderr, "%s has no compute queues.\n", device_name);
+		return -1;
+	}
+	fprintf(stderr, "Creating %u queues, %u of which can compute.\n", dc->queues.count, numcompute);
+
+	// Check the device extensions
+	uint32_t devExtCount = 0;
+	const VkResult res_edep0 = vkEnumerateDeviceExtensionProperties(dc->pdev, 0, &devExtCount, 0);
+	CHECK_VK(res_edep0);
+	VkExtensionProperties devExtProps[devExtCount];
+	const VkResult res_edep1 = vkEnumerateDeviceExtensionProperties(dc->pdev, 0, &devExtCount, devExtProps);
+	CHECK_VK(res_edep1);
+	const char* devExtNames[8];
+	uint32_t numDevExt = 0;
+	for (uint32_t i=0; i<devExtCount; ++i)
+	{
+		const char* ename = devExtProps[i].extensionName;
+		if (!strcmp(ename, "VK_EXT_memory_budget"))
+		{
+			dc->has_memory_budget = 1;
+			devExtNames[numDevExt++] = "VK_EXT_memory_budget";
+		}
+	}
+	fprintf(stderr, "VK_EXT_memory_budget: %s\n", dc->has_memory_budget ? "yes" : "no");
+	// Wrapping host memory in buffers needs this, but all that uses it can do without.
+	const char* nohostimport = getenv("MVK_NO_HOST_IMPORT");
+	dc->has_host_import = 0;
+	for (uint32_t i=0; i<devExtCount && !(nohostimport && *nohostimport); ++i)
+		if (!strcmp(devExtProps[i].extensionName, "VK_EXT_external_memory_host"))
+		{
+			dc->has_host_import = 1;
+			devExtNames[numDevExt++] = "VK_EXT_external_memory_host";
+		}
+	fprintf(stderr, "VK_EXT_external_memory_host: %s\n", dc->has_host_import ? "yes" : "no");
+	// Jobs can push their descriptors, rather than take sets from a pool.
+	const char* nopushdesc = getenv("MVK_NO_PUSH_DESCRIPTORS");
+	dc->has_push_descriptor = 0;
+	for (uint32_t i=0; i<devExtCount && !(nopushdesc && *nopushdesc); ++i)
+		if (!strcmp(devExtProps[i].extensionName, "VK_KHR_push_descriptor"))
+		{
+			dc->has_push_descriptor = 1;
+			devExtNames[numDevExt++] = "VK_KHR_push_descriptor";
+		}
+	fprintf(stderr, "VK_KHR_push_descriptor: %s\n", dc->has_push_descriptor ? "yes" : "no");
+	// Traces use this to put device and host time on one clock, if the device can sample both.
+	dc->has_calibrated_timestamps = 0;
+	PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT pfnGetPhysicalDeviceCalibrateableTimeDomainsEXT =
+		(PFN_vkGetPhysicalDeviceCalibrateableTimeDomainsEXT)vkGetInstanceProcAddr(dc->inst, "vkGetPhysicalDeviceCalibrateableTimeDomainsEXT");
+	for (uint32_t i=0; i<devExtCount && pfnGetPhysicalDeviceCalibrateableTimeDomainsEXT; ++i)
+		if (!strcmp(devExtProps[i].extensionName, "VK_EXT_calibrated_timestamps"))
+		{
+			VkTimeDomainEXT domains[8];
+			uint32_t numdomains = 8;
+			pfnGetPhysicalDeviceCalibrateableTimeDomainsEXT(dc->pdev, &numdomains, domains);
+			int has_device = 0, has_monotonic = 0;
+			for (uint32_t d=0; d<numdomains; ++d)
+			{
+				has_device |= domains[d] == VK_TIME_DOMAIN_DEVICE_EXT;
+				has_monotonic |= domains[d] == VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT;
+			}
+			if (has_device && has_monotonic)
+			{
+				dc->has_calibrated_timestamps = 1;
+				devExtNames[numDevExt++] = "VK_EXT_calibrated_timestamps";
+			}
+		}
+	fprintf(stderr, "VK_EXT_calibrated_timestamps: %s\n", dc->has_calibrated_timestamps ? "yes" : "no");
+
+	// Enable the 8 and 16 bit types that the device has, for kernels that clspv compiled to use them.
+	const int has_v12 = dc->dprops.apiVersion >= VK_API_VERSION_1_2;
+	VkPhysicalDeviceVulkan12Features avail12;
+	VkPhysicalDeviceVulkan11Features avail11;
+	VkPhysicalDeviceFeatures2 avail;
+	memset(&avail12, 0, sizeof(avail12));
+	memset(&avail11, 0, sizeof(avail11));
+	memset(&avail, 0, sizeof(avail));
+	avail12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	avail11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+	avail11.pNext = &avail12;
+	avail.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	avail.pNext = has_v12 ? &avail11 : 0;
+	vkGetPhysicalDeviceFeatures2(dc->pdev, &avail);
+
+	VkPhysicalDeviceVulkan12Features feat12;
+	VkPhysicalDeviceVulkan11Features feat11;
+	VkPhysicalDeviceFeatures2 feats;
+	memset(&feat12, 0, sizeof(feat12));
+	memset(&feat11, 0, sizeof(feat11));
+	memset(&feats, 0, sizeof(feats));
+	feat12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+	feat12.storageBuffer8BitAccess            = avail12.storageBuffer8BitAccess;
+	feat12.uniformAndStorageBuffer8BitAccess  = avail12.uniformAndStorageBuffer8BitAccess;
+	feat12.storagePushConstant8               = avail12.storagePushConstant8;
+	feat12.shaderInt8                         = avail12.shaderInt8;
+	feat12.shaderFloat16                      = avail12.shaderFloat16;
+	// For kernels that clspv compiled to take their buffers as pointers.
+	feat12.bufferDeviceAddress                = avail12.bufferDeviceAddress;
+	dc->has_device_address = has_v12 && avail12.bufferDeviceAddress;
+	feat11.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_1_FEATURES;
+	feat11.pNext = &feat12;
+	feat11.storageBuffer16BitAccess           = avail11.storageBuffer16BitAccess;
+	feat11.uniformAndStorageBuffer16BitAccess = avail11.uniformAndStorageBuffer16BitAccess;
+	feat11.storagePushConstant16              = avail11.storagePushConstant16;
+	feats.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+	feats.pNext = has_v12 ? &feat11 : 0;
+	feats.features.shaderInt16 = avail.features.shaderInt16;
+	// This lets the last work group of a window hang over the end of the buffers. It costs on some devices, and
+	// kernels can check their index instead, so only enable it when asked.
+	const char* robust = getenv("MVK_ROBUST");
+	feats.features.robustBufferAccess = robust && *robust && avail.features.robustBufferAccess;
+	dc->has_robust_access = feats.features.robustBufferAccess;
+	// For traces that count the shader invocations of every dispatch.
+	feats.features.pipelineStatisticsQuery = avail.features.pipelineStatisticsQuery;
+	dc->has_pipeline_stats = avail.features.pipelineStatisticsQuery;
+	fprintf
+	(
+		stderr,
+		"Enabled features: int8:%c int16:%c f16:%c 8-bit storage:%c 16-bit storage:%c robust access:%c device address:%c pipeline stats:%c\n",
+		feat12.shaderInt8 ? 'Y' : 'N',
+		feats.features.shaderInt16 ? 'Y' : 'N',
+		feat12.shaderFloat16 ? 'Y' : 'N',
+		feat12.storageBuffer8BitAccess ? 'Y' : 'N',
+		feat11.storageBuffer16BitAccess ? 'Y' : 'N',
+		dc->has_robust_access ? 'Y' : 'N',
+		dc->has_device_address ? 'Y' : 'N',
+		dc->has_pipeline_stats ? 'Y' : 'N'
+	);
+
+	// Create a device
+	const VkDeviceCreateInfo dci =
+	{
+		VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO,
+		&feats,					// next
+		0,					// flags
+		numdqci,				// dqci count
+		dqci,					// dqci
+		0,					// layer count
+		0,					// layers
+		numDevExt,				// extension count
+		devExtNames,				// extensions
+		0					// features
+	};
+	const VkResult res_cd = vkCreateDevice
+	(
+		dc->pdev,
+		&dci,
+		0,					// allocator
+		&dc->devi
+	);
+	if (res_cd != VK_SUCCESS)
+	{
+		fprintf(stderr, "Failed to create a device for %s (%d).\n", device_name, res_cd);
+		return -1;
+	}
+	uint32_t idx = 0;	// Index of the queue within its family.
+	for (uint32_t i=0; i<dc->queues.count; ++i)
+	{
+		idx = (i == 0 || dc->queues.fam[i] != dc->queues.fam[i-1]) ? 0 : idx + 1;
+		vkGetDeviceQueue(dc->devi, dc->queues.fam[i], idx, dc->queues.queue + i);
+		pthread_mutex_init(dc->queues.lock + i, 0);
+	}
+	pthread_mutex_init(&dc->arenalock, 0);
+	pthread_mutex_init(&dc->staginglock, 0);
+	dc->homeq = assign_queue(&dc->queues);
+	dc->homexq = assign_copy_queue(&dc->queues, dc->homeq);
+	dc->queue = dc->queues.queue[dc->homeq];
+	dc->qfam = dc->queues.fam[dc->homeq];
+	dc->xqueue = dc->queues.queue[dc->homexq];
+	dc->xfam = dc->queues.fam[dc->homexq];
+	uint32_t numjobqueues = 0;
+	for (uint32_t i=0; i<dc->queues.count; ++i)
+	{
+		const uint32_t validbits = famprops[dc->queues.fam[i]].timestampValidBits;
+		dc->queues.tsmask[i] = validbits >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << validbits) - 1;
+		numjobqueues += dc->queues.compute[i] && dc->queues.fam[i] == dc->qfam;
+	}
+	fprintf
+	(
+		stderr,
+		"Compute on queue %d (family %d, priority %.2f) and %u more of its family, copies on queue %d (family %d).\n",
+		dc->homeq, dc->qfam, dc->queues.prio[dc->homeq], numjobqueues - 1, dc->homexq, dc->xfam
+	);
+	dc->pfnSetDebugUtilsObjectNameEXT = !instcache.has_debug_utils ? 0 : (PFN_vkSetDebugUtilsObjectNameEXT)vkGetInstanceProcAddr
+	(
+		dc->inst,
+		"vkSetDebugUtilsObjectNameEXT"
+	);
+	LABEL_OBJ(dc, dc->devi, VK_OBJECT_TYPE_DEVICE, device_name);
+	if (dc->has_host_import)
+	{
+		VkPhysicalDeviceExternalMemoryHostPropertiesEXT hostprops;
+		hostprops.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTERNAL_MEMORY_HOST_PROPERTIES_EXT;
+		hostprops.pNext = 0;
+		VkPhysicalDeviceProperties2 props2;
+		props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+		props2.pNext = &hostprops;
+		vkGetPhysicalDeviceProperties2(dc->pdev, &props2);
+		dc->hostimportalign = hostprops.minImportedHostPointerAlignment;
+		dc->pfnGetMemoryHostPointerPropertiesEXT = (PFN_vkGetMemoryHostPointerPropertiesEXT)vkGetDeviceProcAddr
+		(
+			dc->devi,
+			"vkGetMemoryHostPointerPropertiesEXT"
+		);
+		dc->has_host_import = dc->pfnGetMemoryHostPointerPropertiesEXT != 0;
+	}
+	if (dc->has_push_descriptor)
+	{
+		dc->pfnCmdPushDescriptorSetKHR = (PFN_vkCmdPushDescriptorSetKHR)vkGetDeviceProcAddr
+		(
+			dc->devi,
+			"vkCmdPushDescriptorSetKHR"
+		);
+		dc->has_push_descriptor = dc->pfnCmdPushDescriptorSetKHR != 0;
+	}
+	if (dc->has_calibrated_timestamps)
+	{
+		dc->pfnGetCalibratedTimestampsEXT = (PFN_vkGetCalibratedTimestampsEXT)vkGetDeviceProcAddr
+		(
+			dc->devi,
+			"vkGetCalibratedTimestampsEXT"
+		);
+		dc->has_calibrated_timestamps = dc->pfnGetCalibratedTimestampsEXT != 0;
+	}
+	return 0;
+}
+
+
+// Tear down all that pick_device() created, and the pools and memory that came after.
+static void release_device(devctx_t* dc)
+{
+	staging_destroy(dc);
+	arena_destroy(dc);
+	for (uint32_t j=0; j<dc->queues.count; ++j)
+		pthread_mutex_destroy(dc->queues.lock + j);
+	pthread_mutex_destroy(&dc->arenalock);
+	pthread_mutex_destroy(&dc->staginglock);
+	vkDestroyDevice(dc->devi, 0);
+	dc->devi = 0;
+	release_instance();
+}
+
+
+#pragma mark memory types
+
+static void list_memory_types(devctx_t* dc)
+{
+	// Examine the memory types.
+	vkGetPhysicalDeviceMemoryProperties(dc->pdev, &dc->memprops);
+	dc->mtcnt = dc->memprops.memoryTypeCount;
+	dc->mhcnt = dc->memprops.memoryHeapCount;
+	if (!dc->verbose)
+		return;
+	fprintf(stderr, "%d mem types (%d mem heaps)\n", dc->mtcnt, dc->mhcnt);
+	for (uint32_t mt=0; mt<dc->mtcnt; ++mt)
+	{
+		const uint32_t hidx = dc->memprops.memoryTypes[mt].heapIndex;
+		const VkMemoryPropertyFlags fl = dc->memprops.memoryTypes[mt].propertyFlags;
+		const VkDeviceSize sz = dc->memprops.memoryHeaps[hidx].size;
+		const VkMemoryHeapFlags mhf = dc->memprops.memoryHeaps[hidx].flags;
+		fprintf
+		(
+			stderr,
+			"%7zu MiB of %s memory [ %s%s%s%s] %zu MiB available\n",
+			sz / (1024*1024),
+			mhf & VK_MEMORY_HEAP_DEVICE_LOCAL_BIT ? "local" : "non-local",
+			fl & VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT ? "device-local " : "",
+			fl & VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT ? "host-visible " : "",
+			fl & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT ? "host-coherent " : "",
+			fl & VK_MEMORY_PROPERTY_HOST_CACHED_BIT ? "host-cached " : "",
+			heap_room(dc, hidx) / (1024*1024)
+		);
+	}
+	for (int role=0; role<MEM_NUMROLES; ++role)
+	{
+		uint32_t ranked[VK_MAX_MEMORY_TYPES];
+		const uint32_t numranked = rank_memory_types(dc, ~0U, role, ranked);
+		fprintf(stderr, "%-8s memory type preference:", memrolenames[role]);
+		for (uint32_t i=0; i<numranked; ++i)
+			fprintf(stderr, " %u", ranked[i]);
+		fprintf(stderr, "\n");
+	}
+}
+
+#pragma mark Kernel
+
+// Create the layouts for a kernel, as its reflection info describes them.
+static void mk_kernel_layout(devctx_t* dc, kernel_t* k)
+{
+	VkDescriptorSetLayoutBinding descriptorSetLayoutBindings[MAXARGS];
+	uint32_t numbindings = 0;
+	for (uint32_t i=0; i<k->numargs; ++i)
+		if (k->args[i].binding >= 0)
+		{
+			VkDescriptorSetLayoutBinding* b = descriptorSetLayoutBindings + numbindings++;
+			b->binding = k->args[i].binding;		// binding number
+			b->descriptorType = k->args[i].type;		// descriptor type
+			b->descriptorCount = 1;				// descriptor count
+			b->stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;	// stage flags
+			b->pImmutableSamplers = 0;			// immutable samplers
+		}
+	const VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo =
+	{
+		VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO,
+		0,				// next
+		k->module->pushdesc ? VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR : 0,	// flags
+		numbindings,			// bindingCount
+		descriptorSetLayoutBindings	// bindings
+	};
+	const VkResult rescdsl = vkCreateDescriptorSetLayout(dc->devi, &descriptorSetLayoutCreateInfo, 0, &k->dsl);
+	CHECK_VK(rescdsl);
+	LABEL_OBJ(dc, k->dsl, VK_OBJECT_TYPE_DESCRIPTOR_SET_LAYOUT, k->name);
+
+	const VkPushConstantRange pcr =
+	{
+		VK_SHADER_STAGE_COMPUTE_BIT,
+		0,				// offset
+		k->pcsz
+	};
+	VkPipelineLayoutCreateInfo pipelineLayoutCreateInfo =
+	{
+		VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO,
+		0,				// next
+		0,				// flags
+		1,				// layout count
+		&k->dsl,			// layouts
+		k->pcsz ? 1 : 0,		// pushConstantRangeCount
+		&pcr				// pushConstantRanges
+	};
+	const VkResult rescpl = vkCreatePipelineLayout(dc->devi, &pipelineLayoutCreateInfo, 0, &k->layout);
+	CHECK_VK(rescpl);
+	LABEL_OBJ(dc, k->layout, VK_OBJECT_TYPE_PIPELINE_LAYOUT, k->name);
+}
+
+
+static int kernel_specializable(const module_t* m, const kernel_t* k)
+{
+	return m->wgspec[0] >= 0 && !k->reqd;
+}
+
+
+// The work group size, for modules that take it as spec constants.
+typedef struct
+{
+	VkSpecializationMapEntry entries[3];
+	uint32_t data[3];
+	VkSpecializationInfo info;
+} wgspec_t;
+
+static const VkSpecializationInfo* mk_wgspec(const module_t* m, const kernel_t* k, wgspec_t* ws)
+{
+	if (m->wgspec[0] < 0)
+		return 0;
+	uint32_t n = 0;
+	for (int d=0; d<3; ++d)
+		if (m->wgspec[d] >= 0)
+		{
+			ws->entries[n].constantID = m->wgspec[d];
+			ws->entries[n].offset = d * sizeof(uint32_t);
+			ws->entries[n].size = sizeof(uint32_t);
+			n++;
+		}
+	memcpy(ws->data, k->wgsz, sizeof(ws->data));
+	ws->info.mapEntryCount = n;
+	ws->info.pMapEntries = ws->entries;
+	ws->info.dataSize = sizeof(ws->data);
+	ws->info.pData = ws->data;
+	return &ws->info;
+}
+
+
+// Create the pipelines for count kernels of a module, starting at first, in one go. Returns how long that took.
+static int64_t mk_pipelines(devctx_t* dc, module_t* m, uint32_t first, uint32_t count)
+{
+	VkComputePipelineCreateInfo computePipelineCreateInfos[MAXKERNELS];
+	wgspec_t wgspecs[MAXKERNELS];
+	VkPipeline pipelines[MAXKERNELS];
+	for (uint32_t i=0; i<count; ++i)
+	{
+		kernel_t* k = m->kernels + first + i;
+		const VkPipelineShaderStageCreateInfo pssci =
+		{
+			VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO,
+			0,				// next
+			0,				// flags
+			VK_SHADER_STAGE_COMPUTE_BIT,	// stage
+			m->module,			// module
+			k->name,			// name of entry point
+			mk_wgspec(m, k, wgspecs+i)	// specialization info
+		};
+		const VkComputePipelineCreateInfo computePipelineCreateInfo =
+		{
+			VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO,
+			0,				// next
+			0,				// flags
+			pssci,				// pipeline shader stage create info
+			k->layout,			// layout
+			0,				// basePipelineHandle
+			0				// basePipelineIndex
+		};
+		computePipelineCreateInfos[i] = computePipelineCreateInfo;
+	}
+	const int64_t t0 = now_ns();
+	const VkResult res_cp = vkCreateComputePipelines
+	(
+		dc->devi,
+		m->cache,			// pipeline cache
+		count,				// create info count
+		computePipelineCreateInfos,
+		0,				// allocator
+		pipelines
+	);
+	CHECK_VK(res_cp);
+	const int64_t elapsed = now_ns() - t0;
+	for (uint32_t i=0; i<count; ++i)
+	{
+		m->kernels[first+i].pipeline = pipelines[i];
+		LABEL_OBJ(dc, pipelines[i], VK_OBJECT_TYPE_PIPELINE, m->kernels[first+i].name);
+	}
+	return elapsed;
+}
+
+
+// Load a module, and create the pipelines for all its kernels in one go.
+static int mk_module(devctx_t* dc, module_t* m, const char* spirv_fname, VkPipelineCache pipelineCache)
+{
+	if (map_spirv(m, spirv_fname) < 0)
+		return -1;
+	if (reflect_module(dc, m, spirv_fname) < 0)
+	{
+		munmap((void*)m->code, m->codesz);
+		m->numkernels = 0;
+		return -1;
+	}
+	m->cache = pipelineCache;
+
+	// Make a shader module
+	m->module = mk_shader(dc, m);
+	LABEL_OBJ(dc, m->module, VK_OBJECT_TYPE_SHADER_MODULE, spirv_fname);
+
+	for (uint32_t i=0; i<m->numkernels; ++i)
+		mk_kernel_layout(dc, m->kernels + i);
+	report_pipeline_time(dc, m->code, m->codesz, mk_pipelines(dc, m, 0, m->numkernels));
+	return 0;
+}
+
+
+// Recreate the pipeline of a kernel, for a different work group size.
+// Jobs in flight may still run the old pipeline, so the job queues drain first.
+static void specialize_kernel(devctx_t* dc, module_t* m, kernel_t* k, uint32_t wgsz)
+{
+	assert(kernel_specializable(m, k));
+	if (wgsz == k->wgsz[0])
+		return;
+	for (uint32_t i=0; i<dc->queues.count; ++i)
+		if (dc->queues.compute[i] && dc->queues.fam[i] == dc->qfam)
+			queue_wait_idle(&dc->queues, dc->queues.queue[i]);
+	vkDestroyPipeline(dc->devi, k->pipeline, 0);
+	k->wgsz[0] = wgsz;
+	mk_pipelines(dc, m, k - m->kernels, 1);
+}
+
+
+#define VARIANT_MINGROUPS	64	// Fewer work groups than this may leave compute units idle.
+
+// Number of work groups it takes for a kernel to cover numwork items.
+static uint32_t num_groups(const kernel_t* k, size_t numwork)
+{
+	const size_t pergroup = (size_t)k->wgsz[0] * k->ipt;
+	assert(numwork % pergroup == 0);
+	return numwork / pergroup;
+}
+
+
+#define TILE_MAX	64	// Max number of tiles that a dispatch gets split into.
+
+// A window on the buffers of a dispatch, and the work groups that cover it.
+typedef struct
+{
+	VkDeviceSize firstword;
+	VkDeviceSize numwords;
+	uint32_t numgroups;		// The last one can be partial.
+} tile_t;
+
+
+// The words per tile that stay within the work group count and the storage buffer range of the device,
+// and the step in words that tiles start on.
+static VkDeviceSize tile_words(const kernel_t* k, const VkPhysicalDeviceLimits* limits, VkDeviceSize* step)
+{
+	const VkDeviceSize pergroup = (VkDeviceSize)k->wgsz[0] * k->ipt;
+	VkDeviceSize tilewords = (VkDeviceSize)limits->maxComputeWorkGroupCount[0] * pergroup;
+	const VkDeviceSize rangewords = limits->maxStorageBufferRange / sizeof(uint32_t);
+	if (tilewords > rangewords)
+		tilewords = rangewords;
+	// Tiles are whole work groups, and start at offsets that descriptors accept.
+	*step = pergroup;
+	while ((*step * sizeof(uint32_t)) % limits->minStorageBufferOffsetAlignment)
+		*step += pergroup;
+	tilewords = tilewords / *step * *step;
+	assert(tilewords);
+	return tilewords;
+}
+
+
+// Cover the words [first,last) with tiles of up to tilewords words, after the numtiles tiles that there are.
+// Returns the new number of tiles, or 0 if it takes too many.
+static uint32_t add_tiles(const kernel_t* k, VkDeviceSize first, VkDeviceSize last, VkDeviceSize tilewords, tile_t* tiles, uint32_t numtiles)
+{
+	const VkDeviceSize pergroup = (VkDeviceSize)k->wgsz[0] * k->ipt;
+	for (; first<last; first+=tilewords)
+	{
+		if (numtiles == TILE_MAX)
+			return 0;
+		tile_t* t = tiles + numtiles++;
+		t->firstword = first;
+		t->numwords = last - first < tilewords ? last - first : tilewords;
+		t->numgroups = (uint32_t)((t->numwords + pergroup - 1) / pergroup);
+	}
+	return numtiles;
+}
+
+
+// Split a dispatch over numwork words into windows that each stay within the work group count and
+// the storage buffer range of the device. Returns the number of tiles, or 0 if it takes too many.
+static uint32_t plan_tiles(const kernel_t* k, VkDeviceSize numwork, const VkPhysicalDeviceLimits* limits, tile_t* tiles)
+{
+	VkDeviceSize step;
+	const VkDeviceSize tilewords = tile_words(k, limits, &step);
+	return add_tiles(k, 0, numwork, tilewords, tiles, 0);
+}
+
+
+static kernel_t* find_kernel(module_t* m, const char* name)
+{
+	for (uint32_t i=0; i<m->numkernels; ++i)
+		if (!strcmp(m->kernels[i].name, name))
+			return m->kernels + i;
+	return 0;
+}
+
+
+// The variant of k to run over numwork words: the tuned one if it fits, or else the one with the
+// most words per work item that still gives the device enough work groups to keep it busy.
+static const kernel_t* pick_variant(const kernel_t* k, size_t numwork, uint32_t maxgroups)
+{
+	const kernel_t* base = k->base;
+	const struct module* m = k->module;
+	#define FITS(V)	(numwork % ((size_t)(V)->wgsz[0] * (V)->ipt) == 0 && numwork / ((size_t)(V)->wgsz[0] * (V)->ipt) <= maxgroups)
+	if (base->tuned && FITS(base->tuned))
+		return base->tuned;
+	const kernel_t* best = 0;
+	for (uint32_t i=0; i<m->numkernels; ++i)
+	{
+		const kernel_t* v = m->kernels + i;
+		if (v->base != base || !FITS(v))
+			continue;
+		const int busy = numwork / ((size_t)v->wgsz[0] * v->ipt) >= VARIANT_MINGROUPS;
+		const int bestbusy = best && numwork / ((size_t)best->wgsz[0] * best->ipt) >= VARIANT_MINGROUPS;
+		if (!best || (busy && !bestbusy) || (busy == bestbusy && (busy ? v->ipt > best->ipt : v->ipt < best->ipt)))
+			best = v;
+	}
+	#undef FITS
+	return best ? best : k;
+}
+
+
+static void rm_module(devctx_t* dc, module_t* m)
+{
+	for (uint32_t i=0; i<m->numkernels; ++i)
+	{
+		kernel_t* k = m->kernels + i;
+		vkDestroyDescriptorSetLayout(dc->devi, k->dsl, 0);
+		vkDestroyPipelineLayout(dc->devi, k->layout, 0);
+		vkDestroyPipeline(dc->devi, k->pipeline, 0);
+	}
+	vkDestroyShaderModule(dc->devi, m->module, 0);
+	munmap((void*)m->code, m->codesz);
+	m->numkernels = 0;
+}
+
+
+// Returns VK_NULL_HANDLE if it can not be made.
+static VkSemaphore mk_semaphore(devctx_t* dc, const char* tag)
+{
+	const VkSemaphoreCreateInfo semaphoreCreateInfo = { VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO, 0, 0 };
+	VkSemaphore sema;
+	const VkResult res_cs = vkCreateSemaphore(dc->devi, &semaphoreCreateInfo, 0, &sema);
+	if (res_cs != VK_SUCCESS)
+		return VK_NULL_HANDLE;
+	LABEL_OBJ(dc, sema, VK_OBJECT_TYPE_SEMAPHORE, tag);
+	return sema;
+}
+
+#pragma mark Autotuning
+
+#define TUNE_REPS	5	// Times to run each variant, the fastest run counts.
+
+// Where the tuning results for this device live, or 0 if we do not keep them.
+static const char* tune_path(devctx_t* dc)
+{
+	char* path = dc->tune_path;
+	const size_t pathsz = sizeof(dc->tune_path);
+	const char* env = getenv("MVK_TUNE");
+	if (env)
+	{
+		snprintf(path, pathsz, "%s", env);
+		return path[0] ? path : 0;
+	}
+	// Key it on the device UUID: the same GPU with a different driver can keep its results.
+	VkPhysicalDeviceIDProperties idprops;
+	memset(&idprops, 0, sizeof(idprops));
+	idprops.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_ID_PROPERTIES;
+	VkPhysicalDeviceProperties2 props2;
+	memset(&props2, 0, sizeof(props2));
+	props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+	props2.pNext = &idprops;
+	vkGetPhysicalDeviceProperties2(dc->pdev, &props2);
+	int len = snprintf(path, pathsz, "mvk_");
+	for (uint32_t i=0; i<VK_UUID_SIZE; ++i)
+		len += snprintf(path+len, pathsz-len, "%02x", idprops.deviceUUID[i]);
+	snprintf(path+len, pathsz-len, ".tune");
+	return path;
+}
+
+
+// Apply earlier tuning results to the kernels of a module.
+static void load_tuning(devctx_t* dc, module_t* m)
+{
+	const char* path = tune_path(dc);
+	FILE* f = path ? fopen(path, "r") : 0;
+	if (!f)
+		return;
+	char name[MAXNAMELEN], variant[MAXNAMELEN];
+	uint32_t wgsz;
+	while (fscanf(f, "%63s %63s %u%*[^\n]", name, variant, &wgsz) == 3)
+	{
+		kernel_t* k = find_kernel(m, name);
+		kernel_t* v = find_kernel(m, variant);
+		if (!k || !v)
+			continue;	// Tuned for a different module.
+		if (kernel_specializable(m, v))
+			specialize_kernel(dc, m, v, wgsz);
+		if (v->wgsz[0] != wgsz)
+			continue;	// The module changed since.
+		k->tuned = v;
+		fprintf(stderr, "Tuned %s: using %s with work group size %u.\n", name, variant, wgsz);
+	}
+	fclose(f);
+}
+
+
+static void save_tuning(devctx_t* dc, const module_t* m)
+{
+	const char* path = tune_path(dc);
+	if (!path)
+		return;
+	FILE* f = fopen(path, "w");
+	if (!f)
+	{
+		fprintf(stderr, "Cannot write tuning results to %s\n", path);
+		return;
+	}
+	for (uint32_t i=0; i<m->numkernels; ++i)
+		if (m->kernels[i].tuned)
+			fprintf(f, "%s %s %u\n", m->kernels[i].name, m->kernels[i].tuned->name, m->kernels[i].tuned->wgsz[0]);
+	fclose(f);
+	fprintf(stderr, "Wrote tuning results to %s\n", path);
+}
+
+#pragma mark Library
+
+#define MVK_MAXJOBS	256	// Max number of jobs in flight, per context.
+#define MVK_MAXWORKERS	16	// Max number of threads that wait for jobs, and run their callbacks.
+
+typedef enum
+{
+	JOB_FREE,
+	JOB_PENDING,		// Submitted, and maybe still running.
+	JOB_DONE,		// Done, and its callback has returned.
+} jobstate_t;
+
+struct mvk_job
+{
+	mvk_context_t* ctx;
+	uint32_t slot;			// Index in the context's jobs, which also picks its two timestamp queries.
+	jobstate_t state;
+	int autorelease;		// Was released before it was done.
+	int queue;			// The queue it was submitted to, in the device's queues.
+	VkCommandBuffer cb;		// Of its slot, from the pool of its queue.
+	VkFence fence;
+	VkDescriptorSet descriptorSets[TILE_MAX];	// One per tile, of the dispatches that bind sets from the pool.
+	uint32_t numsets;
+	mvk_callback_t callback;
+	void* user;
+	int64_t gpuns;			// Time between the timestamps around its commands.
+};
+
+typedef struct trace trace_t;
+
+// The command buffers of the jobs on one compute queue. Threads that submit to different queues record at the same time.
+typedef struct
+{
+	VkCommandPool pool;
+	pthread_mutex_t lock;			// Held while recording into, or allocating from, the pool.
+	VkCommandBuffer cbs[MVK_MAXJOBS];	// Per job slot, allocated when the slot first runs on this queue.
+} jobpool_t;
+
+struct mvk_context
+{
+	devctx_t dc;			// The device, its queues, and its memory.
+	VkPipelineCache pipelineCache;
+	jobpool_t jobpools[MAXQUEUES];	// Per queue of the device, for those that jobs go to.
+	int jobqueues[MAXQUEUES];	// The compute queues of the home family, that the jobs go to in turn.
+	uint32_t numjobqueues;
+	uint32_t nextqueue;
+	VkDescriptorPool descriptorPool;
+	VkQueryPool queryPool;
+	pthread_mutex_t lock;		// Guards the descriptor pool, the turn of the queues, and the job states.
+	pthread_cond_t cond;		// Signalled when a job is done, or freed.
+	pthread_cond_t work;		// Signalled when a job is submitted, or when the workers must quit.
+	mvk_job_t jobs[MVK_MAXJOBS];
+	uint32_t freeslots[MVK_MAXJOBS];
+	uint32_t numfree;
+	uint32_t pending[MVK_MAXJOBS];	// Ring of submitted jobs that no worker waits for yet.
+	uint32_t head;
+	uint32_t numpending;
+	int quit;
+	uint32_t numworkers;
+	pthread_t workers[MVK_MAXWORKERS];
+	trace_t* trace;			// If MVK_TRACE is set.
+};
+
+struct mvk_buffer
+{
+	mvk_context_t* ctx;
+	VkBuffer buf;
+	suballoc_t mem;
+	size_t size;
+	void* host;			// The host memory it was made from, if any.
+	VkDeviceMemory imported;	// Memory object of the host memory, if it got imported, and not copied.
+	void* mapping;			// Mapped file, to unmap on destroy.
+	size_t mappingsz;
+	VkDeviceAddress addr;		// For kernels that take it by address.
+	range_t dirty[DIRTY_MAX];	// Ranges that changed, sorted, apart, and in whole atoms.
+	uint32_t numdirty;
+};
+
+struct mvk_module
+{
+	mvk_context_t* ctx;
+	module_t m;
+};
+
+#define GRAPH_MAXNODES	32	// Max number of dispatches and copies in a graph.
+#define GRAPH_MAXPC	128	// Max size of the push constants of a dispatch, which all devices support.
+
+typedef enum
+{
+	NODE_DISPATCH,
+	NODE_COPY,
+} nodetype_t;
+
+// A dispatch or a copy in a graph. A copy reads buffers[0] and writes buffers[1].
+typedef struct
+{
+	nodetype_t type;
+	const kernel_t* kernel;
+	VkDeviceSize numwork;
+	mvk_buffer_t* buffers[MAXARGS];
+	uint32_t numbuffers;
+	uint32_t writes;		// Bit per buffer that it writes.
+	uint8_t pc[GRAPH_MAXPC];
+	uint32_t pcsz;
+	VkBufferCopy region;
+	uint32_t firsttile;		// Its tiles, in the tiles of the graph.
+	uint32_t numtiles;
+	int dirty;			// Its tiles get marked as dirty in the buffers that it writes, on every submit.
+	uint32_t firstset;		// Its descriptor sets, in those of the job, if it binds sets from the pool.
+	VkPipelineStageFlags stage;
+	VkAccessFlags readaccess;
+	VkAccessFlags writeaccess;
+	uint32_t wave;			// Nodes in the same wave do not depend on each other.
+	VkPipelineStageFlags depstages;	// What it waits for, in the nodes that it depends on.
+	VkAccessFlags depaccess;
+} node_t;
+
+struct mvk_graph
+{
+	mvk_context_t* ctx;
+	uint32_t numnodes;
+	node_t nodes[GRAPH_MAXNODES];
+	uint32_t numtiles;
+	tile_t tiles[TILE_MAX];
+};
+
+
+#define TRACE_MAXSPANS	(2 * GRAPH_MAXNODES + 1)	// Spans per job: its nodes, the barriers between its waves, and the last barrier.
+
+// A span of GPU time in a job, between two of its trace queries.
+typedef struct
+{
+	char name[MAXNAMELEN];
+	const char* cat;		// dispatch, copy or barrier.
+	int stats;			// Its pipeline statistics query, or -1.
+} tracespan_t;
+
+// A span of host or GPU time, in ns of CLOCK_MONOTONIC.
+typedef struct
+{
+	char name[MAXNAMELEN];
+	const char* cat;
+	int gpu;			// On the device, rather than on the host.
+	int tid;			// Thread or queue.
+	int64_t ts;
+	int64_t dur;
+	int64_t invocations;		// Compute shader invocations, or -1 if not counted.
+	uint32_t job;
+} traceevent_t;
+
+struct trace
+{
+	char path[512];			// Where the trace gets written, when the context is destroyed.
+	pthread_mutex_t lock;		// Guards the events.
+	traceevent_t* events;
+	uint32_t numevents;
+	uint32_t capevents;
+	VkQueryPool queryPool;		// A pair of timestamps per span of every job.
+	VkQueryPool statsPool;		// A pipeline statistics query per node of every job, if the device has them.
+	tracespan_t spans[MVK_MAXJOBS][TRACE_MAXSPANS];
+	uint32_t numspans[MVK_MAXJOBS];
+	int64_t submitns[MVK_MAXJOBS];	// When the job got submitted, to line up devices that can not calibrate.
+};
+
+
+static trace_t* trace_create(const devctx_t* dc)
+{
+	const char* path = getenv("MVK_TRACE");
+	if (!path || !*path)
+		return 0;
+	trace_t* tr = calloc(1, sizeof(trace_t));
+	if (!tr)
+		return 0;
+	snprintf(tr->path, sizeof(tr->path), "%s", path);
+	pthread_mutex_init(&tr->lock, 0);
+	const VkQueryPoolCreateInfo qpci =
+	{
+		VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+		0,				// pNext
+		0,				// flags
+		VK_QUERY_TYPE_TIMESTAMP,	// query type
+		2 * TRACE_MAXSPANS * MVK_MAXJOBS,	// query count
+		0,				// pipeline statistics
+	};
+	const VkResult res_cqp = vkCreateQueryPool(dc->devi, &qpci, 0, &tr->queryPool);
+	if (res_cqp != VK_SUCCESS)
+	{
+		fprintf(stderr, "Cannot create the queries of a trace (%d), so there is none.\n", res_cqp);
+		pthread_mutex_destroy(&tr->lock);
+		free(tr);
+		return 0;
+	}
+	if (dc->has_pipeline_stats)
+	{
+		const VkQueryPoolCreateInfo sqpci =
+		{
+			VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+			0,
+			0,
+			VK_QUERY_TYPE_PIPELINE_STATISTICS,
+			GRAPH_MAXNODES * MVK_MAXJOBS,
+			VK_QUERY_PIPELINE_STATISTIC_COMPUTE_SHADER_INVOCATIONS_BIT,
+		};
+		// Without them, the trace goes on without invocation counts.
+		if (vkCreateQueryPool(dc->devi, &sqpci, 0, &tr->statsPool) != VK_SUCCESS)
+			tr->statsPool = VK_NULL_HANDLE;
+	}
+	fprintf
+	(
+		stderr,
+		"Tracing to %s, %s invocation counts, %s calibrated timestamps.\n",
+		tr->path,
+		tr->statsPool ? "with" : "without",
+		dc->has_calibrated_timestamps ? "with" : "without"
+	);
+	return tr;
+}
+
+
+static void trace_add(trace_t* tr, const traceevent_t* ev)
+{
+	pthread_mutex_lock(&tr->lock);
+	if (tr->numevents == tr->capevents)
+	{
+		tr->capevents = tr->capevents ? 2 * tr->capevents : 1024;
+		tr->events = realloc(tr->events, tr->capevents * sizeof(traceevent_t));
+		assert(tr->events);
+	}
+	tr->events[tr->numevents++] = *ev;
+	pthread_mutex_unlock(&tr->lock);
+}
+
+
+// Add a span of host time, on the calling thread.
+static void trace_host(trace_t* tr, const char* name, int64_t t0, int64_t t1, uint32_t job)
+{
+	traceevent_t ev;
+	snprintf(ev.name, sizeof(ev.name), "%s", name);
+	ev.cat = "host";
+	ev.gpu = 0;
+	ev.tid = gettid();
+	ev.ts = t0;
+	ev.dur = t1 - t0;
+	ev.invocations = -1;
+	ev.job = job;
+	trace_add(tr, &ev);
+}
+
+
+// Start recording the trace of a job.
+static void trace_begin_job(trace_t* tr, const mvk_job_t* job)
+{
+	tr->numspans[job->slot] = 0;
+	vkCmdResetQueryPool(job->cb, tr->queryPool, 2 * TRACE_MAXSPANS * job->slot, 2 * TRACE_MAXSPANS);
+	if (tr->statsPool)
+		vkCmdResetQueryPool(job->cb, tr->statsPool, GRAPH_MAXNODES * job->slot, GRAPH_MAXNODES);
+}
+
+
+// Open a span, with a timestamp before the commands that follow. Dispatches get their invocations counted.
+// Returns the index of the span.
+static uint32_t trace_open(trace_t* tr, const mvk_job_t* job, const char* name, const char* cat, int node)
+{
+	const uint32_t i = tr->numspans[job->slot]++;
+	assert(i < TRACE_MAXSPANS);
+	tracespan_t* s = tr->spans[job->slot] + i;
+	snprintf(s->name, sizeof(s->name), "%s", name);
+	s->cat = cat;
+	s->stats = (tr->statsPool && node >= 0) ? (int)(GRAPH_MAXNODES * job->slot + node) : -1;
+	vkCmdWriteTimestamp(job->cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, tr->queryPool, 2 * (TRACE_MAXSPANS * job->slot + i));
+	if (s->stats >= 0)
+		vkCmdBeginQuery(job->cb, tr->statsPool, s->stats, 0);
+	return i;
+}
+
+
+// Close a span, with a timestamp that gets written once all commands so far are past stage.
+static void trace_close(trace_t* tr, const mvk_job_t* job, uint32_t i, VkPipelineStageFlagBits stage)
+{
+	const tracespan_t* s = tr->spans[job->slot] + i;
+	if (s->stats >= 0)
+		vkCmdEndQuery(job->cb, tr->statsPool, s->stats);
+	vkCmdWriteTimestamp(job->cb, stage, tr->queryPool, 2 * (TRACE_MAXSPANS * job->slot + i) + 1);
+}
+
+
+// Turn the spans of a job that is done into events. Device ticks go on the host clock by a calibration
+// right now, or, without calibrated timestamps, by putting the start of the job at its submit.
+static void trace_end_job(trace_t* tr, const devctx_t* dc, const mvk_job_t* job)
+{
+	const uint32_t numspans = tr->numspans[job->slot];
+	if (!numspans)
+		return;
+	uint64_t stamps[2 * TRACE_MAXSPANS];
+	const VkResult res_qpr = vkGetQueryPoolResults
+	(
+		dc->devi,
+		tr->queryPool,
+		2 * TRACE_MAXSPANS * job->slot,
+		2 * numspans,
+		sizeof(stamps),
+		stamps,
+		sizeof(uint64_t),
+		VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT
+	);
+	CHECK_VK(res_qpr);
+	const uint64_t tsmask = dc->queues.tsmask[job->queue];
+	for (uint32_t i=0; i<2*numspans; ++i)
+		stamps[i] &= tsmask;
+	const double period = dc->dprops.limits.timestampPeriod;
+	uint64_t basetick = stamps[0];
+	int64_t basens = tr->submitns[job->slot];
+	if (dc->has_calibrated_timestamps)
+	{
+		const VkCalibratedTimestampInfoEXT cti[2] =
+		{
+			{ VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT, 0, VK_TIME_DOMAIN_DEVICE_EXT },
+			{ VK_STRUCTURE_TYPE_CALIBRATED_TIMESTAMP_INFO_EXT, 0, VK_TIME_DOMAIN_CLOCK_MONOTONIC_EXT },
+		};
+		uint64_t now[2];
+		uint64_t deviation;
+		const VkResult res_gct = dc->pfnGetCalibratedTimestampsEXT(dc->devi, 2, cti, now, &deviation);
+		CHECK_VK(res_gct);
+		basetick = now[0] & tsmask;
+		basens = (int64_t) now[1];
+	}
+	for (uint32_t i=0; i<numspans; ++i)
+	{
+		const tracespan_t* s = tr->spans[job->slot] + i;
+		traceevent_t ev;
+		snprintf(ev.name, sizeof(ev.name), "%s", s->name);
+		ev.cat = s->cat;
+		ev.gpu = 1;
+		ev.tid = job->queue;
+		ev.ts = basens + (int64_t) (((int64_t) (stamps[2*i] - basetick)) * period);
+		ev.dur = (int64_t) (((stamps[2*i+1] - stamps[2*i]) & tsmask) * period);
+		ev.invocations = -1;
+		ev.job = job->slot;
+		if (s->stats >= 0)
+		{
+			uint64_t invocations = 0;
+			const VkResult res_sqpr = vkGetQueryPoolResults
+			(
+				dc->devi,
+				tr->statsPool,
+				s->stats,
+				1,
+				sizeof(invocations),
+				&invocations,
+				sizeof(uint64_t),
+				VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT
+			);
+			CHECK_VK(res_sqpr);
+			ev.invocations = (int64_t) invocations;
+		}
+		trace_add(tr, &ev);
+	}
+}
+
+
+// Write s as a JSON string, in quotes. Device and kernel names come from the driver and the SPIR-V.
+static void trace_string(FILE* f, const char* s)
+{
+	fputc('"', f);
+	for (; *s; ++s)
+	{
+		const unsigned char c = (unsigned char) *s;
+		if (c == '"' || c == '\\')
+			fprintf(f, "\\%c", c);
+		else if (c < 0x20)
+			fprintf(f, "\\u%04x", c);
+		else
+			fputc(c, f);
+	}
+	fputc('"', f);
+}
+
+
+// Write the events as Chrome trace JSON, which chrome://tracing and Perfetto can show, and free the trace.
+static void trace_destroy(trace_t* tr, const devctx_t* dc)
+{
+	FILE* f = fopen(tr->path, "w");
+	if (!f)
+		fprintf(stderr, "Cannot write the trace to %s\n", tr->path);
+	else
+	{
+		fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+		fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"host\"}},\n", getpid());
+		fprintf(f, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":0,\"args\":{\"name\":");
+		trace_string(f, dc->dprops.deviceName);
+		fprintf(f, "}},\n");
+		for (uint32_t q=0, first=1; q<dc->queues.count; ++q)
+			if (dc->queues.compute[q] && dc->queues.fam[q] == dc->qfam)
+			{
+				fprintf(f, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,\"args\":{\"name\":\"queue %u\"}}", first ? "" : ",\n", q, q);
+				first = 0;
+			}
+		for (uint32_t i=0; i<tr->numevents; ++i)
+		{
+			const traceevent_t* ev = tr->events + i;
+			fprintf(f, ",\n{\"name\":");
+			trace_string(f, ev->name);
+			fprintf
+			(
+				f,
+				",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"job\":%u",
+				ev->cat, ev->gpu ? 0 : getpid(), ev->tid, ev->ts / 1000.0, ev->dur / 1000.0, ev->job
+			);
+			if (ev->invocations >= 0)
+				fprintf(f, ",\"invocations\":%ld", (long) ev->invocations);
+			fprintf(f, "}}");
+		}
+		fprintf(f, "\n]}\n");
+		fclose(f);
+		fprintf(stderr, "Wrote %u trace events to %s\n", tr->numevents, tr->path);
+	}
+	vkDestroyQueryPool(dc->devi, tr->queryPool, 0);
+	if (tr->statsPool)
+		vkDestroyQueryPool(dc->devi, tr->statsPool, 0);
+	pthread_mutex_destroy(&tr->lock);
+	free(tr->events);
+	free(tr);
+}
+
+
+// The lock must be held.
+static void job_free(mvk_job_t* job)
+{
+	mvk_context_t* ctx = job->ctx;
+	if (job->numsets)
+	{
+		const VkResult res_fds = vkFreeDescriptorSets(ctx->dc.devi, ctx->descriptorPool, job->numsets, job->descriptorSets);
+		CHECK_VK(res_fds);
+	}
+	job->numsets = 0;
+	job->state = JOB_FREE;
+	ctx->freeslots[ctx->numfree++] = job->slot;
+	pthread_cond_broadcast(&ctx->cond);
+}
+
+
+// Gives back the slot of a job that could not be recorded or submitted. The lock must not be held.
+static mvk_job_t* job_abort(mvk_job_t* job, VkResult res)
+{
+	mvk_context_t* ctx = job->ctx;
+	fprintf(stderr, "Cannot submit a job (%d).\n", res);
+	pthread_mutex_lock(&ctx->lock);
+	job_free(job);
+	pthread_mutex_unlock(&ctx->lock);
+	return 0;
+}
+
+
+// Waits for the submitted jobs in turn, reads their timestamps and runs their callbacks.
+static void* job_worker(void* arg)
+{
+	mvk_context_t* ctx = arg;
+	const VkDevice dev = ctx->dc.devi;
+	pthread_mutex_lock(&ctx->lock);
+	while (1)
+	{
+		while (!ctx->numpending && !ctx->quit)
+			pthread_cond_wait(&ctx->work, &ctx->lock);
+		if (!ctx->numpending)
+			break;
+		mvk_job_t* job = ctx->jobs + ctx->pending[ctx->head];
+		ctx->head = (ctx->head + 1) % MVK_MAXJOBS;
+		ctx->numpending--;
+		pthread_mutex_unlock(&ctx->lock);
+
+		const VkResult res_wf = vkWaitForFences(dev, 1, &job->fence, VK_TRUE, ~0ULL);
+		CHECK_VK(res_wf);
+		uint64_t stamps[2];
+		const VkResult res_qpr = vkGetQueryPoolResults
+		(
+			dev,
+			ctx->queryPool,
+			2 * job->slot,
+			2,
+			sizeof(stamps),
+			stamps,
+			sizeof(uint64_t),
+			VK_QUERY_RESULT_64_BIT | VK_QUERY_RESULT_WAIT_BIT
+		);
+		CHECK_VK(res_qpr);
+		job->gpuns = (int64_t) (((stamps[1] - stamps[0]) & ctx->dc.queues.tsmask[job->queue]) * ctx->dc.dprops.limits.timestampPeriod);
+		if (ctx->trace)
+			trace_end_job(ctx->trace, &ctx->dc, job);
+		if (job->callback)
+		{
+			const int64_t t0 = now_ns();
+			job->callback(job, job->user);
+			if (ctx->trace)
+				trace_host(ctx->trace, "callback", t0, now_ns(), job->slot);
+		}
+
+		pthread_mutex_lock(&ctx->lock);
+		if (job->autorelease)
+			job_free(job);
+		else
+		{
+			job->state = JOB_DONE;
+			pthread_cond_broadcast(&ctx->cond);
+		}
+	}
+	pthread_mutex_unlock(&ctx->lock);
+	return 0;
+}
+
+
+// Destroys the pools and fences of a context, those of them that got made.
+static void ctx_destroy_objects(mvk_context_t* ctx)
+{
+	const VkDevice dev = ctx->dc.devi;
+	for (uint32_t i=0; i<MVK_MAXJOBS; ++i)
+		if (ctx->jobs[i].fence)
+			vkDestroyFence(dev, ctx->jobs[i].fence, 0);
+	if (ctx->queryPool)
+		vkDestroyQueryPool(dev, ctx->queryPool, 0);
+	if (ctx->descriptorPool)
+		vkDestroyDescriptorPool(dev, ctx->descriptorPool, 0);
+	for (uint32_t i=0; i<ctx->numjobqueues; ++i)
+	{
+		jobpool_t* jp = ctx->jobpools + ctx->jobqueues[i];
+		if (jp->pool)
+			vkDestroyCommandPool(dev, jp->pool, 0);
+		pthread_mutex_destroy(&jp->lock);
+	}
+}
+
+
+// Creates the pools and fences of the job slots. Returns -1 if one of them can not be made.
+static int ctx_create_objects(mvk_context_t* ctx)
+{
+	devctx_t* dc = &ctx->dc;
+	// Buffers belong to the family of the home queue, so the jobs stay on the queues of that family.
+	for (uint32_t i=0; i<dc->queues.count; ++i)
+		if (dc->queues.compute[i] && dc->queues.fam[i] == dc->qfam)
+		{
+			ctx->jobqueues[ctx->numjobqueues++] = i;
+			pthread_mutex_init(&ctx->jobpools[i].lock, 0);
+		}
+	for (uint32_t i=0; i<ctx->numjobqueues; ++i)
+	{
+		const int q = ctx->jobqueues[i];
+		const VkCommandPoolCreateInfo cpci =
+		{
+			VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+			0,
+			VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT,
+			dc->queues.fam[q]
+		};
+		const VkResult res_ccp = vkCreateCommandPool(dc->devi, &cpci, 0, &ctx->jobpools[q].pool);
+		if (res_ccp != VK_SUCCESS)
+		{
+			ctx->jobpools[q].pool = VK_NULL_HANDLE;
+			return -1;
+		}
+		char tag[32];
+		snprintf(tag, sizeof(tag), "jobs on queue %d", q);
+		LABEL_OBJ(dc, ctx->jobpools[q].pool, VK_OBJECT_TYPE_COMMAND_POOL, tag);
+	}
+
+	// Jobs free their sets when they are done, so the pool needs the flag for that.
+	// A set per job, plus enough for one job that got split into the most tiles.
+	const uint32_t maxsets = MVK_MAXJOBS + TILE_MAX;
+	const VkDescriptorPoolSize dps[2] =
+	{
+		{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, maxsets * MAXARGS },
+		{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, maxsets * MAXARGS },
+	};
+	const VkDescriptorPoolCreateInfo dpci =
+	{
+		VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+		0,
+		VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT,
+		maxsets,
+		2,
+		dps
+	};
+	const VkResult res_cdp = vkCreateDescriptorPool(dc->devi, &dpci, 0, &ctx->descriptorPool);
+	if (res_cdp != VK_SUCCESS)
+		return -1;
+
+	const VkQueryPoolCreateInfo qpci =
+	{
+		VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO,
+		0,				// pNext
+		0,				// flags
+		VK_QUERY_TYPE_TIMESTAMP,	// query type
+		2 * MVK_MAXJOBS,		// query count
+		0,				// pipeline statistics
+	};
+	const VkResult res_cqp = vkCreateQueryPool(dc->devi, &qpci, 0, &ctx->queryPool);
+	if (res_cqp != VK_SUCCESS)
+		return -1;
+
+	for (uint32_t i=0; i<MVK_MAXJOBS; ++i)
+	{
+		mvk_job_t* job = ctx->jobs + i;
+		job->ctx = ctx;
+		job->slot = i;
+		const VkFenceCreateInfo fci = { VK_STRUCTURE_TYPE_FENCE_CREATE_INFO, 0, 0 };
+		if (vkCreateFence(dc->devi, &fci, 0, &job->fence) != VK_SUCCESS)
+		{
+			job->fence = VK_NULL_HANDLE;
+			return -1;
+		}
+		ctx->freeslots[i] = MVK_MAXJOBS - 1 - i;
+	}
+	ctx->numfree = MVK_MAXJOBS;
+	return 0;
+}
+
+
+mvk_context_t* mvk_create(int devnr)
+{
+	// The device keeps this reference on the instance, until it gets released.
+	const int64_t t0 = now_ns();
+	const int fresh = acquire_instance();
+	const int64_t t1 = now_ns();
+	mvk_context_t* ctx = calloc(1, sizeof(mvk_context_t));
+	if (!ctx)
+	{
+		release_instance();
+		return 0;
+	}
+	devctx_t* dc = &ctx->dc;
+	dc->inst = instcache.inst;
+	if (pick_device(dc, devnr) < 0)
+	{
+		free(ctx);
+		release_instance();
+		return 0;
+	}
+	const char* verbose = getenv("MVK_VERBOSE");
+	dc->verbose = verbose && *verbose;
+	list_memory_types(dc);
+	const int64_t t2 = now_ns();
+	ctx->pipelineCache = load_pipeline_cache(dc);
+	const int64_t t3 = now_ns();
+
+	if (ctx_create_objects(ctx) < 0)
+	{
+		fprintf(stderr, "Cannot create the job slots of a context.\n");
+		ctx_destroy_objects(ctx);
+		vkDestroyPipelineCache(dc->devi, ctx->pipelineCache, 0);
+		release_device(dc);
+		free(ctx);
+		return 0;
+	}
+
+	pthread_mutex_init(&ctx->lock, 0);
+	pthread_cond_init(&ctx->cond, 0);
+	pthread_cond_init(&ctx->work, 0);
+	const char* numstr = getenv("MVK_CALLBACK_THREADS");
+	const int numworkers = numstr ? atoi(numstr) : 2;
+	ctx->numworkers = numworkers < 1 ? 1 : numworkers > MVK_MAXWORKERS ? MVK_MAXWORKERS : numworkers;
+	for (uint32_t i=0; i<ctx->numworkers; ++i)
+	{
+		const int res_pc = pthread_create(ctx->workers + i, 0, job_worker, ctx);
+		assert(res_pc == 0);
+	}
+	ctx->trace = trace_create(&ctx->dc);
+
+	// Where the time to the first job goes. Making the instance and enumerating the devices only happens for the
+	// first context of the process, and is free for the others.
+	const int64_t t4 = now_ns();
+	fprintf
+	(
+		stderr,
+		"Startup in %.1f ms: instance %.1f ms, enumeration %.1f ms, device %.1f ms, pipeline cache %.1f ms, context %.1f ms\n",
+		(t4 - t0) * 1e-6,
+		fresh ? instcache.ns[0] * 1e-6 : 0.0,
+		fresh ? instcache.ns[1] * 1e-6 : 0.0,
+		(t2 - t1) * 1e-6,
+		(t3 - t2) * 1e-6,
+		(t4 - t3) * 1e-6
+	);
+	return ctx;
+}
+
+
+void mvk_destroy(mvk_context_t* ctx)
+{
+	devctx_t* dc = &ctx->dc;
+	pthread_mutex_lock(&ctx->lock);
+	ctx->quit = 1;
+	pthread_cond_broadcast(&ctx->work);
+	pthread_mutex_unlock(&ctx->lock);
+	for (uint32_t i=0; i<ctx->numworkers; ++i)
+		pthread_join(ctx->workers[i], 0);
+	pthread_cond_destroy(&ctx->work);
+	pthread_cond_destroy(&ctx->cond);
+	pthread_mutex_destroy(&ctx->lock);
+
+	if (ctx->trace)
+		trace_destroy(ctx->trace, &ctx->dc);
+	ctx_destroy_objects(ctx);
+	save_pipeline_cache(dc, ctx->pipelineCache);
+	vkDestroyPipelineCache(dc->devi, ctx->pipelineCache, 0);
+	arena_report(dc);
+	release_device(dc);
+	free(ctx);
+}
+
+
+int mvk_device_count(void)
+{
+	// While there are contexts, the instance knows. Otherwise it gets made just to count the devices.
+	pthread_mutex_lock(&instlock);
+	int count = instcache.refs ? (int) instcache.count : -1;
+	pthread_mutex_unlock(&instlock);
+	if (count < 0)
+	{
+		acquire_instance();
+		count = instcache.count;
+		release_instance();
+	}
+	return count;
+}
+
+
+const char* mvk_device_name(const mvk_context_t* ctx)
+{
+	return ctx->dc.dprops.deviceName;
+}
+
+
+#define MVK_BUFFER_USAGE \
+	( VK_BUFFER_USAGE_STORAGE_BUFFER_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT | VK_BUFFER_USAGE_TRANSFER_SRC_BIT | VK_BUFFER_USAGE_TRANSFER_DST_BIT | \
+	  ( dc->has_device_address ? VK_BUFFER_USAGE_SHADER_DEVICE_ADDRESS_BIT : 0 ) )
+
+static VkDeviceAddress buffer_address(devctx_t* dc, VkBuffer buf)
+{
+	if (!dc->has_device_address)
+		return 0;
+	VkBufferDeviceAddressInfo bdai;
+	bdai.sType = VK_STRUCTURE_TYPE_BUFFER_DEVICE_ADDRESS_INFO;
+	bdai.pNext = 0;
+	bdai.buffer = buf;
+	return vkGetBufferDeviceAddress(dc->devi, &bdai);
+}
+
+mvk_buffer_t* mvk_buffer_create(mvk_context_t* ctx, size_t size)
+{
+	devctx_t* dc = &ctx->dc;
+	mvk_buffer_t* buf = calloc(1, sizeof(mvk_buffer_t));
+	if (!buf)
+		return 0;
+	buf->ctx = ctx;
+	buf->size = size;
+	const int res_mb = mk_buffer
+	(
+		dc,
+		MVK_BUFFER_USAGE,
+		MEM_DEVICE,
+		size,
+		&buf->buf,
+		&buf->mem,
+		"mvk"
+	);
+	if (res_mb < 0)
+	{
+		free(buf);
+		return 0;
+	}
+	buf->addr = buffer_address(dc, buf->buf);
+	return buf;
+}
+
+
+mvk_buffer_t* mvk_buffer_import(mvk_context_t* ctx, void* ptr, size_t size)
+{
+	devctx_t* dc = &ctx->dc;
+	mvk_buffer_t* buf = calloc(1, sizeof(mvk_buffer_t));
+	if (!buf)
+		return 0;
+	buf->ctx = ctx;
+	buf->size = size;
+	buf->host = ptr;
+	if (!import_host_buffer(dc, ptr, size, MVK_BUFFER_USAGE, &buf->buf, &buf->imported))
+	{
+		// Fall back to a buffer of our own, that holds a copy.
+		if (mk_buffer(dc, MVK_BUFFER_USAGE, MEM_DEVICE, size, &buf->buf, &buf->mem, "import copy") < 0)
+		{
+			free(buf);
+			return 0;
+		}
+		if (upload_buffer(dc, buf->buf, &buf->mem, 0, ptr, size) < 0)
+		{
+			rm_buffer(dc, buf->buf, &buf->mem);
+			free(buf);
+			return 0;
+		}
+	}
+	buf->addr = buffer_address(dc, buf->buf);
+	return buf;
+}
+
+
+mvk_buffer_t* mvk_buffer_map_file(mvk_context_t* ctx, const char* fname, int writable)
+{
+	const int fd = open(fname, writable ? O_RDWR : O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Cannot open %s\n", fname);
+		return 0;
+	}
+	struct stat st;
+	if (fstat(fd, &st))
+	{
+		fprintf(stderr, "Cannot stat %s\n", fname);
+		close(fd);
+		return 0;
+	}
+	void* ptr = st.st_size ? mmap(0, st.st_size, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (ptr == MAP_FAILED)
+	{
+		fprintf(stderr, "Cannot map %s\n", fname);
+		return 0;
+	}
+	mvk_buffer_t* buf = mvk_buffer_import(ctx, ptr, st.st_size);
+	if (!buf)
+	{
+		munmap(ptr, st.st_size);
+		return 0;
+	}
+	buf->mapping = ptr;
+	buf->mappingsz = st.st_size;
+	return buf;
+}
+
+
+int mvk_buffer_is_zero_copy(const mvk_buffer_t* buf)
+{
+	return buf->imported != 0;
+}
+
+
+// Add [offset,offset+sz) to the dirty ranges of a buffer, widened to whole atoms, and merged with the ranges that it
+// overlaps or touches. When there are too many, the two that are closest together become one.
+// The caller holds the context lock, as jobs on other threads mark the buffers too.
+static void dirty_add(mvk_buffer_t* buf, VkDeviceSize offset, VkDeviceSize sz)
+{
+	if (!sz)
+		return;
+	const VkDeviceSize atom = buf->ctx->dc.dprops.limits.nonCoherentAtomSize;
+	VkDeviceSize beg = offset / atom * atom;
+	VkDeviceSize end = align_up(offset + sz, atom);
+	if (end > buf->size)
+		end = buf->size;
+	range_t merged[DIRTY_MAX + 1];
+	uint32_t n = 0;
+	uint32_t i = 0;
+	for (; i<buf->numdirty && buf->dirty[i].offset + buf->dirty[i].size < beg; ++i)
+		merged[n++] = buf->dirty[i];
+	for (; i<buf->numdirty && buf->dirty[i].offset <= end; ++i)
+	{
+		const range_t* r = buf->dirty + i;
+		beg = r->offset < beg ? r->offset : beg;
+		end = r->offset + r->size > end ? r->offset + r->size : end;
+	}
+	merged[n].offset = beg;
+	merged[n++].size = end - beg;
+	for (; i<buf->numdirty; ++i)
+		merged[n++] = buf->dirty[i];
+	if (n > DIRTY_MAX)
+	{
+		uint32_t closest = 0;
+		for (uint32_t j=1; j+1<n; ++j)
+			if (merged[j+1].offset - merged[j].offset - merged[j].size < merged[closest+1].offset - merged[closest].offset - merged[closest].size)
+				closest = j;
+		merged[closest].size = merged[closest+1].offset + merged[closest+1].size - merged[closest].offset;
+		memmove(merged + closest + 1, merged + closest + 2, (n - closest - 2) * sizeof(range_t));
+		n--;
+	}
+	memcpy(buf->dirty, merged, n * sizeof(range_t));
+	buf->numdirty = n;
+}
+
+
+void mvk_buffer_mark_dirty(mvk_buffer_t* buf, size_t offset, size_t size)
+{
+	assert(offset + size <= buf->size);
+	pthread_mutex_lock(&buf->ctx->lock);
+	dirty_add(buf, offset, size);
+	pthread_mutex_unlock(&buf->ctx->lock);
+}
+
+
+void mvk_buffer_clean(mvk_buffer_t* buf)
+{
+	pthread_mutex_lock(&buf->ctx->lock);
+	buf->numdirty = 0;
+	pthread_mutex_unlock(&buf->ctx->lock);
+}
+
+
+size_t mvk_buffer_dirty_size(const mvk_buffer_t* buf)
+{
+	size_t sz = 0;
+	for (uint32_t i=0; i<buf->numdirty; ++i)
+		sz += buf->dirty[i].size;
+	return sz;
+}
+
+
+int mvk_buffer_push(mvk_buffer_t* buf)
+{
+	if (buf->host && !buf->imported)
+		return upload_buffer(&buf->ctx->dc, buf->buf, &buf->mem, 0, buf->host, buf->size);
+	return 0;
+}
+
+
+int mvk_buffer_pull(mvk_buffer_t* buf)
+{
+	if (buf->host && !buf->imported)
+		return download_buffer(&buf->ctx->dc, buf->buf, &buf->mem, 0, buf->host, buf->size);
+	return 0;
+}
+
+
+int mvk_buffer_push_dirty(mvk_buffer_t* buf)
+{
+	if (buf->host && !buf->imported)
+		return upload_ranges(&buf->ctx->dc, buf->buf, &buf->mem, buf->host, buf->dirty, buf->numdirty);
+	return 0;
+}
+
+
+int mvk_buffer_pull_dirty(mvk_buffer_t* buf)
+{
+	if (buf->host && !buf->imported)
+		return download_ranges(&buf->ctx->dc, buf->buf, &buf->mem, buf->host, buf->dirty, buf->numdirty);
+	return 0;
+}
+
+
+void mvk_buffer_destroy(mvk_buffer_t* buf)
+{
+	if (buf->imported)
+	{
+		vkDestroyBuffer(buf->ctx->dc.devi, buf->buf, 0);
+		vkFreeMemory(buf->ctx->dc.devi, buf->imported, 0);
+	}
+	else
+		rm_buffer(&buf->ctx->dc, buf->buf, &buf->mem);
+	if (buf->mapping)
+		munmap(buf->mapping, buf->mappingsz);
+	free(buf);
+}
+
+
+size_t mvk_buffer_size(const mvk_buffer_t* buf)
+{
+	return buf->size;
+}
+
+
+int mvk_buffer_write(mvk_buffer_t* buf, size_t offset, const void* data, size_t size)
+{
+	assert(offset + size <= buf->size);
+	if (buf->imported)
+		memcpy((char*)buf->host + offset, data, size);
+	else if (upload_buffer(&buf->ctx->dc, buf->buf, &buf->mem, offset, data, size) < 0)
+		return -1;
+	pthread_mutex_lock(&buf->ctx->lock);
+	dirty_add(buf, offset, size);
+	pthread_mutex_unlock(&buf->ctx->lock);
+	return 0;
+}
+
+
+int mvk_buffer_read(const mvk_buffer_t* buf, size_t offset, void* data, size_t size)
+{
+	assert(offset + size <= buf->size);
+	if (buf->imported)
+	{
+		memcpy(data, (const char*)buf->host + offset, size);
+		return 0;
+	}
+	return download_buffer(&buf->ctx->dc, buf->buf, &buf->mem, offset, data, size);
+}
+
+
+mvk_module_t* mvk_module_load(mvk_context_t* ctx, const char* fname)
+{
+	devctx_t* dc = &ctx->dc;
+	mvk_module_t* mod = calloc(1, sizeof(mvk_module_t));
+	assert(mod);
+	mod->ctx = ctx;
+	mod->m.pushdesc = ctx->dc.has_push_descriptor;
+	if (mk_module(dc, &mod->m, fname, ctx->pipelineCache) < 0)
+	{
+		free(mod);
+		return 0;
+	}
+	load_tuning(dc, &mod->m);
+	return mod;
+}
+
+
+void mvk_module_unload(mvk_module_t* mod)
+{
+	rm_module(&mod->ctx->dc, &mod->m);
+	free(mod);
+}
+
+
+const mvk_kernel_t* mvk_kernel(const mvk_module_t* mod, const char* name)
+{
+	// The handle is the kernel itself, which the library knows as a kernel_t.
+	const kernel_t* k = find_kernel((module_t*) &mod->m, name);
+	if (!k)
+		fprintf(stderr, "There is no kernel named %s.\n", name);
+	return (const mvk_kernel_t*) k;
+}
+
+
+const char* mvk_kernel_name(const mvk_kernel_t* kernel)
+{
+	return ((const kernel_t*) kernel)->name;
+}
+
+
+uint32_t mvk_kernel_wgsz(const mvk_kernel_t* kernel)
+{
+	return ((const kernel_t*) kernel)->wgsz[0];
+}
+
+
+// The window of tile t on a buffer. If the dispatch got split, storage buffers that hold a word per work item
+// get windowed. Others, and all buffers of a dispatch that did not get split, get used whole.
+static void tile_window(const kernel_t* k, const karg_t* a, const mvk_buffer_t* buf, const tile_t* t, VkDeviceSize numwork, VkDeviceSize* offset, VkDeviceSize* range)
+{
+	*offset = 0;
+	*range = VK_WHOLE_SIZE;
+	if (a->type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER && buf->size >= numwork * sizeof(uint32_t) && t->numwords < numwork)
+	{
+		// Without robust access, the last group can only hang over the end if the buffer has room for it.
+		const VkDeviceSize pergroup = (VkDeviceSize)k->wgsz[0] * k->ipt;
+		const VkDeviceSize covered = (VkDeviceSize)t->numgroups * pergroup * sizeof(uint32_t);
+		const VkDeviceSize room = buf->size - t->firstword * sizeof(uint32_t);
+		*offset = t->firstword * sizeof(uint32_t);
+		*range = covered <= room ? covered : t->numwords * sizeof(uint32_t);
+	}
+}
+
+
+// Fill in the descriptor writes that point the bindings at the window of tile t on the buffers. Returns their number.
+static uint32_t tile_descriptor_writes(VkDescriptorSet set, const kernel_t* k, mvk_buffer_t* const* buffers, const tile_t* t, VkDeviceSize numwork, VkDescriptorBufferInfo* dbi, VkWriteDescriptorSet* wds)
+{
+	uint32_t n = 0;
+	for (uint32_t i=0; i<k->numargs; ++i)
+	{
+		const karg_t* a = k->args + i;
+		if (a->binding < 0)
+			continue;
+		assert(a->type == VK_DESCRIPTOR_TYPE_STORAGE_BUFFER || a->type == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER);
+		const mvk_buffer_t* buf = buffers[a->slot];
+		dbi[n].buffer = buf->buf;
+		tile_window(k, a, buf, t, numwork, &dbi[n].offset, &dbi[n].range);
+		wds[n].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+		wds[n].pNext = 0;
+		wds[n].dstSet = set;
+		wds[n].dstBinding = a->binding;
+		wds[n].dstArrayElement = 0;
+		wds[n].descriptorCount = 1;
+		wds[n].descriptorType = a->type;
+		wds[n].pImageInfo = 0;
+		wds[n].pBufferInfo = dbi + n;
+		wds[n].pTexelBufferView = 0;
+		n++;
+	}
+	return n;
+}
+
+
+// Put the addresses of the windows of tile t on the buffers in the push constants, for the args that take them.
+static void tile_pointers(const kernel_t* k, mvk_buffer_t* const* buffers, const tile_t* t, VkDeviceSize numwork, uint8_t* pc)
+{
+	for (uint32_t i=0; i<k->numargs; ++i)
+	{
+		const karg_t* a = k->args + i;
+		if (!a->ptr)
+			continue;
+		assert(a->size == sizeof(VkDeviceAddress) && a->offset + a->size <= k->pcsz);
+		const mvk_buffer_t* buf = buffers[a->slot];
+		VkDeviceSize offset, range;
+		tile_window(k, a, buf, t, numwork, &offset, &range);
+		const VkDeviceAddress addr = buf->addr + offset;
+		memcpy(pc + a->offset, &addr, sizeof(addr));
+	}
+}
+
+
+// Plan tiles over only the work groups of a dispatch that cover the dirty ranges of its buffers that hold a word per
+// work item. Returns the number of tiles, which is 0 if nothing is dirty, or -1 if it takes too many.
+static int plan_dirty_tiles(const kernel_t* k, VkDeviceSize numwork, mvk_buffer_t* const* buffers, uint32_t numbuffers, const VkPhysicalDeviceLimits* limits, tile_t* tiles)
+{
+	const VkDeviceSize pergroup = (VkDeviceSize)k->wgsz[0] * k->ipt;
+	VkDeviceSize step;
+	const VkDeviceSize tilewords = tile_words(k, limits, &step);
+	// The dirty words, widened to where tiles can start and end, and sorted by their first word.
+	range_t spans[MAXARGS * DIRTY_MAX];
+	uint32_t numspans = 0;
+	for (uint32_t i=0; i<numbuffers; ++i)
+	{
+		const mvk_buffer_t* buf = buffers[i];
+		if (buf->size < numwork * sizeof(uint32_t))
+			continue;
+		for (uint32_t d=0; d<buf->numdirty; ++d)
+		{
+			const range_t* r = buf->dirty + d;
+			const VkDeviceSize first = r->offset / sizeof(uint32_t) / step * step;
+			VkDeviceSize last = align_up((r->offset + r->size + sizeof(uint32_t) - 1) / sizeof(uint32_t), pergroup);
+			if (last > numwork)
+				last = numwork;
+			if (first >= last)
+				continue;
+			uint32_t j = numspans++;
+			for (; j>0 && spans[j-1].offset > first; --j)
+				spans[j] = spans[j-1];
+			spans[j].offset = first;
+			spans[j].size = last - first;
+		}
+	}
+	// Tile the spans, after merging the ones that overlap.
+	uint32_t numtiles = 0;
+	for (uint32_t i=0; i<numspans; )
+	{
+		const VkDeviceSize first = spans[i].offset;
+		VkDeviceSize last = first + spans[i].size;
+		for (++i; i<numspans && spans[i].offset <= last; ++i)
+			if (spans[i].offset + spans[i].size > last)
+				last = spans[i].offset + spans[i].size;
+		numtiles = add_tiles(k, first, last, tilewords, tiles, numtiles);
+		if (!numtiles)
+			return -1;
+	}
+	return (int) numtiles;
+}
+
+
+static void graph_init(mvk_graph_t* graph, mvk_context_t* ctx)
+{
+	graph->ctx = ctx;
+	graph->numnodes = 0;
+	graph->numtiles = 0;
+}
+
+
+mvk_graph_t* mvk_graph_create(mvk_context_t* ctx)
+{
+	mvk_graph_t* graph = malloc(sizeof(mvk_graph_t));
+	assert(graph);
+	graph_init(graph, ctx);
+	return graph;
+}
+
+
+void mvk_graph_destroy(mvk_graph_t* graph)
+{
+	free(graph);
+}
+
+
+// Add a dispatch to a graph. If dirty is set, it runs only the tiles over the dirty ranges of its buffers, and every
+// submit of the graph marks what they cover as dirty in the buffers that it writes.
+static int graph_dispatch
+(
+	mvk_graph_t* graph,
+	const mvk_kernel_t* kernel,
+	size_t numwork,
+	mvk_buffer_t* const* buffers,
+	uint32_t numbuffers,
+	uint32_t writes,
+	const void* pc,
+	uint32_t pcsz,
+	int dirty
+)
+{
+	const mvk_context_t* ctx = graph->ctx;
+	const kernel_t* k = (const kernel_t*) kernel;
+	// Run the variant that suits the size, unless a specific one was asked for.
+	if (k->base == k)
+		k = pick_variant(k, numwork, ctx->dc.dprops.limits.maxComputeWorkGroupCount[0]);
+	if (numbuffers != k->numbindings + k->numpointers || numbuffers > MAXARGS)
+	{
+		fprintf(stderr, "%s takes %u buffers, not %u.\n", k->name, k->numbindings + k->numpointers, numbuffers);
+		return -1;
+	}
+	// The pointers to the buffers get filled in for the kernel, so pc may leave them off at the end.
+	if (k->pcsz > GRAPH_MAXPC || !(pcsz == k->pcsz || (k->numpointers && pcsz <= k->pcsz)))
+	{
+		fprintf(stderr, "%s takes %u bytes of push constants, not %u.\n", k->name, k->pcsz, pcsz);
+		return -1;
+	}
+	if (graph->numnodes == GRAPH_MAXNODES)
+	{
+		fprintf(stderr, "A graph can not have more than %d nodes.\n", GRAPH_MAXNODES);
+		return -1;
+	}
+
+	// Split it up if it is too large for a single dispatch. A dirty dispatch that would take too many tiles runs whole.
+	tile_t tiles[TILE_MAX];
+	const int numdirtytiles = dirty ? plan_dirty_tiles(k, numwork, buffers, numbuffers, &ctx->dc.dprops.limits, tiles) : -1;
+	const uint32_t numtiles = numdirtytiles >= 0 && graph->numtiles + numdirtytiles <= TILE_MAX ? (uint32_t) numdirtytiles : plan_tiles(k, numwork, &ctx->dc.dprops.limits, tiles);
+	if ((!numtiles && numdirtytiles) || graph->numtiles + numtiles > TILE_MAX)
+	{
+		fprintf(stderr, "A job over %zu words would take more than %d dispatches.\n", numwork, TILE_MAX);
+		return -1;
+	}
+	const VkDeviceSize pergroup = (VkDeviceSize)k->wgsz[0] * k->ipt;
+	const VkDeviceSize coveredsz = (numwork + pergroup - 1) / pergroup * pergroup * sizeof(uint32_t);
+	// Kernels like foo check their index against the words of the job, which does not help in a window, where the
+	// index starts over. There the last group needs room in the buffers, or robust access, which does not cover
+	// buffers that are passed by address.
+	int windowed = 0;
+	for (uint32_t t=0; t<numtiles; ++t)
+		windowed |= tiles[t].numwords < numwork;
+	if (windowed && (!ctx->dc.has_robust_access || k->numpointers))
+		for (uint32_t i=0; i<numbuffers; ++i)
+			if (buffers[i]->size >= numwork * sizeof(uint32_t) && buffers[i]->size < coveredsz)
+			{
+				fprintf(stderr, "Without robustBufferAccess, the buffers of a job over %zu words need %lu bytes.\n", numwork, coveredsz);
+				return -1;
+			}
+
+	node_t* n = graph->nodes + graph->numnodes;
+	memset(n, 0, sizeof(node_t));
+	n->type = NODE_DISPATCH;
+	n->kernel = k;
+	n->numwork = numwork;
+	memcpy(n->buffers, buffers, numbuffers * sizeof(mvk_buffer_t*));
+	n->numbuffers = numbuffers;
+	n->writes = writes;
+	if (pcsz)
+		memcpy(n->pc, pc, pcsz);
+	n->pcsz = k->pcsz;
+	n->firsttile = graph->numtiles;
+	n->numtiles = numtiles;
+	memcpy(graph->tiles + graph->numtiles, tiles, numtiles * sizeof(tile_t));
+	graph->numtiles += numtiles;
+	n->stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+	n->readaccess = VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_UNIFORM_READ_BIT;
+	n->writeaccess = VK_ACCESS_SHADER_WRITE_BIT;
+	n->dirty = dirty;
+	return graph->numnodes++;
+}
+
+
+int mvk_graph_dispatch
+(
+	mvk_graph_t* graph,
+	const mvk_kernel_t* kernel,
+	size_t numwork,
+	mvk_buffer_t* const* buffers,
+	uint32_t numbuffers,
+	uint32_t writes,
+	const void* pc,
+	uint32_t pcsz
+)
+{
+	return graph_dispatch(graph, kernel, numwork, buffers, numbuffers, writes, pc, pcsz, 0);
+}
+
+
+int mvk_graph_dispatch_dirty
+(
+	mvk_graph_t* graph,
+	const mvk_kernel_t* kernel,
+	size_t numwork,
+	mvk_buffer_t* const* buffers,
+	uint32_t numbuffers,
+	uint32_t writes,
+	const void* pc,
+	uint32_t pcsz
+)
+{
+	return graph_dispatch(graph, kernel, numwork, buffers, numbuffers, writes, pc, pcsz, 1);
+}
+
+
+int mvk_graph_copy(mvk_graph_t* graph, mvk_buffer_t* src, size_t srcoffset, mvk_buffer_t* dst, size_t dstoffset, size_t size)
+{
+	assert(srcoffset + size <= src->size && dstoffset + size <= dst->size);
+	if (graph->numnodes == GRAPH_MAXNODES)
+	{
+		fprintf(stderr, "A graph can not have more than %d nodes.\n", GRAPH_MAXNODES);
+		return -1;
+	}
+	node_t* n = graph->nodes + graph->numnodes;
+	memset(n, 0, sizeof(node_t));
+	n->type = NODE_COPY;
+	n->buffers[0] = src;
+	n->buffers[1] = dst;
+	n->numbuffers = 2;
+	n->writes = 2;
+	n->region.srcOffset = srcoffset;
+	n->region.dstOffset = dstoffset;
+	n->region.size = size;
+	n->stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+	n->readaccess = VK_ACCESS_TRANSFER_READ_BIT;
+	n->writeaccess = VK_ACCESS_TRANSFER_WRITE_BIT;
+	return graph->numnodes++;
+}
+
+
+// Returns 1 if node b has to wait for the earlier node a, because one of them writes a buffer that both use.
+// Adds the writes of a that b has to see to *access. Copies are ordered by buffer, and not by range.
+static int node_depends(const node_t* b, const node_t* a, VkAccessFlags* access)
+{
+	int dep = 0;
+	for (uint32_t i=0; i<b->numbuffers; ++i)
+		for (uint32_t j=0; j<a->numbuffers; ++j)
+			if (b->buffers[i] == a->buffers[j])
+			{
+				if ((a->writes >> j) & 1)
+				{
+					*access |= a->writeaccess;
+					dep = 1;
+				}
+				if ((b->writes >> i) & 1)
+					dep = 1;
+			}
+	return dep;
+}
+
+
+mvk_job_t* mvk_graph_submit(mvk_graph_t* graph, mvk_callback_t callback, void* user)
+{
+	mvk_context_t* ctx = graph->ctx;
+	const VkDevice dev = ctx->dc.devi;
+	trace_t* tr = ctx->trace;
+	const int64_t t0 = tr ? now_ns() : 0;
+	node_t* nodes = graph->nodes;
+	const uint32_t numnodes = graph->numnodes;
+	assert(numnodes);
+
+	// Put every node in the wave after the last of the nodes that it depends on. The waves get a barrier
+	// between them, that waits for just the stages and writes that the next wave depends on.
+	VkPipelineStageFlags srcstages[GRAPH_MAXNODES] = { 0 };
+	VkAccessFlags srcaccess[GRAPH_MAXNODES] = { 0 };
+	VkPipelineStageFlags dststages[GRAPH_MAXNODES] = { 0 };
+	VkAccessFlags dstaccess[GRAPH_MAXNODES] = { 0 };
+	VkPipelineStageFlags allstages = 0;
+	VkAccessFlags allwrites = 0;
+	for (uint32_t i=0; i<numnodes; ++i)
+	{
+		node_t* n = nodes + i;
+		n->wave = 0;
+		n->depstages = 0;
+		n->depaccess = 0;
+		for (uint32_t j=0; j<i; ++j)
+			if (node_depends(n, nodes + j, &n->depaccess))
+			{
+				n->depstages |= nodes[j].stage;
+				if (nodes[j].wave + 1 > n->wave)
+					n->wave = nodes[j].wave + 1;
+			}
+		if (n->wave)
+		{
+			srcstages[n->wave] |= n->depstages;
+			srcaccess[n->wave] |= n->depaccess;
+			dststages[n->wave] |= n->stage;
+			dstaccess[n->wave] |= n->readaccess | n->writeaccess;
+		}
+		allstages |= n->stage;
+		allwrites |= n->writeaccess;
+	}
+
+	// Record wave by wave, so that independent nodes can overlap. Within a wave, dispatches of
+	// the same pipeline go back to back, and share a bind.
+	uint32_t order[GRAPH_MAXNODES];
+	for (uint32_t i=0; i<numnodes; ++i)
+	{
+		uint32_t j = i;
+		for (; j>0; --j)
+		{
+			const node_t* a = nodes + order[j-1];
+			const node_t* b = nodes + i;
+			const VkPipeline pa = a->kernel ? a->kernel->pipeline : VK_NULL_HANDLE;
+			const VkPipeline pb = b->kernel ? b->kernel->pipeline : VK_NULL_HANDLE;
+			if (a->wave < b->wave || (a->wave == b->wave && (uintptr_t)pa <= (uintptr_t)pb))
+				break;
+			order[j] = order[j-1];
+		}
+		order[j] = i;
+	}
+
+	pthread_mutex_lock(&ctx->lock);
+	// Dirty dispatches mark what they cover, each time that they run. Jobs of other threads may mark the same buffers.
+	for (uint32_t i=0; i<numnodes; ++i)
+	{
+		const node_t* n = nodes + i;
+		for (uint32_t b=0; b<n->numbuffers && n->dirty; ++b)
+			if ((n->writes >> b & 1) && n->buffers[b]->size >= n->numwork * sizeof(uint32_t))
+				for (uint32_t t=0; t<n->numtiles; ++t)
+				{
+					const tile_t* tl = graph->tiles + n->firsttile + t;
+					dirty_add(n->buffers[b], tl->firstword * sizeof(uint32_t), tl->numwords * sizeof(uint32_t));
+				}
+	}
+
+	// Wait for a free slot, if too many jobs are in flight.
+	while (!ctx->numfree)
+		pthread_cond_wait(&ctx->cond, &ctx->lock);
+	mvk_job_t* job = ctx->jobs + ctx->freeslots[--ctx->numfree];
+	job->state = JOB_PENDING;
+	job->autorelease = 0;
+	job->callback = callback;
+	job->user = user;
+	job->gpuns = 0;
+	// The jobs take turns over the compute queues.
+	job->queue = ctx->jobqueues[ctx->nextqueue++ % ctx->numjobqueues];
+
+	// A descriptor set per tile of every dispatch that binds its buffers, rather than push them.
+	VkDescriptorSetLayout layouts[TILE_MAX];
+	uint32_t numsets = 0;
+	for (uint32_t i=0; i<numnodes; ++i)
+	{
+		node_t* n = nodes + i;
+		n->firstset = numsets;
+		if (n->type == NODE_DISPATCH && n->kernel->numbindings && !n->kernel->module->pushdesc)
+			for (uint32_t t=0; t<n->numtiles; ++t)
+				layouts[numsets++] = n->kernel->dsl;
+	}
+	if (numsets)
+	{
+		const VkDescriptorSetAllocateInfo dsai =
+		{
+			VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+			0,
+			ctx->descriptorPool,
+			numsets,
+			layouts
+		};
+		// The pool can run dry when many jobs are split into tiles. Then wait for one to be freed.
+		VkResult res_ads;
+		while ((res_ads = vkAllocateDescriptorSets(dev, &dsai, job->descriptorSets)) != VK_SUCCESS)
+		{
+			if (res_ads != VK_ERROR_OUT_OF_POOL_MEMORY && res_ads != VK_ERROR_FRAGMENTED_POOL)
+			{
+				pthread_mutex_unlock(&ctx->lock);
+				return job_abort(job, res_ads);
+			}
+			pthread_cond_wait(&ctx->cond, &ctx->lock);
+		}
+	}
+	job->numsets = numsets;
+	pthread_mutex_unlock(&ctx->lock);
+
+	// From here on, only the job, its sets and the pool of its queue get touched, so other threads can record too.
+	for (uint32_t i=0; i<numnodes; ++i)
+	{
+		const node_t* n = nodes + i;
+		if (n->type != NODE_DISPATCH || !n->kernel->numbindings || n->kernel->module->pushdesc)
+			continue;
+		for (uint32_t t=0; t<n->numtiles; ++t)
+		{
+			VkDescriptorBufferInfo dbi[MAXARGS];
+			VkWriteDescriptorSet wds[MAXARGS];
+			const uint32_t nw = tile_descriptor_writes(job->descriptorSets[n->firstset + t], n->kernel, n->buffers, graph->tiles + n->firsttile + t, n->numwork, dbi, wds);
+			vkUpdateDescriptorSets(dev, nw, wds, 0, 0);
+		}
+	}
+
+	const VkCommandBufferBeginInfo cbbi =
+	{
+		VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+		0,
+		VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT,
+		0
+	};
+	jobpool_t* jp = ctx->jobpools + job->queue;
+	pthread_mutex_lock(&jp->lock);
+	if (!jp->cbs[job->slot])
+	{
+		const VkCommandBufferAllocateInfo cbai =
+		{
+			VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+			0,
+			jp->pool,
+			VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+			1
+		};
+		const VkResult res_acb = vkAllocateCommandBuffers(dev, &cbai, jp->cbs + job->slot);
+		if (res_acb != VK_SUCCESS)
+		{
+			jp->cbs[job->slot] = VK_NULL_HANDLE;
+			pthread_mutex_unlock(&jp->lock);
+			return job_abort(job, res_acb);
+		}
+	}
+	job->cb = jp->cbs[job->slot];
+	const VkResult res_bcb = vkBeginCommandBuffer(job->cb, &cbbi);
+	if (res_bcb != VK_SUCCESS)
+	{
+		pthread_mutex_unlock(&jp->lock);
+		return job_abort(job, res_bcb);
+	}
+	vkCmdResetQueryPool(job->cb, ctx->queryPool, 2 * job->slot, 2);
+	if (tr)
+		trace_begin_job(tr, job);
+	vkCmdWriteTimestamp(job->cb, VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT, ctx->queryPool, 2 * job->slot + 0);
+	uint32_t wave = 0;
+	const kernel_t* bound = 0;
+	const node_t* pushed = 0;
+	for (uint32_t o=0; o<numnodes; ++o)
+	{
+		const node_t* n = nodes + order[o];
+		if (n->wave != wave)
+		{
+			wave = n->wave;
+			const VkMemoryBarrier mb =
+			{
+				VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+				0,
+				srcaccess[wave],
+				dstaccess[wave],
+			};
+			const uint32_t span = tr ? trace_open(tr, job, "barrier", "barrier", -1) : 0;
+			vkCmdPipelineBarrier
+			(
+				job->cb,
+				srcstages[wave],
+				dststages[wave],
+				0,
+				srcaccess[wave] ? 1 : 0, &mb,
+				0, 0,
+				0, 0
+			);
+			if (tr)
+				trace_close(tr, job, span, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+		}
+		if (n->type == NODE_COPY)
+		{
+			const uint32_t span = tr ? trace_open(tr, job, "copy", "copy", -1) : 0;
+			vkCmdCopyBuffer(job->cb, n->buffers[0]->buf, n->buffers[1]->buf, 1, &n->region);
+			if (tr)
+				trace_close(tr, job, span, VK_PIPELINE_STAGE_TRANSFER_BIT);
+			continue;
+		}
+		const kernel_t* k = n->kernel;
+		if (k != bound)
+		{
+			vkCmdBindPipeline(job->cb, VK_PIPELINE_BIND_POINT_COMPUTE, k->pipeline);
+			bound = k;
+			pushed = 0;
+		}
+		if (n->pcsz && !k->numpointers && !(pushed && pushed->pcsz == n->pcsz && !memcmp(pushed->pc, n->pc, n->pcsz)))
+		{
+			vkCmdPushConstants(job->cb, k->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, n->pcsz, n->pc);
+			pushed = n;
+		}
+		// The span gets the name of the kernel, which is also the debug label of its pipeline.
+		const uint32_t span = tr ? trace_open(tr, job, k->name, "dispatch", order[o]) : 0;
+		// The tiles write disjoint windows, so they need no barriers between them.
+		for (uint32_t t=0; t<n->numtiles; ++t)
+		{
+			const tile_t* tile = graph->tiles + n->firsttile + t;
+			if (k->numpointers)
+			{
+				// Every tile gets the addresses of its own windows.
+				uint8_t pc[GRAPH_MAXPC];
+				memcpy(pc, n->pc, n->pcsz);
+				tile_pointers(k, n->buffers, tile, n->numwork, pc);
+				vkCmdPushConstants(job->cb, k->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, n->pcsz, pc);
+				pushed = 0;
+			}
+			if (k->numbindings && k->module->pushdesc)
+			{
+				VkDescriptorBufferInfo dbi[MAXARGS];
+				VkWriteDescriptorSet wds[MAXARGS];
+				const uint32_t nw = tile_descriptor_writes(VK_NULL_HANDLE, k, n->buffers, tile, n->numwork, dbi, wds);
+				ctx->dc.pfnCmdPushDescriptorSetKHR(job->cb, VK_PIPELINE_BIND_POINT_COMPUTE, k->layout, 0, nw, wds);
+			}
+			else if (k->numbindings)
+				vkCmdBindDescriptorSets(job->cb, VK_PIPELINE_BIND_POINT_COMPUTE, k->layout, 0, 1, job->descriptorSets + n->firstset + t, 0, 0);
+			vkCmdDispatch(job->cb, tile->numgroups, 1, 1);
+		}
+		if (tr)
+			trace_close(tr, job, span, VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT);
+	}
+	vkCmdWriteTimestamp(job->cb, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, ctx->queryPool, 2 * job->slot + 1);
+
+	// Make the results visible to later jobs, to copies, and to the host.
+	const VkMemoryBarrier mb =
+	{
+		VK_STRUCTURE_TYPE_MEMORY_BARRIER,
+		0,
+		allwrites,
+		VK_ACCESS_SHADER_READ_BIT | VK_ACCESS_SHADER_WRITE_BIT | VK_ACCESS_TRANSFER_READ_BIT | VK_ACCESS_TRANSFER_WRITE_BIT | VK_ACCESS_HOST_READ_BIT,
+	};
+	const uint32_t span = tr ? trace_open(tr, job, "barrier", "barrier", -1) : 0;
+	vkCmdPipelineBarrier
+	(
+		job->cb,
+		allstages,
+		VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT | VK_PIPELINE_STAGE_TRANSFER_BIT | VK_PIPELINE_STAGE_HOST_BIT,
+		0,
+		1, &mb,
+		0, 0,
+		0, 0
+	);
+	if (tr)
+		trace_close(tr, job, span, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT);
+	const VkResult res_ecb = vkEndCommandBuffer(job->cb);
+	pthread_mutex_unlock(&jp->lock);
+	if (res_ecb != VK_SUCCESS)
+		return job_abort(job, res_ecb);
+
+	const VkResult res_rf = vkResetFences(dev, 1, &job->fence);
+	if (res_rf != VK_SUCCESS)
+		return job_abort(job, res_rf);
+	const VkSubmitInfo si =
+	{
+		VK_STRUCTURE_TYPE_SUBMIT_INFO,
+		0,
+		0, 0, 0,
+		1, &job->cb,
+		0, 0
+	};
+	queues_t* qs = &ctx->dc.queues;
+	pthread_mutex_lock(qs->lock + job->queue);
+	if (tr)
+		tr->submitns[job->slot] = now_ns();
+	const VkResult res_qs = vkQueueSubmit(qs->queue[job->queue], 1, &si, job->fence);
+	pthread_mutex_unlock(qs->lock + job->queue);
+	if (res_qs != VK_SUCCESS)
+		return job_abort(job, res_qs);
+
+	pthread_mutex_lock(&ctx->lock);
+	ctx->pending[(ctx->head + ctx->numpending) % MVK_MAXJOBS] = job->slot;
+	ctx->numpending++;
+	pthread_cond_signal(&ctx->work);
+	const uint32_t slot = job->slot;
+	pthread_mutex_unlock(&ctx->lock);
+	if (tr)
+		trace_host(tr, "submit", t0, now_ns(), slot);
+	return job;
+}
+
+
+mvk_job_t* mvk_submit
+(
+	mvk_context_t* ctx,
+	const mvk_kernel_t* kernel,
+	size_t numwork,
+	mvk_buffer_t* const* buffers,
+	uint32_t numbuffers,
+	const void* pc,
+	uint32_t pcsz,
+	mvk_callback_t callback,
+	void* user
+)
+{
+	// A graph of one dispatch, that may write all its buffers.
+	mvk_graph_t graph;
+	graph_init(&graph, ctx);
+	if (mvk_graph_dispatch(&graph, kernel, numwork, buffers, numbuffers, ~0u, pc, pcsz) < 0)
+		return 0;
+	return mvk_graph_submit(&graph, callback, user);
+}
+
+
+mvk_job_t* mvk_submit_dirty
+(
+	mvk_context_t* ctx,
+	const mvk_kernel_t* kernel,
+	size_t numwork,
+	mvk_buffer_t* const* buffers,
+	uint32_t numbuffers,
+	const void* pc,
+	uint32_t pcsz,
+	mvk_callback_t callback,
+	void* user
+)
+{
+	mvk_graph_t graph;
+	graph_init(&graph, ctx);
+	if (mvk_graph_dispatch_dirty(&graph, kernel, numwork, buffers, numbuffers, ~0u, pc, pcsz) < 0)
+		return 0;
+	return mvk_graph_submit(&graph, callback, user);
+}
+
+
+int mvk_job_poll(mvk_job_t* job)
+{
+	pthread_mutex_lock(&job->ctx->lock);
+	const int done = job->state == JOB_DONE;
+	pthread_mutex_unlock(&job->ctx->lock);
+	return done;
+}
+
+
+int64_t mvk_job_wait(mvk_job_t* job)
+{
+	mvk_context_t* ctx = job->ctx;
+	const int64_t t0 = ctx->trace ? now_ns() : 0;
+	pthread_mutex_lock(&ctx->lock);
+	assert(job->state != JOB_FREE && !job->autorelease);
+	const int waited = job->state != JOB_DONE;
+	while (job->state != JOB_DONE)
+		pthread_cond_wait(&ctx->cond, &ctx->lock);
+	const int64_t ns = job->gpuns;
+	pthread_mutex_unlock(&ctx->lock);
+	// Only a wait that blocked is a stall worth seeing.
+	if (ctx->trace && waited)
+		trace_host(ctx->trace, "wait", t0, now_ns(), job->slot);
+	return ns;
+}
+
+
+void mvk_job_release(mvk_job_t* job)
+{
+	mvk_context_t* ctx = job->ctx;
+	pthread_mutex_lock(&ctx->lock);
+	if (job->state == JOB_DONE)
+		job_free(job);
+	else
+		job->autorelease = 1;
+	pthread_mutex_unlock(&ctx->lock);
+}
+
+#pragma mark Streaming
+
+#define STREAM_MAXSLOTS	16
+
+// One in-flight chunk of a stream: its own buffers, staging, descriptor set and commands.
+typedef struct
+{
+	mvk_buffer_t* buffers[2];		// The input and the output of the kernel.
+	xfer_t upload;
+	xfer_t download;
+	VkDescriptorSet descriptorSet;		// If the kernel binds a set, rather than push it.
+	VkCommandBuffer commandBuffer;		// Recorded once, submitted for every chunk that uses this slot.
+	VkSemaphore computeDone;		// Signalled by the dispatch, waited on by the download.
+	int64_t chunk;				// Chunk that is in flight in this slot, or -1.
+} slot_t;
+
+
+int64_t mvk_stream
+(
+	mvk_context_t* ctx,
+	const mvk_kernel_t* kernel,
+	size_t numwords,
+	size_t chunkwords,
+	uint32_t numslots,
+	const void* pc,
+	uint32_t pcsz,
+	mvk_chunk_fn produce,
+	mvk_chunk_fn consume,
+	void* user,
+	int64_t* hostns
+)
+{
+	devctx_t* dc = &ctx->dc;
+	const VkPhysicalDeviceLimits* limits = &ctx->dc.dprops.limits;
+	const kernel_t* k = (const kernel_t*) kernel;
+	// Run the variant that suits the chunks, which get padded to whole work groups of it.
+	if (k->base == k && chunkwords)
+	{
+		const kernel_t* t = k->tuned ? k->tuned : k;
+		const size_t pergroup = (size_t)t->wgsz[0] * t->ipt;
+		k = pick_variant(k, (chunkwords + pergroup - 1) / pergroup * pergroup, limits->maxComputeWorkGroupCount[0]);
+	}
+	if (k->numbindings + k->numpointers != 2)
+	{
+		fprintf(stderr, "%s does not take just an input and an output buffer.\n", k->name);
+		return -1;
+	}
+	if (k->pcsz > GRAPH_MAXPC || !(pcsz == k->pcsz || (k->numpointers && pcsz <= k->pcsz)))
+	{
+		fprintf(stderr, "%s takes %u bytes of push constants, not %u.\n", k->name, k->pcsz, pcsz);
+		return -1;
+	}
+	const size_t pergroup = (size_t)k->wgsz[0] * k->ipt;
+	const size_t padwords = (chunkwords + pergroup - 1) / pergroup * pergroup;
+	const VkDeviceSize chunksz = chunkwords * sizeof(uint32_t);
+	const VkDeviceSize padsz = padwords * sizeof(uint32_t);
+	const uint32_t numgroups = num_groups(k, padwords);
+	if (!chunkwords || numgroups > limits->maxComputeWorkGroupCount[0] || padsz > limits->maxStorageBufferRange)
+	{
+		fprintf(stderr, "Chunks of %zu words do not fit in one dispatch of %s.\n", chunkwords, k->name);
+		return -1;
+	}
+	const int64_t numchunks = (int64_t)((numwords + chunkwords - 1) / chunkwords);
+	if (numslots < 1)
+		numslots = 1;
+	if (numslots > STREAM_MAXSLOTS)
+		numslots = STREAM_MAXSLOTS;
+
+	// The slots bind sets of their own, where the kernel can not have its descriptors pushed.
+	const int bindsets = k->numbindings && !k->module->pushdesc;
+	VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+	VkCommandPool commandPool = VK_NULL_HANDLE;
+	slot_t slots[STREAM_MAXSLOTS];
+	memset(slots, 0, sizeof(slots));
+	int failed = 0;
+	if (bindsets)
+	{
+		const VkDescriptorPoolSize dps[2] =
+		{
+			{ VK_DESCRIPTOR_TYPE_STORAGE_BUFFER, 2 * numslots },
+			{ VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER, 2 * numslots },
+		};
+		const VkDescriptorPoolCreateInfo dpci =
+		{
+			VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO,
+			0,
+			0,
+			numslots,
+			2,
+			dps
+		};
+		if (vkCreateDescriptorPool(dc->devi, &dpci, 0, &descriptorPool) != VK_SUCCESS)
+		{
+			descriptorPool = VK_NULL_HANDLE;
+			failed = 1;
+		}
+	}
+	const VkCommandPoolCreateInfo commandPoolCreateInfo =
+	{
+		VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO,
+		0,				// next
+		0,				// flags
+		dc->qfam				// queue fam
+	};
+	if (!failed && vkCreateCommandPool(dc->devi, &commandPoolCreateInfo, 0, &commandPool) != VK_SUCCESS)
+	{
+		commandPool = VK_NULL_HANDLE;
+		failed = 1;
+	}
+
+	const tile_t tile = { 0, padwords, numgroups };
+	for (uint32_t s=0; s<numslots; ++s)
+		slots[s].chunk = -1;
+	for (uint32_t s=0; s<numslots && !failed; ++s)
+	{
+		slot_t* sl = slots + s;
+		char tag[32];
+		sl->buffers[0] = mvk_buffer_create(ctx, padsz);
+		sl->buffers[1] = mvk_buffer_create(ctx, padsz);
+		snprintf(tag, sizeof(tag), "upload%u", s);
+		failed |= xfer_init(dc, &sl->upload, MEM_UPLOAD, padsz, tag) < 0;
+		snprintf(tag, sizeof(tag), "download%u", s);
+		failed |= xfer_init(dc, &sl->download, MEM_READBACK, chunksz, tag) < 0;
+		snprintf(tag, sizeof(tag), "computed%u", s);
+		sl->computeDone = mk_semaphore(dc, tag);
+		if (failed || !sl->buffers[0] || !sl->buffers[1] || !sl->computeDone)
+		{
+			failed = 1;
+			break;
+		}
+
+		// The buffers of a slot never change, so its commands are recorded just once.
+		const VkCommandBufferAllocateInfo commandBufferAllocateInfo =
+		{
+			VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO,
+			0,
+			commandPool,
+			VK_COMMAND_BUFFER_LEVEL_PRIMARY,
+			1
+		};
+		const VkCommandBufferBeginInfo commandBufferBeginInfo =
+		{
+			VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO,
+			0,
+			0,
+			0
+		};
+		if
+		(
+			vkAllocateCommandBuffers(dc->devi, &commandBufferAllocateInfo, &sl->commandBuffer) != VK_SUCCESS ||
+			vkBeginCommandBuffer(sl->commandBuffer, &commandBufferBeginInfo) != VK_SUCCESS
+		)
+		{
+			failed = 1;
+			break;
+		}
+		xfer_acquire_barrier(dc, sl->commandBuffer, sl->buffers[0]->buf, 0, padsz);
+		vkCmdBindPipeline(sl->commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, k->pipeline);
+		if (k->numbindings)
+		{
+			VkDescriptorBufferInfo dbi[MAXARGS];
+			VkWriteDescriptorSet wds[MAXARGS];
+			if (bindsets)
+			{
+				const VkDescriptorSetAllocateInfo dsai =
+				{
+					VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO,
+					0,
+					descriptorPool,
+					1,
+					&k->dsl
+				};
+				if (vkAllocateDescriptorSets(dc->devi, &dsai, &sl->descriptorSet) != VK_SUCCESS)
+				{
+					vkEndCommandBuffer(sl->commandBuffer);
+					failed = 1;
+					break;
+				}
+			}
+			const uint32_t nw = tile_descriptor_writes(sl->descriptorSet, k, sl->buffers, &tile, padwords, dbi, wds);
+			if (bindsets)
+			{
+				vkUpdateDescriptorSets(dc->devi, nw, wds, 0, 0);
+				vkCmdBindDescriptorSets(sl->commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, k->layout, 0, 1, &sl->descriptorSet, 0, 0);
+			}
+			else
+				ctx->dc.pfnCmdPushDescriptorSetKHR(sl->commandBuffer, VK_PIPELINE_BIND_POINT_COMPUTE, k->layout, 0, nw, wds);
+		}
+		if (k->pcsz)
+		{
+			uint8_t pcs[GRAPH_MAXPC];
+			memset(pcs, 0, k->pcsz);
+			if (pcsz)
+				memcpy(pcs, pc, pcsz);
+			tile_pointers(k, sl->buffers, &tile, padwords, pcs);
+			vkCmdPushConstants(sl->commandBuffer, k->layout, VK_SHADER_STAGE_COMPUTE_BIT, 0, k->pcsz, pcs);
+		}
+		vkCmdDispatch(sl->commandBuffer, numgroups, 1, 1);
+		xfer_release_barrier(dc, sl->commandBuffer, sl->buffers[1]->buf, 0, padsz);
+		if (vkEndCommandBuffer(sl->commandBuffer) != VK_SUCCESS)
+		{
+			failed = 1;
+			break;
+		}
+		LABEL_OBJ(dc, sl->commandBuffer, VK_OBJECT_TYPE_COMMAND_BUFFER, tag);
+	}
+	if (failed)
+		fprintf(stderr, "Cannot make the slots of a stream of %s.\n", k->name);
+
+	const int64_t t0 = now_ns();
+	*hostns = 0;
+	for (int64_t c=0; c<numchunks+numslots && !failed; ++c)
+	{
+		slot_t* sl = slots + (c % numslots);
+
+		// Retire the chunk that last used this slot.
+		if (sl->chunk >= 0)
+		{
+			xfer_wait(&sl->download, chunksz);
+			xfer_wait(&sl->upload, padsz);
+			const size_t first = sl->chunk * chunkwords;
+			const int64_t h0 = now_ns();
+			consume(user, first, xfer_staging(&sl->download), numwords - first < chunkwords ? numwords - first : chunkwords);
+			*hostns += now_ns() - h0;
+			sl->chunk = -1;
+		}
+		if (c >= numchunks)
+			continue;	// Draining.
+
+		// Upload, compute, and read back chunk c, without waiting for any of it.
+		// The last chunk can be partial, and every chunk is padded to whole work groups: the kernel then runs
+		// over some zeros that nobody looks at.
+		const size_t first = c * chunkwords;
+		const size_t valid = numwords - first < chunkwords ? numwords - first : chunkwords;
+		uint32_t* data = xfer_staging(&sl->upload);
+		const int64_t h0 = now_ns();
+		produce(user, first, data, valid);
+		*hostns += now_ns() - h0;
+		memset(data + valid, 0, (padwords - valid) * sizeof(uint32_t));
+		if (xfer_upload(&sl->upload, sl->buffers[0]->buf, 0, padsz) < 0)
+		{
+			failed = 1;
+			break;
+		}
+		const VkPipelineStageFlags waitStage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+		const VkSubmitInfo submitInfo =
+		{
+			VK_STRUCTURE_TYPE_SUBMIT_INFO,
+			0,
+			1,
+			&sl->upload.sema,
+			&waitStage,
+			1,
+			&sl->commandBuffer,
+			1,
+			&sl->computeDone
+		};
+		if
+		(
+			queue_submit(&dc->queues, dc->queue, 1, &submitInfo, 0) != VK_SUCCESS ||
+			xfer_download(&sl->download, sl->buffers[1]->buf, 0, chunksz, sl->computeDone) < 0
+		)
+		{
+			failed = 1;
+			break;
+		}
+		sl->chunk = c;
+	}
+	const int64_t elapsed = now_ns() - t0;
+
+	// A chunk that broke off can still be computing, without a fence to wait for.
+	if (failed)
+		queue_wait_idle(&dc->queues, dc->queue);
+	for (uint32_t s=0; s<numslots; ++s)
+	{
+		slot_t* sl = slots + s;
+		if (sl->upload.dc)
+			xfer_destroy(&sl->upload);
+		if (sl->download.dc)
+			xfer_destroy(&sl->download);
+		if (sl->computeDone)
+			vkDestroySemaphore(dc->devi, sl->computeDone, 0);
+		if (sl->buffers[0])
+			mvk_buffer_destroy(sl->buffers[0]);
+		if (sl->buffers[1])
+			mvk_buffer_destroy(sl->buffers[1]);
+	}
+	if (commandPool)
+		vkDestroyCommandPool(dc->devi, commandPool, 0);
+	if (descriptorPool)
+		vkDestroyDescriptorPool(dc->devi, descriptorPool, 0);
+	return failed ? -1 : elapsed;
+}
+
+#pragma mark Tuning
+
+// Give the variants of a kernel back the work group sizes they had before a sweep.
+static void restore_sizes(devctx_t* dc, module_t* m, const kernel_t* base, const uint32_t* oldsz)
+{
+	for (uint32_t i=0; i<m->numkernels; ++i)
+	{
+		kernel_t* v = m->kernels + i;
+		if (v->base == base && kernel_specializable(m, v))
+			specialize_kernel(dc, m, v, oldsz[i]);
+	}
+}
+
+
+int mvk_tune
+(
+	mvk_module_t* mod,
+	const char* name,
+	size_t numwork,
+	mvk_buffer_t* const* buffers,
+	uint32_t numbuffers,
+	const void* pc,
+	uint32_t pcsz,
+	mvk_timing_t* timings,
+	uint32_t maxtimings
+)
+{
+	devctx_t* dc = &mod->ctx->dc;
+	module_t* m = &mod->m;
+	const VkPhysicalDeviceLimits* limits = &dc->dprops.limits;
+	kernel_t* base = find_kernel(m, name);
+	if (!base)
+	{
+		fprintf(stderr, "There is no kernel named %s.\n", name);
+		return -1;
+	}
+	if (base->base != base)
+	{
+		fprintf(stderr, "%s is a variant of %s, which gets tuned instead.\n", name, base->base->name);
+		base = m->kernels + (base->base - m->kernels);
+	}
+	const uint32_t maxsz = limits->maxComputeWorkGroupSize[0] < limits->maxComputeWorkGroupInvocations ?
+		limits->maxComputeWorkGroupSize[0] : limits->maxComputeWorkGroupInvocations;
+	const kernel_t* oldtuned = base->tuned;
+	uint32_t oldsz[MAXKERNELS];	// The sweep respecializes the variants, which get their own sizes back after.
+	for (uint32_t i=0; i<m->numkernels; ++i)
+		oldsz[i] = m->kernels[i].wgsz[0];
+	kernel_t* best = 0;
+	uint32_t bestsz = 0;
+	int64_t bestns = 0;
+	uint32_t numtimings = 0;
+	for (uint32_t i=0; i<m->numkernels; ++i)
+	{
+		kernel_t* v = m->kernels + i;
+		if (v->base != base)
+			continue;	// Not a variant of this kernel.
+		const int specializable = kernel_specializable(m, v);
+		for (uint32_t sz = specializable ? 32 : v->wgsz[0]; sz <= (specializable ? maxsz : v->wgsz[0]); sz *= 2)
+		{
+			if (specializable)
+				specialize_kernel(dc, m, v, sz);
+			const size_t pergroup = (size_t)sz * v->ipt;
+			if (numwork % pergroup || numwork / pergroup > limits->maxComputeWorkGroupCount[0])
+				continue;
+			// A submit of the kernel runs its tuned variant, when that fits, so make that this one.
+			base->tuned = v;
+			int64_t ns = -1;
+			for (uint32_t r=0; r<TUNE_REPS; ++r)
+			{
+				mvk_job_t* job = mvk_submit(mod->ctx, (const mvk_kernel_t*) base, numwork, buffers, numbuffers, pc, pcsz, 0, 0);
+				if (!job)
+				{
+					restore_sizes(dc, m, base, oldsz);
+					base->tuned = oldtuned;
+					return -1;
+				}
+				const int64_t t = mvk_job_wait(job);
+				mvk_job_release(job);
+				if (ns < 0 || t < ns)
+					ns = t;
+			}
+			if (numtimings < maxtimings)
+			{
+				snprintf(timings[numtimings].variant, sizeof(timings[numtimings].variant), "%s", v->name);
+				timings[numtimings].wgsz = sz;
+				timings[numtimings].ns = ns;
+				numtimings++;
+			}
+			if (!best || ns < bestns)
+			{
+				best = v;
+				bestsz = sz;
+				bestns = ns;
+			}
+			if (!specializable)
+				break;
+		}
+	}
+	restore_sizes(dc, m, base, oldsz);
+	if (!best)
+	{
+		fprintf(stderr, "No variant of %s fits a job over %zu words in one dispatch.\n", base->name, numwork);
+		base->tuned = oldtuned;
+		return -1;
+	}
+	if (kernel_specializable(m, best))
+		specialize_kernel(dc, m, best, bestsz);
+	base->tuned = best;
+	save_tuning(dc, m);
+	return (int) numtimings;
+}
+
+#pragma mark Primitives
+
+struct mvk_prims
+{
+	mvk_context_t* ctx;
+	mvk_module_t* mod;
+	const kernel_t* reduce;		// reduce_add, or reduce_add_sg where the device has subgroup arithmetic.
+	const kernel_t* scanreduce;
+	const kernel_t* scansums;
+	const kernel_t* scanblock;
+	const kernel_t* compactcount;
+	const kernel_t* compactblock;
+	const kernel_t* sortcount;
+	const kernel_t* sortoffsets;
+	const kernel_t* sortscatter;
+	const kernel_t* sortscatterkv;
+	uint32_t maxgroups;		// Groups per pass, as many as scan_sums can combine.
+	mvk_buffer_t* sums;		// Scratch for the sums of the groups, and their total.
+	mvk_buffer_t* total;		// Scratch for the total of a reduce, which can not go to sums while it reads them.
+	mvk_buffer_t* hist;		// Scratch for the digit counts of the groups, of a radix sort.
+	mvk_buffer_t* sortkeys;		// Scratch for the keys and values between the passes of a radix sort, kept for the next sort.
+	mvk_buffer_t* sortvals;
+};
+
+// Bits of a radix sort digit, as in prims.cl.
+#define RADIX_BITS	4
+#define RADIX		(1 << RADIX_BITS)
+
+
+// Put the value of a POD arg of a kernel at its place in the push constants. Returns -1 if it has no such uint arg.
+static int set_pod(const kernel_t* k, uint8_t* pc, uint32_t ordinal, uint32_t value)
+{
+	for (uint32_t i=0; i<k->numargs; ++i)
+	{
+		const karg_t* a = k->args + i;
+		if (a->ordinal == ordinal && a->binding < 0 && !a->ptr && a->size == sizeof(value) && a->offset + a->size <= GRAPH_MAXPC)
+		{
+			memcpy(pc + a->offset, &value, sizeof(value));
+			return 0;
+		}
+	}
+	fprintf(stderr, "Kernel %s has no uint arg %u in its push constants.\n", k->name, ordinal);
+	return -1;
+}
+
+
+// Add a dispatch of numgroups whole groups to a graph, with the POD args in pods, in the order of the args.
+// The last numwritten buffers are the ones that get written. Returns -1 if the kernel does not take these args.
+static int prims_dispatch(mvk_graph_t* graph, const kernel_t* k, uint32_t numgroups, mvk_buffer_t** buffers, uint32_t numbuffers, uint32_t numwritten, const uint32_t* pods, uint32_t numpods)
+{
+	uint8_t pc[GRAPH_MAXPC];
+	memset(pc, 0, sizeof(pc));
+	for (uint32_t i=0; i<numpods; ++i)
+		if (set_pod(k, pc, i, pods[i]) < 0)
+			return -1;
+	const uint32_t writes = ((1U << numbuffers) - 1) & ~((1U << (numbuffers - numwritten)) - 1);
+	return mvk_graph_dispatch(graph, (const mvk_kernel_t*) k, (size_t)numgroups * k->wgsz[0], buffers, numbuffers, writes, pc, k->pcsz) < 0 ? -1 : 0;
+}
+
+
+// Run a graph, and wait for it. Returns -1 if it can not be submitted.
+static int prims_run(mvk_graph_t* graph)
+{
+	mvk_job_t* job = mvk_graph_submit(graph, 0, 0);
+	if (!job)
+		return -1;
+	mvk_job_wait(job);
+	mvk_job_release(job);
+	return 0;
+}
+
+
+// Whether the first n words of a buffer can go through the primitives.
+static int prims_fits(const mvk_buffer_t* buf, size_t n)
+{
+	if (n <= UINT32_MAX && n * sizeof(uint32_t) <= buf->size)
+		return 1;
+	fprintf(stderr, "A buffer of %zu bytes can not hold the %zu words of a primitive.\n", buf->size, n);
+	return 0;
+}
+
+
+// Number of groups for a pass over n words, and the block of words that each one gets.
+static uint32_t prims_groups(const mvk_prims_t* p, size_t n, uint32_t* blocksz)
+{
+	const uint32_t wgsz = p->scanblock->wgsz[0];
+	uint32_t numgroups = (uint32_t) ((n + wgsz - 1) / wgsz);
+	if (numgroups > p->maxgroups)
+		numgroups = p->maxgroups;
+	if (!numgroups)
+		numgroups = 1;
+	// Blocks of whole groups, except for the last.
+	*blocksz = (uint32_t) ((n + numgroups - 1) / numgroups + wgsz - 1) / wgsz * wgsz;
+	return numgroups;
+}
+
+
+mvk_prims_t* mvk_prims_create(mvk_context_t* ctx, const char* fname)
+{
+	mvk_prims_t* p = calloc(1, sizeof(mvk_prims_t));
+	if (!p)
+		return 0;
+	p->ctx = ctx;
+	p->mod = mvk_module_load(ctx, fname);
+	if (!p->mod)
+	{
+		free(p);
+		return 0;
+	}
+	module_t* m = &p->mod->m;
+	p->scanreduce    = find_kernel(m, "scan_reduce");
+	p->scansums      = find_kernel(m, "scan_sums");
+	p->scanblock     = find_kernel(m, "scan_block");
+	p->compactcount  = find_kernel(m, "compact_count");
+	p->compactblock  = find_kernel(m, "compact_block");
+	p->reduce        = find_kernel(m, "reduce_add");
+	p->sortcount     = find_kernel(m, "sort_count");
+	p->sortoffsets   = find_kernel(m, "sort_offsets");
+	p->sortscatter   = find_kernel(m, "sort_scatter");
+	p->sortscatterkv = find_kernel(m, "sort_scatter_kv");
+	if
+	(
+		!p->scanreduce || !p->scansums || !p->scanblock || !p->compactcount || !p->compactblock || !p->reduce ||
+		!p->sortcount || !p->sortoffsets || !p->sortscatter || !p->sortscatterkv
+	)
+	{
+		fprintf(stderr, "%s does not have the kernels of prims.cl.\n", fname);
+		mvk_module_unload(p->mod);
+		free(p);
+		return 0;
+	}
+
+	// The subgroup reduce is only there if clspv had cl_khr_subgroups, and only runs on devices with subgroup arithmetic.
+	const kernel_t* sg = find_kernel(m, "reduce_add_sg");
+	VkPhysicalDeviceSubgroupProperties sgprops;
+	memset(&sgprops, 0, sizeof(sgprops));
+	sgprops.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_SUBGROUP_PROPERTIES;
+	VkPhysicalDeviceProperties2 props2;
+	props2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_PROPERTIES_2;
+	props2.pNext = &sgprops;
+	vkGetPhysicalDeviceProperties2(ctx->dc.pdev, &props2);
+	if (sg && (sgprops.supportedStages & VK_SHADER_STAGE_COMPUTE_BIT) && (sgprops.supportedOperations & VK_SUBGROUP_FEATURE_ARITHMETIC_BIT))
+		p->reduce = sg;
+
+	p->maxgroups = p->scansums->wgsz[0];
+	if (p->maxgroups > ctx->dc.dprops.limits.maxComputeWorkGroupCount[0])
+		p->maxgroups = ctx->dc.dprops.limits.maxComputeWorkGroupCount[0];
+	p->sums = mvk_buffer_create(ctx, (p->maxgroups + 1) * sizeof(uint32_t));
+	p->total = mvk_buffer_create(ctx, sizeof(uint32_t));
+	p->hist = mvk_buffer_create(ctx, RADIX * p->maxgroups * sizeof(uint32_t));
+	if (!p->sums || !p->total || !p->hist)
+	{
+		fprintf(stderr, "Cannot create the scratch buffers of prims.\n");
+		mvk_prims_destroy(p);
+		return 0;
+	}
+	return p;
+}
+
+
+void mvk_prims_destroy(mvk_prims_t* p)
+{
+	if (p->sortkeys)
+		mvk_buffer_destroy(p->sortkeys);
+	if (p->sortvals)
+		mvk_buffer_destroy(p->sortvals);
+	if (p->hist)
+		mvk_buffer_destroy(p->hist);
+	if (p->total)
+		mvk_buffer_destroy(p->total);
+	if (p->sums)
+		mvk_buffer_destroy(p->sums);
+	mvk_module_unload(p->mod);
+	free(p);
+}
+
+
+int64_t mvk_reduce_add(mvk_prims_t* p, mvk_buffer_t* src, size_t n)
+{
+	if (!prims_fits(src, n))
+		return -1;
+	const uint32_t wgsz = p->reduce->wgsz[0];
+	uint32_t numgroups = (uint32_t) ((n + wgsz - 1) / wgsz);
+	if (numgroups > p->maxgroups)
+		numgroups = p->maxgroups;
+	if (!numgroups)
+		numgroups = 1;
+	// Partial sums of the groups first, and then the sum of those, by a single group.
+	mvk_graph_t graph;
+	graph_init(&graph, p->ctx);
+	mvk_buffer_t* pass1[2] = { src, p->sums };
+	mvk_buffer_t* pass2[2] = { p->sums, p->total };
+	const uint32_t pods1[1] = { (uint32_t) n };
+	const uint32_t pods2[1] = { numgroups };
+	if (prims_dispatch(&graph, p->reduce, numgroups, pass1, 2, 1, pods1, 1) < 0 || prims_dispatch(&graph, p->reduce, 1, pass2, 2, 1, pods2, 1) < 0)
+		return -1;
+	if (prims_run(&graph) < 0)
+		return -1;
+	uint32_t sum;
+	if (mvk_buffer_read(p->total, 0, &sum, sizeof(sum)) < 0)
+		return -1;
+	return sum;
+}
+
+
+int mvk_scan_add(mvk_prims_t* p, mvk_buffer_t* src, mvk_buffer_t* dst, size_t n, int inclusive)
+{
+	if (!prims_fits(src, n) || !prims_fits(dst, n))
+		return -1;
+	uint32_t blocksz;
+	const uint32_t numgroups = prims_groups(p, n, &blocksz);
+	mvk_graph_t graph;
+	graph_init(&graph, p->ctx);
+	mvk_buffer_t* pass1[2] = { src, p->sums };
+	mvk_buffer_t* pass2[1] = { p->sums };
+	mvk_buffer_t* pass3[3] = { src, p->sums, dst };
+	const uint32_t pods1[2] = { (uint32_t) n, blocksz };
+	const uint32_t pods2[1] = { numgroups };
+	const uint32_t pods3[3] = { (uint32_t) n, blocksz, inclusive ? 1 : 0 };
+	if
+	(
+		prims_dispatch(&graph, p->scanreduce, numgroups, pass1, 2, 1, pods1, 2) < 0 ||
+		prims_dispatch(&graph, p->scansums, 1, pass2, 1, 1, pods2, 1) < 0 ||
+		prims_dispatch(&graph, p->scanblock, numgroups, pass3, 3, 1, pods3, 3) < 0
+	)
+		return -1;
+	return prims_run(&graph);
+}
+
+
+int64_t mvk_compact(mvk_prims_t* p, mvk_buffer_t* src, mvk_buffer_t* dst, size_t n, uint32_t msk, uint32_t cmp)
+{
+	if (!prims_fits(src, n) || !prims_fits(dst, n))
+		return -1;
+	uint32_t blocksz;
+	const uint32_t numgroups = prims_groups(p, n, &blocksz);
+	mvk_graph_t graph;
+	graph_init(&graph, p->ctx);
+	mvk_buffer_t* pass1[2] = { src, p->sums };
+	mvk_buffer_t* pass2[1] = { p->sums };
+	mvk_buffer_t* pass3[3] = { src, p->sums, dst };
+	const uint32_t pods1[4] = { (uint32_t) n, blocksz, msk, cmp };
+	const uint32_t pods2[1] = { numgroups };
+	if
+	(
+		prims_dispatch(&graph, p->compactcount, numgroups, pass1, 2, 1, pods1, 4) < 0 ||
+		prims_dispatch(&graph, p->scansums, 1, pass2, 1, 1, pods2, 1) < 0 ||
+		prims_dispatch(&graph, p->compactblock, numgroups, pass3, 3, 1, pods1, 4) < 0
+	)
+		return -1;
+	if (prims_run(&graph) < 0)
+		return -1;
+	// The total of the counts is right after them.
+	uint32_t count;
+	if (mvk_buffer_read(p->sums, numgroups * sizeof(uint32_t), &count, sizeof(count)) < 0)
+		return -1;
+	return count;
+}
+
+
+// A scratch buffer of at least size bytes. It only gets replaced when it is too small. Returns 0 if there is no
+// memory for it.
+static mvk_buffer_t* prims_scratch(mvk_prims_t* p, mvk_buffer_t** buf, size_t size)
+{
+	if (*buf && (*buf)->size < size)
+	{
+		mvk_buffer_destroy(*buf);
+		*buf = 0;
+	}
+	if (!*buf)
+		*buf = mvk_buffer_create(p->ctx, size);
+	return *buf;
+}
+
+
+int mvk_sort(mvk_prims_t* p, mvk_buffer_t* keys, mvk_buffer_t* vals, size_t n)
+{
+	if (!prims_fits(keys, n) || (vals && !prims_fits(vals, n)))
+		return -1;
+	if (n < 2)
+		return 0;
+	uint32_t blocksz;
+	const uint32_t numgroups = prims_groups(p, n, &blocksz);
+	mvk_buffer_t* tmpkeys = prims_scratch(p, &p->sortkeys, n * sizeof(uint32_t));
+	mvk_buffer_t* tmpvals = vals ? prims_scratch(p, &p->sortvals, n * sizeof(uint32_t)) : 0;
+	if (!tmpkeys || (vals && !tmpvals))
+		return -1;
+
+	// Every digit is a count, a scan of the counts and a scatter, from one buffer to the other and back.
+	// An even number of digits brings the keys back where they started.
+	mvk_graph_t graph;
+	graph_init(&graph, p->ctx);
+	assert(3 * (32 / RADIX_BITS) <= GRAPH_MAXNODES);
+	for (uint32_t shift=0; shift<32; shift+=RADIX_BITS)
+	{
+		const int odd = (shift / RADIX_BITS) & 1;
+		mvk_buffer_t* srckeys = odd ? tmpkeys : keys;
+		mvk_buffer_t* dstkeys = odd ? keys : tmpkeys;
+		mvk_buffer_t* srcvals = odd ? tmpvals : vals;
+		mvk_buffer_t* dstvals = odd ? vals : tmpvals;
+		const uint32_t pods[3] = { (uint32_t) n, blocksz, shift };
+		const uint32_t offspods[1] = { numgroups };
+		mvk_buffer_t* count[2] = { srckeys, p->hist };
+		mvk_buffer_t* offs[1] = { p->hist };
+		mvk_buffer_t* scatter[3] = { srckeys, p->hist, dstkeys };
+		mvk_buffer_t* scatterkv[5] = { srckeys, srcvals, p->hist, dstkeys, dstvals };
+		if (prims_dispatch(&graph, p->sortcount, numgroups, count, 2, 1, pods, 3) < 0)
+			return -1;
+		if (prims_dispatch(&graph, p->sortoffsets, 1, offs, 1, 1, offspods, 1) < 0)
+			return -1;
+		if (vals && prims_dispatch(&graph, p->sortscatterkv, numgroups, scatterkv, 5, 2, pods, 3) < 0)
+			return -1;
+		if (!vals && prims_dispatch(&graph, p->sortscatter, numgroups, scatter, 3, 1, pods, 3) < 0)
+			return -1;
+	}
+	return prims_run(&graph);
+}
+
+#pragma mark Batcher
+
+#define BATCH_MAXSLOTS	4	// Max number of batches that are filled or in flight at once.
+
+typedef enum
+{
+	SLOT_FREE,
+	SLOT_OPEN,		// Taking jobs.
+	SLOT_SEALED,		// Full, and waiting to be submitted.
+	SLOT_RUNNING,		// Submitted.
+	SLOT_DONE,		// Done on the device, and waiting for its jobs to be finished.
+} slotstate_t;
+
+// A job of a batch, as the host knows it.
+typedef struct
+{
+	uint32_t* dst;
+	uint32_t first;			// Its first word in the arenas.
+	uint32_t numwords;
+	mvk_batch_callback_t callback;
+	void* user;
+} batchjob_t;
+
+// A batch of jobs, in arenas of its own, so that it can be filled while others run.
+typedef struct
+{
+	mvk_batcher_t* batcher;
+	slotstate_t state;
+	mvk_buffer_t* table;		// The job of every group, and from maxgroups on, a record of 4 words per job.
+	mvk_buffer_t* src;
+	mvk_buffer_t* dst;
+	batchjob_t* jobs;
+	uint32_t numjobs;
+	uint32_t numgroups;		// Groups taken by its jobs so far.
+	int64_t deadline;		// When the first job wants to be submitted, at the latest.
+	mvk_job_t* job;
+} batchslot_t;
+
+struct mvk_batcher
+{
+	mvk_context_t* ctx;
+	const kernel_t* kernel;
+	uint32_t wgsz;			// Words per group. Every job starts on a group of its own.
+	uint32_t maxjobs;
+	uint32_t maxgroups;
+	int64_t maxlatency;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work;		// For the thread, when there is a batch to submit or finish.
+	pthread_cond_t room;		// For those that add jobs, or flush, when a batch got finished.
+	int open;			// The slot that takes jobs, or -1.
+	int flush;			// Submit the open batch without waiting for its deadline.
+	int quit;
+	uint64_t numjobs;
+	uint64_t numbatches;
+	batchslot_t slots[BATCH_MAXSLOTS];
+};
+
+
+// A buffer of the batcher, in host-visible memory, that stays mapped. Returns 0 if there is no such memory for it.
+static mvk_buffer_t* batcher_buffer(mvk_context_t* ctx, memrole_t role, size_t size, const char* tag)
+{
+	devctx_t* dc = &ctx->dc;
+	mvk_buffer_t* buf = calloc(1, sizeof(mvk_buffer_t));
+	if (!buf)
+		return 0;
+	buf->ctx = ctx;
+	buf->size = size;
+	if (mk_buffer(dc, MVK_BUFFER_USAGE, role, size, &buf->buf, &buf->mem, tag) < 0)
+	{
+		free(buf);
+		return 0;
+	}
+	// Vulkan promises a host-visible memory type for every buffer, so only a full heap gets here.
+	if (!buf->mem.mapped)
+	{
+		fprintf(stderr, "Batch buffer %s is not host-visible.\n", tag);
+		mvk_buffer_destroy(buf);
+		return 0;
+	}
+	buf->addr = buffer_address(dc, buf->buf);
+	return buf;
+}
+
+
+// Called on a thread of the context's pool when a batch is done. The thread of the batcher takes it from there.
+static void batcher_done(mvk_job_t* job, void* user)
+{
+	(void) job;
+	batchslot_t* s = user;
+	mvk_batcher_t* b = s->batcher;
+	pthread_mutex_lock(&b->lock);
+	s->state = SLOT_DONE;
+	pthread_cond_signal(&b->work);
+	pthread_mutex_unlock(&b->lock);
+}
+
+
+// Make the results of a batch visible to the host, hand them to its jobs, and tell each of them.
+static void batcher_finish(mvk_batcher_t* b, batchslot_t* s)
+{
+	// A batch that could not be submitted has no job, and leaves the destinations of its jobs alone.
+	const mvk_job_t* job = s->job;
+	if (job)
+	{
+		mvk_job_wait(s->job);
+		mvk_job_release(s->job);
+		s->job = 0;
+		arena_invalidate(&b->ctx->dc, &s->dst->mem, 0, (VkDeviceSize)s->numgroups * b->wgsz * sizeof(uint32_t));
+	}
+	const uint32_t* dst = s->dst->mem.mapped;
+	for (uint32_t i=0; i<s->numjobs; ++i)
+	{
+		const batchjob_t* j = s->jobs + i;
+		if (job)
+			memcpy(j->dst, dst + j->first, j->numwords * sizeof(uint32_t));
+		if (j->callback)
+			j->callback(j->user);
+	}
+}
+
+
+// Record and submit a batch as one dispatch, over all the groups of its jobs.
+// Returns -1 if the batch can not be run.
+static int batcher_submit(mvk_batcher_t* b, batchslot_t* s)
+{
+	devctx_t* dc = &b->ctx->dc;
+	const kernel_t* k = b->kernel;
+	arena_flush(dc, &s->table->mem, 0, (VkDeviceSize)s->numgroups * sizeof(uint32_t));
+	arena_flush(dc, &s->table->mem, (VkDeviceSize)b->maxgroups * sizeof(uint32_t), 4 * s->numjobs * sizeof(uint32_t));
+	arena_flush(dc, &s->src->mem, 0, (VkDeviceSize)s->numgroups * b->wgsz * sizeof(uint32_t));
+	uint8_t pc[GRAPH_MAXPC];
+	memset(pc, 0, sizeof(pc));
+	if (set_pod(k, pc, 0, b->maxgroups) < 0)
+		return -1;
+	mvk_buffer_t* buffers[3] = { s->table, s->src, s->dst };
+	s->job = mvk_submit(b->ctx, (const mvk_kernel_t*) k, (size_t)s->numgroups * b->wgsz, buffers, 3, pc, k->pcsz, batcher_done, s);
+	return s->job ? 0 : -1;
+}
+
+
+static void* batcher_worker(void* arg)
+{
+	mvk_batcher_t* b = arg;
+	pthread_mutex_lock(&b->lock);
+	while (1)
+	{
+		int busy = 0;
+		for (int i=0; i<BATCH_MAXSLOTS; ++i)
+		{
+			batchslot_t* s = b->slots + i;
+			// The open batch goes when it is due, or asked for. Its jobs are in, as they get added under the lock.
+			if (i == b->open && s->numjobs && (b->flush || b->quit || now_ns() >= s->deadline))
+			{
+				s->state = SLOT_SEALED;
+				b->open = -1;
+			}
+			if (s->state == SLOT_SEALED)
+			{
+				s->state = SLOT_RUNNING;
+				b->numbatches++;
+				pthread_mutex_unlock(&b->lock);
+				const int res_bs = batcher_submit(b, s);
+				if (res_bs < 0)
+					fprintf(stderr, "Failed to submit a batch of %u jobs.\n", s->numjobs);
+				pthread_mutex_lock(&b->lock);
+				if (res_bs < 0)
+					s->state = SLOT_DONE;
+			}
+			if (s->state == SLOT_DONE)
+			{
+				pthread_mutex_unlock(&b->lock);
+				batcher_finish(b, s);
+				pthread_mutex_lock(&b->lock);
+				s->state = SLOT_FREE;
+				pthread_cond_broadcast(&b->room);
+			}
+			busy |= s->state != SLOT_FREE && !(i == b->open && !s->numjobs);
+		}
+		if (b->open < 0 || !b->slots[b->open].numjobs)
+			b->flush = 0;
+		if (b->quit && !busy)
+			break;
+		// Sleep until there is work, or until the open batch is due.
+		if (b->open >= 0 && b->slots[b->open].numjobs && !b->flush)
+		{
+			const int64_t wait = b->slots[b->open].deadline - now_ns();
+			if (wait > 0)
+			{
+				// Condition variables wait on the realtime clock, by default.
+				struct timespec ts;
+				clock_gettime(CLOCK_REALTIME, &ts);
+				const int64_t until = ts.tv_sec * 1000000000LL + ts.tv_nsec + wait;
+				ts.tv_sec = until / 1000000000LL;
+				ts.tv_nsec = until % 1000000000LL;
+				pthread_cond_timedwait(&b->work, &b->lock, &ts);
+			}
+		}
+		else if (!b->flush)
+		{
+			int pending = 0;
+			for (int i=0; i<BATCH_MAXSLOTS; ++i)
+				pending |= b->slots[i].state == SLOT_SEALED || b->slots[i].state == SLOT_DONE;
+			if (!pending)
+				pthread_cond_wait(&b->work, &b->lock);
+		}
+	}
+	pthread_mutex_unlock(&b->lock);
+	return 0;
+}
+
+
+// Frees the buffers of the slots, those of them that got made.
+static void batcher_free_slots(mvk_batcher_t* b)
+{
+	for (int i=0; i<BATCH_MAXSLOTS; ++i)
+	{
+		batchslot_t* s = b->slots + i;
+		if (s->table)
+			mvk_buffer_destroy(s->table);
+		if (s->src)
+			mvk_buffer_destroy(s->src);
+		if (s->dst)
+			mvk_buffer_destroy(s->dst);
+		free(s->jobs);
+	}
+}
+
+
+mvk_batcher_t* mvk_batcher_create(mvk_context_t* ctx, const mvk_kernel_t* kernel, size_t arenasz, uint32_t maxbatch, int64_t maxlatency)
+{
+	devctx_t* dc = &ctx->dc;
+	const kernel_t* k = (const kernel_t*) kernel;
+	if (k->numargs != 4 || k->numbindings != 3)
+	{
+		fprintf(stderr, "Kernel %s does not take a batch: a POD, a table, a source and a destination.\n", k->name);
+		return 0;
+	}
+	uint8_t pc[GRAPH_MAXPC];
+	if (set_pod(k, pc, 0, 0) < 0)
+		return 0;
+	// All groups go in one dispatch, that must not get split into tiles, as the table is indexed by group.
+	const VkDeviceSize maxwords = dc->dprops.limits.maxStorageBufferRange / sizeof(uint32_t);
+	VkDeviceSize maxgroups = (arenasz / sizeof(uint32_t) < maxwords ? arenasz / sizeof(uint32_t) : maxwords) / k->wgsz[0];
+	if (maxgroups > dc->dprops.limits.maxComputeWorkGroupCount[0])
+		maxgroups = dc->dprops.limits.maxComputeWorkGroupCount[0];
+	if (!maxgroups)
+	{
+		fprintf(stderr, "Arenas of %zu bytes do not hold a work group of %s.\n", arenasz, k->name);
+		return 0;
+	}
+	mvk_batcher_t* b = calloc(1, sizeof(mvk_batcher_t));
+	if (!b)
+		return 0;
+	b->ctx = ctx;
+	b->kernel = k;
+	b->wgsz = k->wgsz[0];
+	b->maxjobs = maxbatch ? maxbatch : 1;
+	b->maxlatency = maxlatency;
+	b->open = -1;
+	b->maxgroups = (uint32_t) maxgroups;
+	const size_t bufsz = (size_t)b->maxgroups * b->wgsz * sizeof(uint32_t);
+	for (int i=0; i<BATCH_MAXSLOTS; ++i)
+	{
+		batchslot_t* s = b->slots + i;
+		s->batcher = b;
+		s->table = batcher_buffer(ctx, MEM_STREAM, (b->maxgroups + 4 * (size_t)b->maxjobs) * sizeof(uint32_t), "batch table");
+		s->src = batcher_buffer(ctx, MEM_STREAM, bufsz, "batch src");
+		s->dst = batcher_buffer(ctx, MEM_READBACK, bufsz, "batch dst");
+		s->jobs = calloc(b->maxjobs, sizeof(batchjob_t));
+		if (!s->table || !s->src || !s->dst || !s->jobs)
+		{
+			fprintf(stderr, "Cannot create the buffers of a batcher.\n");
+			batcher_free_slots(b);
+			free(b);
+			return 0;
+		}
+	}
+	pthread_mutex_init(&b->lock, 0);
+	pthread_cond_init(&b->work, 0);
+	pthread_cond_init(&b->room, 0);
+	const int res_pc = pthread_create(&b->thread, 0, batcher_worker, b);
+	assert(res_pc == 0);
+	return b;
+}
+
+
+void mvk_batcher_destroy(mvk_batcher_t* b)
+{
+	pthread_mutex_lock(&b->lock);
+	b->quit = 1;
+	pthread_cond_signal(&b->work);
+	pthread_mutex_unlock(&b->lock);
+	pthread_join(b->thread, 0);
+	batcher_free_slots(b);
+	pthread_mutex_destroy(&b->lock);
+	pthread_cond_destroy(&b->work);
+	pthread_cond_destroy(&b->room);
+	free(b);
+}
+
+
+int mvk_batcher_add(mvk_batcher_t* b, const uint32_t* src, uint32_t* dst, size_t numwords, uint32_t param, mvk_batch_callback_t callback, void* user)
+{
+	const uint32_t numgroups = (uint32_t) ((numwords + b->wgsz - 1) / b->wgsz);
+	if (!numwords || numwords > (size_t)b->maxgroups * b->wgsz)
+		return -1;
+	pthread_mutex_lock(&b->lock);
+	// Take the open batch if the job fits, or else seal it, and open a free one.
+	batchslot_t* s = 0;
+	while (!s)
+	{
+		if (b->open >= 0)
+		{
+			batchslot_t* o = b->slots + b->open;
+			if (o->numjobs < b->maxjobs && o->numgroups + numgroups <= b->maxgroups)
+				s = o;
+			else
+			{
+				o->state = SLOT_SEALED;
+				b->open = -1;
+				pthread_cond_signal(&b->work);
+			}
+		}
+		for (int i=0; i<BATCH_MAXSLOTS && b->open < 0; ++i)
+			if (b->slots[i].state == SLOT_FREE)
+			{
+				b->open = i;
+				b->slots[i].state = SLOT_OPEN;
+				b->slots[i].numjobs = 0;
+				b->slots[i].numgroups = 0;
+			}
+		if (!s && b->open < 0)
+			pthread_cond_wait(&b->room, &b->lock);
+	}
+
+	// The job starts on a group of its own, and the table tells every group which job it is in.
+	const uint32_t first = s->numgroups * b->wgsz;
+	uint32_t* table = s->table->mem.mapped;
+	for (uint32_t g=0; g<numgroups; ++g)
+		table[s->numgroups + g] = s->numjobs;
+	uint32_t* rec = table + b->maxgroups + 4 * s->numjobs;
+	rec[0] = first;
+	rec[1] = (uint32_t) numwords;
+	rec[2] = param;
+	rec[3] = 0;
+	memcpy((uint32_t*) s->src->mem.mapped + first, src, numwords * sizeof(uint32_t));
+	batchjob_t* j = s->jobs + s->numjobs;
+	j->dst = dst;
+	j->first = first;
+	j->numwords = (uint32_t) numwords;
+	j->callback = callback;
+	j->user = user;
+	if (!s->numjobs)
+		s->deadline = now_ns() + b->maxlatency;
+	s->numjobs++;
+	s->numgroups += numgroups;
+	b->numjobs++;
+	// A full batch goes right away.
+	if (s->numjobs == 1 || s->numjobs == b->maxjobs || s->numgroups == b->maxgroups)
+	{
+		if (s->numjobs == b->maxjobs || s->numgroups == b->maxgroups)
+		{
+			s->state = SLOT_SEALED;
+			b->open = -1;
+		}
+		pthread_cond_signal(&b->work);
+	}
+	pthread_mutex_unlock(&b->lock);
+	return 0;
+}
+
+
+void mvk_batcher_flush(mvk_batcher_t* b)
+{
+	pthread_mutex_lock(&b->lock);
+	b->flush = 1;
+	pthread_cond_signal(&b->work);
+	while (1)
+	{
+		int busy = 0;
+		for (int i=0; i<BATCH_MAXSLOTS; ++i)
+			busy |= b->slots[i].state != SLOT_FREE && !(i == b->open && !b->slots[i].numjobs);
+		if (!busy)
+			break;
+		pthread_cond_wait(&b->room, &b->lock);
+	}
+	pthread_mutex_unlock(&b->lock);
+}
+
+
+void mvk_batcher_stats(mvk_batcher_t* b, uint64_t* numjobs, uint64_t* numbatches)
+{
+	pthread_mutex_lock(&b->lock);
+	*numjobs = b->numjobs;
+	*numbatches = b->numbatches;
+	pthread_mutex_unlock(&b->lock);
+}
+
+#pragma mark Daemon
+
+#define DAEMON_MAXBUFFERS	64	// Max number of buffers that a client can have mapped at once.
+
+typedef enum
+{
+	MSG_MAP,		// Map the memfd that comes along, of size bytes, as a buffer. Replies with its id.
+	MSG_UNMAP,		// Destroy buffer id. Replies with 0.
+	MSG_RUN,		// Run a kernel on buffers, like mvk_submit(). Replies with the time it took on the GPU, in ns.
+} msgtype_t;
+
+// A request from a client, that goes over the socket as one packet. Replies are an int64_t each, -1 on failure.
+typedef struct
+{
+	uint32_t type;
+	uint32_t id;
+	uint64_t size;
+	char kernel[MAXNAMELEN];
+	uint64_t numwork;
+	uint32_t numbuffers;
+	uint32_t buffers[MAXARGS];
+	uint32_t pcsz;
+	uint8_t pc[GRAPH_MAXPC];
+} request_t;
+
+// A client of the daemon, served by a thread of its own, with the buffers it mapped.
+typedef struct conn
+{
+	mvk_context_t* ctx;
+	const mvk_module_t* mod;
+	int fd;
+	pthread_t thread;
+	int done;			// Set by the thread when the client went away. Guarded by the lock of the daemon.
+	pthread_mutex_t* lock;
+	uint64_t numrequests;
+	mvk_buffer_t* buffers[DAEMON_MAXBUFFERS];
+	struct conn* next;
+} conn_t;
+
+static volatile sig_atomic_t serve_stop;
+
+static void serve_signal(int sig)
+{
+	(void) sig;
+	serve_stop = 1;
+}
+
+
+// Remove a socket that was left at path. Anything else there is not ours to remove.
+static void unlink_socket(const char* path)
+{
+	struct stat st;
+	if (!lstat(path, &st) && S_ISSOCK(st.st_mode))
+		unlink(path);
+}
+
+
+// Map the memfd of a client, and import it. The device works on the shared pages in place, where it can import them.
+static int64_t serve_map(conn_t* c, const request_t* r, int fd)
+{
+	struct stat st;
+	int id = -1;
+	for (int i=0; i<DAEMON_MAXBUFFERS && id<0; ++i)
+		if (!c->buffers[i])
+			id = i;
+	if (fd < 0 || id < 0 || !r->size || fstat(fd, &st) || (uint64_t)st.st_size < r->size)
+		return -1;
+	void* ptr = mmap(0, r->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+		return -1;
+	mvk_buffer_t* buf = mvk_buffer_import(c->ctx, ptr, r->size);
+	if (!buf)
+	{
+		munmap(ptr, r->size);
+		return -1;
+	}
+	buf->mapping = ptr;
+	buf->mappingsz = r->size;
+	c->buffers[id] = buf;
+	return id;
+}
+
+
+// Where the kernels of foo.cl keep the number of words that they touch, in their push constants, or -1 for other
+// kernels. The work items past numwork of a last, partial work group only stay in the buffers by that.
+static int serve_wordcount(const char* name)
+{
+	if (!strcmp(name, "foo") || !strncmp(name, "foo_ipt", 7) || !strncmp(name, "foo_vec4", 8))
+		return 4;
+	return -1;
+}
+
+
+static int64_t serve_run(conn_t* c, const request_t* r)
+{
+	char name[MAXNAMELEN];
+	memcpy(name, r->kernel, MAXNAMELEN);
+	name[MAXNAMELEN-1] = 0;
+	const kernel_t* k = (const kernel_t*) mvk_kernel(c->mod, name);
+	if (!k || r->numbuffers > MAXARGS || r->pcsz > GRAPH_MAXPC)
+		return -1;
+	// The client is not to be trusted with the signature of the kernel.
+	if (r->numbuffers != k->numbindings + k->numpointers || !(r->pcsz == k->pcsz || (k->numpointers && r->pcsz <= k->pcsz)))
+		return -1;
+	mvk_buffer_t* buffers[MAXARGS];
+	for (uint32_t i=0; i<r->numbuffers; ++i)
+	{
+		if (r->buffers[i] >= DAEMON_MAXBUFFERS || !c->buffers[r->buffers[i]])
+			return -1;
+		buffers[i] = c->buffers[r->buffers[i]];
+		// Nor with how much of its buffers a kernel gets to touch.
+		if (r->numwork > buffers[i]->size / sizeof(uint32_t))
+			return -1;
+	}
+	uint8_t pc[GRAPH_MAXPC];
+	memcpy(pc, r->pc, r->pcsz);
+	const int wc = serve_wordcount(name);
+	if (wc >= 0 && wc + sizeof(uint32_t) <= r->pcsz)
+	{
+		uint32_t n;
+		memcpy(&n, pc + wc, sizeof(n));
+		if (n > r->numwork)
+			n = (uint32_t) r->numwork;
+		memcpy(pc + wc, &n, sizeof(n));
+	}
+	// Buffers that hold a copy need to be brought in step with the shared memory, both ways. Free when zero-copy.
+	for (uint32_t i=0; i<r->numbuffers; ++i)
+		if (mvk_buffer_push(buffers[i]) < 0)
+			return -1;
+	mvk_job_t* job = mvk_submit(c->ctx, (const mvk_kernel_t*) k, r->numwork, buffers, r->numbuffers, pc, r->pcsz, 0, 0);
+	if (!job)
+		return -1;
+	const int64_t ns = mvk_job_wait(job);
+	mvk_job_release(job);
+	for (uint32_t i=0; i<r->numbuffers; ++i)
+		if (mvk_buffer_pull(buffers[i]) < 0)
+			return -1;
+	return ns;
+}
+
+
+static void* serve_conn(void* arg)
+{
+	conn_t* c = arg;
+	for (;;)
+	{
+		request_t r;
+		union
+		{
+			struct cmsghdr align;
+			char buf[CMSG_SPACE(sizeof(int))];
+		} ctl;
+		struct iovec iov = { &r, sizeof(r) };
+		struct msghdr mh;
+		memset(&mh, 0, sizeof(mh));
+		mh.msg_iov = &iov;
+		mh.msg_iovlen = 1;
+		mh.msg_control = ctl.buf;
+		mh.msg_controllen = sizeof(ctl.buf);
+		const ssize_t n = recvmsg(c->fd, &mh, MSG_CMSG_CLOEXEC);
+		if (n <= 0)
+			break;
+		int fd = -1;
+		const struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+		if (cm && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS)
+			memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+
+		int64_t result = -1;
+		if (n == sizeof(r) && r.type == MSG_MAP)
+			result = serve_map(c, &r, fd);
+		else if (n == sizeof(r) && r.type == MSG_UNMAP && r.id < DAEMON_MAXBUFFERS && c->buffers[r.id])
+		{
+			mvk_buffer_destroy(c->buffers[r.id]);
+			c->buffers[r.id] = 0;
+			result = 0;
+		}
+		else if (n == sizeof(r) && r.type == MSG_RUN)
+			result = serve_run(c, &r);
+		if (fd >= 0)
+			close(fd);
+		c->numrequests++;
+		if (send(c->fd, &result, sizeof(result), MSG_NOSIGNAL) != sizeof(result))
+			break;
+	}
+	for (int i=0; i<DAEMON_MAXBUFFERS; ++i)
+		if (c->buffers[i])
+			mvk_buffer_destroy(c->buffers[i]);
+	pthread_mutex_lock(c->lock);
+	c->done = 1;
+	pthread_mutex_unlock(c->lock);
+	return 0;
+}
+
+
+// Join the threads of the clients that went away, or of all clients. Returns the requests they served.
+static uint64_t serve_reap(conn_t** conns, pthread_mutex_t* lock, int all)
+{
+	uint64_t numrequests = 0;
+	conn_t** pc = conns;
+	while (*pc)
+	{
+		conn_t* c = *pc;
+		pthread_mutex_lock(lock);
+		const int done = c->done;
+		pthread_mutex_unlock(lock);
+		if (!done && !all)
+		{
+			pc = &c->next;
+			continue;
+		}
+		if (!done)
+			shutdown(c->fd, SHUT_RDWR);
+		pthread_join(c->thread, 0);
+		close(c->fd);
+		numrequests += c->numrequests;
+		*pc = c->next;
+		free(c);
+	}
+	return numrequests;
+}
+
+
+int mvk_serve(mvk_context_t* ctx, const char* path, const char* fname)
+{
+	struct sockaddr_un sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa.sun_path))
+	{
+		fprintf(stderr, "Socket path %s is too long.\n", path);
+		return -1;
+	}
+	strcpy(sa.sun_path, path);
+	mvk_module_t* mod = mvk_module_load(ctx, fname);
+	if (!mod)
+		return -1;
+
+	// Packets keep the requests whole, and can carry a memfd along.
+	const int lfd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	assert(lfd >= 0);
+	unlink_socket(path);
+	if (bind(lfd, (const struct sockaddr*) &sa, sizeof(sa)) || listen(lfd, 64))
+	{
+		fprintf(stderr, "Cannot listen on %s: %s\n", path, strerror(errno));
+		close(lfd);
+		mvk_module_unload(mod);
+		return -1;
+	}
+
+	// Stop on a signal, without restarting the poll, so that the clients get let go, and the caches written.
+	struct sigaction act, oldint, oldterm;
+	memset(&act, 0, sizeof(act));
+	act.sa_handler = serve_signal;
+	sigemptyset(&act.sa_mask);
+	serve_stop = 0;
+	sigaction(SIGINT, &act, &oldint);
+	sigaction(SIGTERM, &act, &oldterm);
+	fprintf(stderr, "Serving the kernels of %s on %s, with %s.\n", fname, path, mvk_device_name(ctx));
+
+	pthread_mutex_t lock;
+	pthread_mutex_init(&lock, 0);
+	conn_t* conns = 0;
+	uint64_t numclients = 0, numrequests = 0;
+	while (!serve_stop)
+	{
+		struct pollfd pfd = { lfd, POLLIN, 0 };
+		const int res_poll = poll(&pfd, 1, 250);
+		numrequests += serve_reap(&conns, &lock, 0);
+		if (res_poll <= 0)
+			continue;
+		const int fd = accept4(lfd, 0, 0, SOCK_CLOEXEC);
+		if (fd < 0)
+			continue;
+		conn_t* c = calloc(1, sizeof(conn_t));
+		assert(c);
+		c->ctx = ctx;
+		c->mod = mod;
+		c->fd = fd;
+		c->lock = &lock;
+		c->next = conns;
+		conns = c;
+		const int res_pc = pthread_create(&c->thread, 0, serve_conn, c);
+		assert(res_pc == 0);
+		numclients++;
+	}
+	numrequests += serve_reap(&conns, &lock, 1);
+	pthread_mutex_destroy(&lock);
+	sigaction(SIGINT, &oldint, 0);
+	sigaction(SIGTERM, &oldterm, 0);
+	close(lfd);
+	unlink_socket(path);
+	mvk_module_unload(mod);
+	fprintf(stderr, "Served %lu requests of %lu clients.\n", (unsigned long) numrequests, (unsigned long) numclients);
+	return 0;
+}
+
+
+struct mvk_client
+{
+	int fd;
+	void* ptrs[DAEMON_MAXBUFFERS];	// The shared memory of the buffers, by id.
+	size_t sizes[DAEMON_MAXBUFFERS];
+};
+
+
+// Send a request, with a file descriptor if fd is not negative, and return the reply.
+static int64_t client_request(mvk_client_t* cl, const request_t* r, int fd)
+{
+	union
+	{
+		struct cmsghdr align;
+		char buf[CMSG_SPACE(sizeof(int))];
+	} ctl;
+	struct iovec iov = { (void*) r, sizeof(*r) };
+	struct msghdr mh;
+	memset(&mh, 0, sizeof(mh));
+	memset(&ctl, 0, sizeof(ctl));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	if (fd >= 0)
+	{
+		mh.msg_control = ctl.buf;
+		mh.msg_controllen = sizeof(ctl.buf);
+		struct cmsghdr* cm = CMSG_FIRSTHDR(&mh);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+	}
+	int64_t result = -1;
+	if (sendmsg(cl->fd, &mh, MSG_NOSIGNAL) != sizeof(*r) || recv(cl->fd, &result, sizeof(result), 0) != sizeof(result))
+		return -1;
+	return result;
+}
+
+
+mvk_client_t* mvk_client_connect(const char* path)
+{
+	struct sockaddr_un sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(sa.sun_path))
+		return 0;
+	strcpy(sa.sun_path, path);
+	const int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		return 0;
+	if (connect(fd, (const struct sockaddr*) &sa, sizeof(sa)))
+	{
+		fprintf(stderr, "Cannot connect to %s: %s\n", path, strerror(errno));
+		close(fd);
+		return 0;
+	}
+	mvk_client_t* cl = calloc(1, sizeof(mvk_client_t));
+	assert(cl);
+	cl->fd = fd;
+	return cl;
+}
+
+
+void mvk_client_close(mvk_client_t* cl)
+{
+	// The daemon lets go of the buffers when the connection goes.
+	close(cl->fd);
+	for (int i=0; i<DAEMON_MAXBUFFERS; ++i)
+		if (cl->ptrs[i])
+			munmap(cl->ptrs[i], cl->sizes[i]);
+	free(cl);
+}
+
+
+void* mvk_client_alloc(mvk_client_t* cl, size_t size, int* id)
+{
+	// Whole pages, so that the daemon can import them as they are.
+	const size_t pagesz = sysconf(_SC_PAGESIZE);
+	size = (size + pagesz - 1) / pagesz * pagesz;
+	const int fd = memfd_create("mvk", MFD_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	void* ptr = ftruncate(fd, size) ? MAP_FAILED : mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED)
+	{
+		close(fd);
+		return 0;
+	}
+	request_t r;
+	memset(&r, 0, sizeof(r));
+	r.type = MSG_MAP;
+	r.size = size;
+	const int64_t res = client_request(cl, &r, fd);
+	close(fd);
+	if (res < 0 || res >= DAEMON_MAXBUFFERS)
+	{
+		munmap(ptr, size);
+		return 0;
+	}
+	cl->ptrs[res] = ptr;
+	cl->sizes[res] = size;
+	*id = (int) res;
+	return ptr;
+}
+
+
+void mvk_client_free(mvk_client_t* cl, int id)
+{
+	assert(id >= 0 && id < DAEMON_MAXBUFFERS && cl->ptrs[id]);
+	request_t r;
+	memset(&r, 0, sizeof(r));
+	r.type = MSG_UNMAP;
+	r.id = id;
+	client_request(cl, &r, -1);
+	munmap(cl->ptrs[id], cl->sizes[id]);
+	cl->ptrs[id] = 0;
+}
+
+
+int64_t mvk_client_run(mvk_client_t* cl, const char* kernel, size_t numwork, const int* ids, uint32_t numids, const void* pc, uint32_t pcsz)
+{
+	if (strlen(kernel) >= MAXNAMELEN || numids > MAXARGS || pcsz > GRAPH_MAXPC)
+		return -1;
+	request_t r;
+	memset(&r, 0, sizeof(r));
+	r.type = MSG_RUN;
+	strcpy(r.kernel, kernel);
+	r.numwork = numwork;
+	r.numbuffers = numids;
+	for (uint32_t i=0; i<numids; ++i)
+		r.buffers[i] = ids[i];
+	r.pcsz = pcsz;
+	if (pcsz)
+		memcpy(r.pc, pc, pcsz);
+	return client_request(cl, &r, -1);
+}
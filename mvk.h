@@ -0,0 +1,293 @@
+// mvk.h
+//
+// A small library for Vulkan compute, with a context that keeps the device and the pipelines alive across jobs.
+//
+// A context, and its buffers, modules and jobs, can be used from any thread. Two threads should not fill or
+// read the same buffer at once.
+
+#ifndef MVK_H
+#define MVK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct mvk_context mvk_context_t;
+typedef struct mvk_buffer mvk_buffer_t;
+typedef struct mvk_module mvk_module_t;
+typedef struct mvk_kernel mvk_kernel_t;
+typedef struct mvk_job mvk_job_t;
+typedef struct mvk_graph mvk_graph_t;
+typedef struct mvk_prims mvk_prims_t;
+typedef struct mvk_client mvk_client_t;
+typedef struct mvk_batcher mvk_batcher_t;
+
+// Called on a thread of the context's pool once a job is done, before waiters are woken up.
+typedef void (*mvk_callback_t)(mvk_job_t* job, void* user);
+
+// Create a context on device devnr, or on the preferred device if devnr is -1. Returns 0 if there is no such device,
+// or it can not be made.
+mvk_context_t* mvk_create(int devnr);
+
+// Wait for all jobs, and destroy the context. All buffers and modules must be destroyed first.
+void mvk_destroy(mvk_context_t* ctx);
+
+const char* mvk_device_name(const mvk_context_t* ctx);
+
+// The number of devices that mvk_create() can pick from.
+int mvk_device_count(void);
+
+// Returns 0 if there is no memory for it.
+mvk_buffer_t* mvk_buffer_create(mvk_context_t* ctx, size_t size);
+void mvk_buffer_destroy(mvk_buffer_t* buf);
+size_t mvk_buffer_size(const mvk_buffer_t* buf);
+
+// Wrap host memory in a buffer. With VK_EXT_external_memory_host, and ptr and size aligned to a page, the device
+// uses the memory itself. Otherwise the buffer holds a copy, which mvk_buffer_push() and mvk_buffer_pull()
+// bring in step with the host memory. The memory must outlive the buffer. Returns 0 if there is no memory for the copy.
+mvk_buffer_t* mvk_buffer_import(mvk_context_t* ctx, void* ptr, size_t size);
+
+// Map a file, and import it like mvk_buffer_import(). To write a new file, size it with ftruncate() first.
+// Returns 0 if it can not be mapped or imported.
+mvk_buffer_t* mvk_buffer_map_file(mvk_context_t* ctx, const char* fname, int writable);
+
+// Returns 1 if the device uses the host memory of an imported buffer, and 0 if it uses a copy.
+int mvk_buffer_is_zero_copy(const mvk_buffer_t* buf);
+
+// Copy the host memory of an imported buffer to its copy, or back. Free for a zero-copy import.
+// These, and the copies below, return 0, or -1 if there is no memory to stage the copy in, or it can not be submitted.
+// Staged copies run on the transfer queue, so that they need not wait for the jobs on the compute queues.
+int mvk_buffer_push(mvk_buffer_t* buf);
+int mvk_buffer_pull(mvk_buffer_t* buf);
+
+// Copy host data into, or out of, a buffer. Blocks until the copy is done. A write marks its range as dirty.
+int mvk_buffer_write(mvk_buffer_t* buf, size_t offset, const void* data, size_t size);
+int mvk_buffer_read(const mvk_buffer_t* buf, size_t offset, void* data, size_t size);
+
+// A buffer keeps a few ranges that changed, in whole nonCoherentAtomSize atoms. Marks stay until the buffer is
+// cleaned. Mark what the host changed in the memory of an imported buffer, or forget all marks.
+void mvk_buffer_mark_dirty(mvk_buffer_t* buf, size_t offset, size_t size);
+void mvk_buffer_clean(mvk_buffer_t* buf);
+
+// The number of bytes in the dirty ranges of a buffer.
+size_t mvk_buffer_dirty_size(const mvk_buffer_t* buf);
+
+// Like mvk_buffer_push() and mvk_buffer_pull(), but copy, flush and invalidate only the dirty ranges.
+int mvk_buffer_push_dirty(mvk_buffer_t* buf);
+int mvk_buffer_pull_dirty(mvk_buffer_t* buf);
+
+// Load the kernels of a SPIR-V file made by clspv, and apply the tuning results of the device. Returns 0 if the file
+// can not be read, or has no kernels that the device can run.
+mvk_module_t* mvk_module_load(mvk_context_t* ctx, const char* fname);
+void mvk_module_unload(mvk_module_t* mod);
+
+// Look up a kernel by name. Gets its fastest variant, if it was tuned. Returns 0 if there is no such kernel, or if it
+// takes __local args, pointers in uniform buffers, or module scope constant data, which can not be bound.
+const mvk_kernel_t* mvk_kernel(const mvk_module_t* mod, const char* name);
+
+const char* mvk_kernel_name(const mvk_kernel_t* kernel);
+uint32_t mvk_kernel_wgsz(const mvk_kernel_t* kernel);
+
+// Start a kernel over numwork words, with one buffer per binding, and the push constants in pc.
+// The kernel should skip the work items of a partial last work group, like foo does, with the number of words in pc.
+// A job that is too large for one dispatch gets split into windows on the storage buffers that hold numwork words.
+// A partial last group of a window needs robustBufferAccess, which MVK_ROBUST enables, or buffers with room for it.
+// A kernel that clspv compiled with -physical-storage-buffers gets its buffers by address. The library fills the
+// addresses in, so pc may leave them off, and its windows always need room for a partial last work group.
+// Returns at once, or 0 if the job can not be run. The callback, if any, is called when the job is done.
+mvk_job_t* mvk_submit
+(
+	mvk_context_t* ctx,
+	const mvk_kernel_t* kernel,
+	size_t numwork,
+	mvk_buffer_t* const* buffers,
+	uint32_t numbuffers,
+	const void* pc,
+	uint32_t pcsz,
+	mvk_callback_t callback,
+	void* user
+);
+
+// Like mvk_submit(), but run only the work groups over the dirty ranges of the buffers that hold numwork words, for a
+// kernel whose word i depends only on word i of its buffers. What they cover gets marked as dirty in those buffers,
+// so that mvk_buffer_pull_dirty() brings back the results. Nothing runs if nothing is dirty.
+mvk_job_t* mvk_submit_dirty
+(
+	mvk_context_t* ctx,
+	const mvk_kernel_t* kernel,
+	size_t numwork,
+	mvk_buffer_t* const* buffers,
+	uint32_t numbuffers,
+	const void* pc,
+	uint32_t pcsz,
+	mvk_callback_t callback,
+	void* user
+);
+
+// A graph of dispatches and copies, that gets recorded into one command buffer and submitted as one job.
+// A node depends on the earlier nodes that write a buffer that it uses, or that use a buffer that it writes.
+// Nodes that do not depend on each other run without a barrier between them, and may overlap.
+mvk_graph_t* mvk_graph_create(mvk_context_t* ctx);
+void mvk_graph_destroy(mvk_graph_t* graph);
+
+// Add a dispatch, like mvk_submit(). Bit i of writes is set if the kernel writes buffers[i].
+// Returns the number of the node, or -1 if it does not fit in the graph, or the buffers or push constants do not
+// match the kernel.
+int mvk_graph_dispatch
+(
+	mvk_graph_t* graph,
+	const mvk_kernel_t* kernel,
+	size_t numwork,
+	mvk_buffer_t* const* buffers,
+	uint32_t numbuffers,
+	uint32_t writes,
+	const void* pc,
+	uint32_t pcsz
+);
+
+// Add a dispatch like mvk_submit_dirty(), that marks only the buffers it writes. Its tiles are picked from the dirty
+// ranges when it is added, and get marked each time that the graph is submitted.
+int mvk_graph_dispatch_dirty
+(
+	mvk_graph_t* graph,
+	const mvk_kernel_t* kernel,
+	size_t numwork,
+	mvk_buffer_t* const* buffers,
+	uint32_t numbuffers,
+	uint32_t writes,
+	const void* pc,
+	uint32_t pcsz
+);
+
+// Add a copy of size bytes between buffers. Returns the number of the node, or -1 if it does not fit in the graph.
+int mvk_graph_copy(mvk_graph_t* graph, mvk_buffer_t* src, size_t srcoffset, mvk_buffer_t* dst, size_t dstoffset, size_t size);
+
+// Record the graph and submit it, like mvk_submit(). The graph can be submitted again, or changed, right after.
+mvk_job_t* mvk_graph_submit(mvk_graph_t* graph, mvk_callback_t callback, void* user);
+
+// Returns 1 if the job is done, 0 if not.
+int mvk_job_poll(mvk_job_t* job);
+
+// Blocks until the job is done, and its callback has returned. Returns the time it took on the GPU, in ns.
+int64_t mvk_job_wait(mvk_job_t* job);
+
+// Give the job back. If it is not done yet, that happens when it is. Safe to call from its callback.
+void mvk_job_release(mvk_job_t* job);
+
+// Called on the thread of a batcher once a job of it is done, and its results are in place.
+typedef void (*mvk_batch_callback_t)(void* user);
+
+// Pack many small jobs into arenas of arenasz bytes, and run them as one dispatch per batch, with a kernel like
+// foo_batch in foo.cl, that takes a POD, a table, a source and a destination. A batch is submitted when it holds
+// maxbatch jobs, when its arenas are full, or when its first job has waited maxlatency ns, whichever comes first.
+// Returns 0 if the kernel does not take a batch, or the arenas do not hold a work group. If a batch can not be run,
+// its jobs get their callback with dst left as it was.
+mvk_batcher_t* mvk_batcher_create(mvk_context_t* ctx, const mvk_kernel_t* kernel, size_t arenasz, uint32_t maxbatch, int64_t maxlatency);
+
+// Finish all jobs, and destroy the batcher.
+void mvk_batcher_destroy(mvk_batcher_t* batcher);
+
+// Add a job over numwords words of src, that get written to dst, with param for the kernel. Can be called from
+// any thread, and copies src before it returns. Blocks while all batches are in flight. Returns -1 if the job does
+// not fit in the arenas.
+int mvk_batcher_add(mvk_batcher_t* batcher, const uint32_t* src, uint32_t* dst, size_t numwords, uint32_t param, mvk_batch_callback_t callback, void* user);
+
+// Submit the open batch now, and wait for all jobs that were added so far.
+void mvk_batcher_flush(mvk_batcher_t* batcher);
+
+// The number of jobs that were added so far, and of the batches that were submitted.
+void mvk_batcher_stats(mvk_batcher_t* batcher, uint64_t* numjobs, uint64_t* numbatches);
+
+// Parallel primitives over buffers of uint32_t words, with the kernels of prims.cl, in the SPIR-V file fname.
+// Their scratch buffers are shared by the calls, so a prims should not be used by two threads at once.
+// Each call runs its passes as one job, and returns when it is done, or -1 if the buffers do not hold n words, or
+// the kernels do not take the args of prims.cl. mvk_prims_create returns 0 if fname does not load, or lacks a kernel.
+mvk_prims_t* mvk_prims_create(mvk_context_t* ctx, const char* fname);
+void mvk_prims_destroy(mvk_prims_t* prims);
+
+// The sum of the first n words of src, modulo 2^32.
+int64_t mvk_reduce_add(mvk_prims_t* prims, mvk_buffer_t* src, size_t n);
+
+// The prefix sums of the first n words of src, into dst, which may be src. Inclusive or exclusive.
+int mvk_scan_add(mvk_prims_t* prims, mvk_buffer_t* src, mvk_buffer_t* dst, size_t n, int inclusive);
+
+// Copy the words of the first n of src for which (word & msk) == cmp to dst, in order. Returns how many there are.
+int64_t mvk_compact(mvk_prims_t* prims, mvk_buffer_t* src, mvk_buffer_t* dst, size_t n, uint32_t msk, uint32_t cmp);
+
+// Sort the first n words of keys in place, in ascending order, with a radix sort. If vals is not 0, its first n words
+// move along with the keys. The sort is stable. Scratch of the size of keys and vals is kept for the next sort.
+int mvk_sort(mvk_prims_t* prims, mvk_buffer_t* keys, mvk_buffer_t* vals, size_t n);
+
+// Serve the kernels of the SPIR-V file fname to clients on the Unix domain socket path, until SIGINT or SIGTERM.
+// Every client gets a thread of its own. Returns -1 if it can not listen on path.
+int mvk_serve(mvk_context_t* ctx, const char* path, const char* fname);
+
+// A client of mvk_serve(), on another process. Returns 0 if there is no daemon on path.
+mvk_client_t* mvk_client_connect(const char* path);
+void mvk_client_close(mvk_client_t* cl);
+
+// Shared memory of at least size bytes, that the daemon maps too, and uses as a buffer. Its id goes in id.
+// Returns 0 on failure.
+void* mvk_client_alloc(mvk_client_t* cl, size_t size, int* id);
+void mvk_client_free(mvk_client_t* cl, int id);
+
+// Run a kernel of the daemon, like mvk_submit(), on the buffers with the given ids, and wait for it.
+// The results are in the shared memory when it returns. Returns the time it took on the GPU in ns, or -1 on failure,
+// which includes numwork words not fitting in every buffer. The daemon clamps the n of the foo kernels to numwork.
+int64_t mvk_client_run(mvk_client_t* cl, const char* kernel, size_t numwork, const int* ids, uint32_t numids, const void* pc, uint32_t pcsz);
+
+// Writes the input for words [firstword, firstword+numwords) of a stream, or takes their output.
+typedef void (*mvk_chunk_fn)(void* user, size_t firstword, uint32_t* data, size_t numwords);
+
+// Stream numwords words through a kernel that takes an input and an output buffer, chunkwords at a time, with
+// numslots chunks in flight. While chunk i is being computed, chunk i+1 is uploaded and chunk i-1 is read back.
+// Every chunk is padded with zeros to whole work groups, and gets the same pc, so a kernel like foo gets chunkwords
+// as its number of words. Returns the time it took, and the part of that the host spent in produce and consume in
+// hostns, or -1 if the kernel or the chunks do not fit, or there is no memory for the slots.
+int64_t mvk_stream
+(
+	mvk_context_t* ctx,
+	const mvk_kernel_t* kernel,
+	size_t numwords,
+	size_t chunkwords,
+	uint32_t numslots,
+	const void* pc,
+	uint32_t pcsz,
+	mvk_chunk_fn produce,
+	mvk_chunk_fn consume,
+	void* user,
+	int64_t* hostns
+);
+
+// The fastest of a few runs of a variant of a kernel, with a work group size.
+typedef struct
+{
+	char variant[64];
+	uint32_t wgsz;
+	int64_t ns;
+} mvk_timing_t;
+
+// Time the kernel name and its variants, over the work group sizes they can be specialized for, with jobs like
+// mvk_submit(). The fastest gets used from then on, and saved for the device. Fills in up to maxtimings timings,
+// and returns how many, or -1 if there is no such kernel, or no variant fits the job.
+int mvk_tune
+(
+	mvk_module_t* mod,
+	const char* name,
+	size_t numwork,
+	mvk_buffer_t* const* buffers,
+	uint32_t numbuffers,
+	const void* pc,
+	uint32_t pcsz,
+	mvk_timing_t* timings,
+	uint32_t maxtimings
+);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
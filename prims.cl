@@ -0,0 +1,381 @@
+// Parallel primitives over uint32_t words: reduce, scan, stream compaction and radix sort.
+//
+// They are built from a few passes, each with at most WGSZ work groups, so that the sums of
+// all groups fit in a single group for the pass that combines them.
+
+#define uint32_t	uint
+
+#if !defined(WGSZ)
+#define WGSZ	256
+#endif
+
+#define KERNEL	__kernel __attribute__((reqd_work_group_size(WGSZ, 1, 1)))
+
+
+// The sum of v over the work group, for all its work items.
+static uint32_t group_reduce(uint32_t v, __local uint32_t* tmp)
+{
+	const uint32_t l = get_local_id(0);
+	tmp[l] = v;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint32_t s=WGSZ/2; s>0; s>>=1)
+	{
+		if (l < s)
+			tmp[l] += tmp[l+s];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	const uint32_t sum = tmp[0];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return sum;
+}
+
+
+// The inclusive prefix sum of v over the work group, and the sum of it all in total.
+static uint32_t group_scan(uint32_t v, __local uint32_t* tmp, uint32_t* total)
+{
+	const uint32_t l = get_local_id(0);
+	tmp[l] = v;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (uint32_t s=1; s<WGSZ; s<<=1)
+	{
+		const uint32_t add = l >= s ? tmp[l-s] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		tmp[l] += add;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	const uint32_t incl = tmp[l];
+	*total = tmp[WGSZ-1];
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return incl;
+}
+
+
+// Every group adds up a grid-strided share of the n words of src, into partial[group].
+KERNEL void reduce_add
+(
+	uint32_t n,
+	__global const uint32_t* __restrict__ src,
+	__global uint32_t* __restrict__ partial
+)
+{
+	__local uint32_t tmp[WGSZ];
+	uint32_t sum = 0;
+	for (uint32_t i=get_global_id(0); i<n; i+=get_global_size(0))
+		sum += src[i];
+	sum = group_reduce(sum, tmp);
+	if (get_local_id(0) == 0)
+		partial[get_group_id(0)] = sum;
+}
+
+
+#if defined(cl_khr_subgroups)
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+
+// The sum of v over the work group, by subgroup operations. Only valid in work item 0.
+static uint32_t group_reduce_sg(uint32_t v, __local uint32_t* tmp)
+{
+	v = sub_group_reduce_add(v);
+	if (get_sub_group_local_id() == 0)
+		tmp[get_sub_group_id()] = v;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	uint32_t sum = 0;
+	if (get_local_id(0) == 0)
+		for (uint32_t i=0; i<get_num_sub_groups(); ++i)
+			sum += tmp[i];
+	return sum;
+}
+
+
+// Same as reduce_add, with the groups reduced by subgroups, rather than through local memory.
+KERNEL void reduce_add_sg
+(
+	uint32_t n,
+	__global const uint32_t* __restrict__ src,
+	__global uint32_t* __restrict__ partial
+)
+{
+	__local uint32_t tmp[WGSZ];
+	uint32_t sum = 0;
+	for (uint32_t i=get_global_id(0); i<n; i+=get_global_size(0))
+		sum += src[i];
+	sum = group_reduce_sg(sum, tmp);
+	if (get_local_id(0) == 0)
+		partial[get_group_id(0)] = sum;
+}
+#endif
+
+
+// Pass 1 of a scan: every group adds up its block of blocksz words of src, into sums[group].
+KERNEL void scan_reduce
+(
+	uint32_t n,
+	uint32_t blocksz,
+	__global const uint32_t* __restrict__ src,
+	__global uint32_t* __restrict__ sums
+)
+{
+	__local uint32_t tmp[WGSZ];
+	const uint32_t first = get_group_id(0) * blocksz;
+	const uint32_t last = min(first + blocksz, n);
+	uint32_t sum = 0;
+	for (uint32_t i=first+get_local_id(0); i<last; i+=WGSZ)
+		sum += src[i];
+	sum = group_reduce(sum, tmp);
+	if (get_local_id(0) == 0)
+		sums[get_group_id(0)] = sum;
+}
+
+
+// Pass 2 of a scan, or a compaction: an exclusive scan of the sums of numgroups groups, in place,
+// followed by their total. Runs as a single group.
+KERNEL void scan_sums
+(
+	uint32_t numgroups,
+	__global uint32_t* sums
+)
+{
+	__local uint32_t tmp[WGSZ];
+	const uint32_t l = get_local_id(0);
+	const uint32_t v = l < numgroups ? sums[l] : 0;
+	uint32_t total;
+	const uint32_t incl = group_scan(v, tmp, &total);
+	if (l < numgroups)
+		sums[l] = incl - v;
+	if (l == 0)
+		sums[numgroups] = total;
+}
+
+
+// Pass 3 of a scan: every group scans its block of src into dst, WGSZ words at a time, starting at the sum of
+// the blocks before it. The scan is inclusive or exclusive. src and dst may be the same buffer.
+KERNEL void scan_block
+(
+	uint32_t n,
+	uint32_t blocksz,
+	uint32_t inclusive,
+	__global const uint32_t* src,
+	__global const uint32_t* __restrict__ sums,
+	__global uint32_t* dst
+)
+{
+	__local uint32_t tmp[WGSZ];
+	const uint32_t first = get_group_id(0) * blocksz;
+	const uint32_t last = min(first + blocksz, n);
+	uint32_t carry = sums[get_group_id(0)];
+	for (uint32_t base=first; base<last; base+=WGSZ)
+	{
+		const uint32_t i = base + get_local_id(0);
+		const uint32_t v = i < last ? src[i] : 0;
+		uint32_t total;
+		const uint32_t incl = group_scan(v, tmp, &total);
+		if (i < last)
+			dst[i] = carry + (inclusive ? incl : incl - v);
+		carry += total;
+	}
+}
+
+
+// A compaction keeps the words for which this holds.
+#define KEEP(V)	(((V) & msk) == cmp)
+
+// Pass 1 of a compaction: every group counts the words to keep in its block of src, into sums[group].
+KERNEL void compact_count
+(
+	uint32_t n,
+	uint32_t blocksz,
+	uint32_t msk,
+	uint32_t cmp,
+	__global const uint32_t* __restrict__ src,
+	__global uint32_t* __restrict__ sums
+)
+{
+	__local uint32_t tmp[WGSZ];
+	const uint32_t first = get_group_id(0) * blocksz;
+	const uint32_t last = min(first + blocksz, n);
+	uint32_t count = 0;
+	for (uint32_t i=first+get_local_id(0); i<last; i+=WGSZ)
+		count += KEEP(src[i]) ? 1 : 0;
+	count = group_reduce(count, tmp);
+	if (get_local_id(0) == 0)
+		sums[get_group_id(0)] = count;
+}
+
+
+// Pass 3 of a compaction: every group writes the words to keep in its block to dst, in order,
+// after those of the blocks before it.
+KERNEL void compact_block
+(
+	uint32_t n,
+	uint32_t blocksz,
+	uint32_t msk,
+	uint32_t cmp,
+	__global const uint32_t* __restrict__ src,
+	__global const uint32_t* __restrict__ sums,
+	__global uint32_t* __restrict__ dst
+)
+{
+	__local uint32_t tmp[WGSZ];
+	const uint32_t first = get_group_id(0) * blocksz;
+	const uint32_t last = min(first + blocksz, n);
+	uint32_t carry = sums[get_group_id(0)];
+	for (uint32_t base=first; base<last; base+=WGSZ)
+	{
+		const uint32_t i = base + get_local_id(0);
+		const uint32_t v = i < last ? src[i] : 0;
+		const uint32_t keep = (i < last && KEEP(v)) ? 1 : 0;
+		uint32_t total;
+		const uint32_t incl = group_scan(keep, tmp, &total);
+		if (keep)
+			dst[carry + incl - 1] = v;
+		carry += total;
+	}
+}
+
+
+// A radix sort goes over the keys RADIX_BITS at a time, from the least significant digit up.
+#define RADIX_BITS	4
+#define RADIX		(1 << RADIX_BITS)
+
+// Pass 1 of a radix sort: every group counts the digits at shift of the keys in its block. The counts go
+// digit-major into hist, at hist[digit * numgroups + group], so that a scan of hist gives where they all go.
+KERNEL void sort_count
+(
+	uint32_t n,
+	uint32_t blocksz,
+	uint32_t shift,
+	__global const uint32_t* __restrict__ keys,
+	__global uint32_t* __restrict__ hist
+)
+{
+	__local uint32_t cnt[RADIX];
+	const uint32_t l = get_local_id(0);
+	if (l < RADIX)
+		cnt[l] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	const uint32_t first = get_group_id(0) * blocksz;
+	const uint32_t last = min(first + blocksz, n);
+	for (uint32_t i=first+l; i<last; i+=WGSZ)
+		atomic_inc(cnt + ((keys[i] >> shift) & (RADIX-1)));
+	barrier(CLK_LOCAL_MEM_FENCE);
+	if (l < RADIX)
+		hist[l * get_num_groups(0) + get_group_id(0)] = cnt[l];
+}
+
+
+// Pass 2 of a radix sort: an exclusive scan of the RADIX * numgroups counts of hist, in place. Runs as a single group.
+KERNEL void sort_offsets
+(
+	uint32_t numgroups,
+	__global uint32_t* hist
+)
+{
+	__local uint32_t tmp[WGSZ];
+	const uint32_t n = RADIX * numgroups;
+	uint32_t carry = 0;
+	for (uint32_t base=0; base<n; base+=WGSZ)
+	{
+		const uint32_t i = base + get_local_id(0);
+		const uint32_t v = i < n ? hist[i] : 0;
+		uint32_t total;
+		const uint32_t incl = group_scan(v, tmp, &total);
+		if (i < n)
+			hist[i] = carry + incl - v;
+		carry += total;
+	}
+}
+
+
+// Where the key goes that has digit in a chunk of WGSZ keys, with the keys of the same digit in the order they came,
+// after the places in offs. Two digits are ranked per scan, in the halves of a word, as a chunk has at most WGSZ of each.
+// Moves offs past the keys of the chunk.
+static uint32_t sort_position(uint32_t digit, uint32_t valid, __local uint32_t* tmp, __local uint32_t* offs)
+{
+	const uint32_t half = (digit & 1) * 16;
+	uint32_t pos = 0;
+	for (uint32_t d=0; d<RADIX/2; ++d)
+	{
+		const uint32_t flag = (valid && (digit >> 1) == d) ? (1U << half) : 0;
+		uint32_t total;
+		const uint32_t incl = group_scan(flag, tmp, &total);
+		if (flag)
+			pos = offs[digit] + ((incl >> half) & 0xffff) - 1;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		if (get_local_id(0) == 0)
+		{
+			offs[2*d+0] += total & 0xffff;
+			offs[2*d+1] += total >> 16;
+		}
+	}
+	return pos;
+}
+
+
+// The offsets of the digits of this group, from the scanned hist.
+static void sort_offs(__global const uint32_t* hist, __local uint32_t* offs)
+{
+	const uint32_t l = get_local_id(0);
+	if (l < RADIX)
+		offs[l] = hist[l * get_num_groups(0) + get_group_id(0)];
+	barrier(CLK_LOCAL_MEM_FENCE);
+}
+
+
+// Pass 3 of a radix sort: every group moves the keys of its block to their place in dst, in a stable way.
+KERNEL void sort_scatter
+(
+	uint32_t n,
+	uint32_t blocksz,
+	uint32_t shift,
+	__global const uint32_t* __restrict__ keys,
+	__global const uint32_t* __restrict__ hist,
+	__global uint32_t* __restrict__ dst
+)
+{
+	__local uint32_t tmp[WGSZ];
+	__local uint32_t offs[RADIX];
+	sort_offs(hist, offs);
+	const uint32_t first = get_group_id(0) * blocksz;
+	const uint32_t last = min(first + blocksz, n);
+	for (uint32_t base=first; base<last; base+=WGSZ)
+	{
+		const uint32_t i = base + get_local_id(0);
+		const uint32_t valid = i < last;
+		const uint32_t key = valid ? keys[i] : 0;
+		const uint32_t pos = sort_position((key >> shift) & (RADIX-1), valid, tmp, offs);
+		if (valid)
+			dst[pos] = key;
+	}
+}
+
+
+// Same as sort_scatter, with a value that goes along with every key.
+KERNEL void sort_scatter_kv
+(
+	uint32_t n,
+	uint32_t blocksz,
+	uint32_t shift,
+	__global const uint32_t* __restrict__ keys,
+	__global const uint32_t* __restrict__ vals,
+	__global const uint32_t* __restrict__ hist,
+	__global uint32_t* __restrict__ dstkeys,
+	__global uint32_t* __restrict__ dstvals
+)
+{
+	__local uint32_t tmp[WGSZ];
+	__local uint32_t offs[RADIX];
+	sort_offs(hist, offs);
+	const uint32_t first = get_group_id(0) * blocksz;
+	const uint32_t last = min(first + blocksz, n);
+	for (uint32_t base=first; base<last; base+=WGSZ)
+	{
+		const uint32_t i = base + get_local_id(0);
+		const uint32_t valid = i < last;
+		const uint32_t key = valid ? keys[i] : 0;
+		const uint32_t pos = sort_position((key >> shift) & (RADIX-1), valid, tmp, offs);
+		if (valid)
+		{
+			dstkeys[pos] = key;
+			dstvals[pos] = vals[i];
+		}
+	}
+}